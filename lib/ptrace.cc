@@ -1,4 +1,9 @@
 #include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <atomic>
+#include <new>
 
 #include "perfetto.h"
 
@@ -8,25 +13,132 @@
 #define _STR(s) #s
 #define STR(s)  _STR(s)
 
+#ifdef PTRACE_WITH_SDT
+/*
+ * USDT probes, e.g.: bpftrace -e 'usdt:libptrace.so:ptrace:begin {...}'
+ *
+ * Every probe has a semaphore, the arguments are only marshalled while a
+ * tracer is attached to it.
+ */
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+#define PTRACE_SDT_SEMAPHORE(probe) \
+    __extension__ unsigned short ptrace_##probe##_semaphore \
+    __attribute__((unused)) __attribute__((section(".probes")))
+
+PTRACE_SDT_SEMAPHORE(begin);
+PTRACE_SDT_SEMAPHORE(end);
+PTRACE_SDT_SEMAPHORE(counter);
+
+#define PTRACE_SDT_ENABLED(probe) \
+    __builtin_expect(ptrace_##probe##_semaphore, 0)
+
+/* begin(category, name) */
+#define PTRACE_SDT_BEGIN(cat, name) \
+    do { \
+        if (PTRACE_SDT_ENABLED(begin)) \
+            STAP_PROBE2(ptrace, begin, #cat, name); \
+    } while (0)
+
+/* end(category, name), name is NULL for PTRACE_END() */
+#define PTRACE_SDT_END(cat, name) \
+    do { \
+        if (PTRACE_SDT_ENABLED(end)) \
+            STAP_PROBE2(ptrace, end, #cat, name); \
+    } while (0)
+
+/* counter(category, track, value), the value is truncated to int64 */
+#define PTRACE_SDT_COUNTER(cat, track, val) \
+    do { \
+        if (PTRACE_SDT_ENABLED(counter)) \
+            STAP_PROBE3(ptrace, counter, #cat, track, (int64_t)(val)); \
+    } while (0)
+#else
+#define PTRACE_SDT_BEGIN(cat, name)
+#define PTRACE_SDT_END(cat, name)
+#define PTRACE_SDT_COUNTER(cat, track, val)
+#endif /* PTRACE_WITH_SDT */
+
+enum ptrace_state_e {
+    PTRACE_STATE_NONE = 0,  /* PTRACE_INIT() not called yet */
+    PTRACE_STATE_ARMED,     /* connect to traced at the first trace point */
+    PTRACE_STATE_RUNNING,   /* connected to traced */
+    PTRACE_STATE_FORKED,    /* forked from a connected process */
+};
+
+static std::atomic<int> ptrace_state(PTRACE_STATE_NONE);
+
+static bool ptrace_connect(void);
+
+#define PTRACE_ACTIVE() \
+    (__builtin_expect(PTRACE_STATE_RUNNING == \
+                      ptrace_state.load(std::memory_order_relaxed), 1) \
+     || ptrace_connect())
+
+/* a track whose uuid is the handle itself */
+#define PTRACE_TRACK(track) ::perfetto::Track(track, ::perfetto::Track())
+
+struct ptrace_fiber {
+    const char *name;
+    ptrace_track_t track;
+    bool switched;  /* the switch slice on the thread track is begun */
+};
+
+/* the fiber running on this thread, see ptrace_fiber_switch() */
+static thread_local struct ptrace_fiber *ptrace_fiber_cur;
+
+/* the track of the fiber running on this thread, 0 for the thread itself */
+#define PTRACE_CURRENT_TRACK() (ptrace_fiber_cur ? ptrace_fiber_cur->track : 0)
+
+#define PTRACE_EVENT_BEGIN(cat, name, track, ...) \
+    do { \
+        ptrace_track_t _track = (track); \
+        if (_track) \
+            TRACE_EVENT_BEGIN(#cat, ::perfetto::StaticString{name}, \
+                              PTRACE_TRACK(_track), ##__VA_ARGS__); \
+        else \
+            TRACE_EVENT_BEGIN(#cat, ::perfetto::StaticString{name}, \
+                              ##__VA_ARGS__); \
+    } while (0)
+
+#define PTRACE_EVENT_END(cat, track) \
+    do { \
+        ptrace_track_t _track = (track); \
+        if (_track) \
+            TRACE_EVENT_END(#cat, PTRACE_TRACK(_track)); \
+        else \
+            TRACE_EVENT_END(#cat); \
+    } while (0)
+
 #define PTRACE_DEFINE_BEGIN_FUNC(cat) \
 _PTRACE_BEGIN_FUNC(cat) \
 {\
-    TRACE_EVENT_BEGIN(#cat, ::perfetto::StaticString{name});\
+    PTRACE_SDT_BEGIN(cat, name);\
+    if (!PTRACE_ACTIVE())\
+        return name;\
+    PTRACE_EVENT_BEGIN(cat, name, PTRACE_CURRENT_TRACK());\
     return name;\
 }
 
 #define PTRACE_DEFINE_BEGIN_FUNC_1(cat, type) \
 _PTRACE_BEGIN_FUNC_1(cat, type) \
 {\
-    TRACE_EVENT_BEGIN(#cat, ::perfetto::StaticString{name}, arg, val);\
+    PTRACE_SDT_BEGIN(cat, name);\
+    if (!PTRACE_ACTIVE())\
+        return name;\
+    PTRACE_EVENT_BEGIN(cat, name, PTRACE_CURRENT_TRACK(), arg, val);\
     return name;\
 }
 
 #define PTRACE_DEFINE_BEGIN_FUNC_2(cat, type1, type2) \
 _PTRACE_BEGIN_FUNC_2(cat, type1, type2) \
 {\
-    TRACE_EVENT_BEGIN(#cat, ::perfetto::StaticString{name}, \
-                      arg1, val1, arg2, val2);\
+    PTRACE_SDT_BEGIN(cat, name);\
+    if (!PTRACE_ACTIVE())\
+        return name;\
+    PTRACE_EVENT_BEGIN(cat, name, PTRACE_CURRENT_TRACK(), \
+                       arg1, val1, arg2, val2);\
     return name;\
 }
 
@@ -34,37 +146,88 @@ _PTRACE_BEGIN_FUNC_2(cat, type1, type2) \
 _PTRACE_END_FUNC(cat) \
 {\
     (void)dummy; \
-    TRACE_EVENT_END(#cat);\
+    PTRACE_SDT_END(cat, dummy ? *dummy : NULL);\
+    if (!PTRACE_ACTIVE())\
+        return;\
+    PTRACE_EVENT_END(cat, PTRACE_CURRENT_TRACK());\
 }
 
 #define PTRACE_DEFINE_COUNTER_FUNC(cat, type) \
 _PTRACE_COUNTER_FUNC(cat, type) \
 {\
+    PTRACE_SDT_COUNTER(cat, track, val);\
+    if (!PTRACE_ACTIVE())\
+        return;\
     TRACE_COUNTER(#cat, track, val);\
 }
 
-#define PTRACE_DEFINE_FUNCS(cat)                \
-    PTRACE_DEFINE_BEGIN_FUNC(cat)               \
-    PTRACE_DEFINE_BEGIN_FUNC_1(cat, u32)        \
-    PTRACE_DEFINE_BEGIN_FUNC_1(cat, i32)        \
-    PTRACE_DEFINE_BEGIN_FUNC_1(cat, u64)        \
-    PTRACE_DEFINE_BEGIN_FUNC_1(cat, i64)        \
-    PTRACE_DEFINE_BEGIN_FUNC_1(cat, str)        \
-    PTRACE_DEFINE_BEGIN_FUNC_2(cat, i32, i32)   \
-    PTRACE_DEFINE_BEGIN_FUNC_2(cat, i32, u32)   \
-    PTRACE_DEFINE_BEGIN_FUNC_2(cat, u32, u32)   \
-    PTRACE_DEFINE_END_FUNC(cat)                 \
-    PTRACE_DEFINE_COUNTER_FUNC(cat, u32)        \
-    PTRACE_DEFINE_COUNTER_FUNC(cat, i32)        \
-    PTRACE_DEFINE_COUNTER_FUNC(cat, u64)        \
-    PTRACE_DEFINE_COUNTER_FUNC(cat, i64)        \
-    PTRACE_DEFINE_COUNTER_FUNC(cat, float)      \
-    PTRACE_DEFINE_COUNTER_FUNC(cat, double)
+#define PTRACE_DEFINE_BEGIN_TRACK_FUNC(cat) \
+_PTRACE_BEGIN_TRACK_FUNC(cat) \
+{\
+    PTRACE_SDT_BEGIN(cat, name);\
+    if (!PTRACE_ACTIVE())\
+        return track;\
+    if (!track)\
+        track = PTRACE_CURRENT_TRACK();\
+    PTRACE_EVENT_BEGIN(cat, name, track);\
+    return track;\
+}
+
+#define PTRACE_DEFINE_END_TRACK_FUNC(cat) \
+_PTRACE_END_TRACK_FUNC(cat) \
+{\
+    PTRACE_SDT_END(cat, (const char *)NULL);\
+    if (!PTRACE_ACTIVE())\
+        return;\
+    PTRACE_EVENT_END(cat, *track ? *track : PTRACE_CURRENT_TRACK());\
+}
+
+#define PTRACE_DEFINE_COUNTER_TRACK_FUNC(cat, type) \
+_PTRACE_COUNTER_TRACK_FUNC(cat, type) \
+{\
+    PTRACE_SDT_COUNTER(cat, name, val);\
+    if (!PTRACE_ACTIVE())\
+        return;\
+    if (track)\
+        TRACE_COUNTER(#cat, \
+                      ::perfetto::CounterTrack(name, PTRACE_TRACK(track)), \
+                      val);\
+    else\
+        TRACE_COUNTER(#cat, name, val);\
+}
+
+#define PTRACE_DEFINE_FUNCS(cat)                  \
+    PTRACE_DEFINE_BEGIN_FUNC(cat)                 \
+    PTRACE_DEFINE_BEGIN_FUNC_1(cat, u32)          \
+    PTRACE_DEFINE_BEGIN_FUNC_1(cat, i32)          \
+    PTRACE_DEFINE_BEGIN_FUNC_1(cat, u64)          \
+    PTRACE_DEFINE_BEGIN_FUNC_1(cat, i64)          \
+    PTRACE_DEFINE_BEGIN_FUNC_1(cat, str)          \
+    PTRACE_DEFINE_BEGIN_FUNC_2(cat, i32, i32)     \
+    PTRACE_DEFINE_BEGIN_FUNC_2(cat, i32, u32)     \
+    PTRACE_DEFINE_BEGIN_FUNC_2(cat, u32, u32)     \
+    PTRACE_DEFINE_END_FUNC(cat)                   \
+    PTRACE_DEFINE_COUNTER_FUNC(cat, u32)          \
+    PTRACE_DEFINE_COUNTER_FUNC(cat, i32)          \
+    PTRACE_DEFINE_COUNTER_FUNC(cat, u64)          \
+    PTRACE_DEFINE_COUNTER_FUNC(cat, i64)          \
+    PTRACE_DEFINE_COUNTER_FUNC(cat, float)        \
+    PTRACE_DEFINE_COUNTER_FUNC(cat, double)       \
+    PTRACE_DEFINE_BEGIN_TRACK_FUNC(cat)           \
+    PTRACE_DEFINE_END_TRACK_FUNC(cat)             \
+    PTRACE_DEFINE_COUNTER_TRACK_FUNC(cat, u32)    \
+    PTRACE_DEFINE_COUNTER_TRACK_FUNC(cat, i32)    \
+    PTRACE_DEFINE_COUNTER_TRACK_FUNC(cat, u64)    \
+    PTRACE_DEFINE_COUNTER_TRACK_FUNC(cat, i64)    \
+    PTRACE_DEFINE_COUNTER_TRACK_FUNC(cat, float)  \
+    PTRACE_DEFINE_COUNTER_TRACK_FUNC(cat, double)
 
 PERFETTO_DEFINE_CATEGORIES(
     ::perfetto::Category(STR(PTRACE_CAT0)).SetDescription("PTrace category 0"),
     ::perfetto::Category(STR(PTRACE_CAT1)).SetDescription("PTrace category 1"),
-    ::perfetto::Category(STR(PTRACE_CAT2)).SetDescription("PTrace category 2"));
+    ::perfetto::Category(STR(PTRACE_CAT2)).SetDescription("PTrace category 2"),
+    ::perfetto::Category(STR(PTRACE_CAT_FIBER))
+        .SetDescription("PTrace fiber switches"));
 
 PERFETTO_TRACK_EVENT_STATIC_STORAGE();
 
@@ -72,27 +235,226 @@ PTRACE_DEFINE_FUNCS(PTRACE_CAT0)
 PTRACE_DEFINE_FUNCS(PTRACE_CAT1)
 PTRACE_DEFINE_FUNCS(PTRACE_CAT2)
 
-static bool ptrace_initialized = false;
+/*
+ * PTRACE_INIT() only arms libptrace, every process connects to traced at its
+ * own first trace point. So the workers of a pre-forking server that called
+ * PTRACE_INIT() in its master are traced without any call of their own.
+ *
+ * The perfetto v22 SDK can neither be shut down nor initialized a second time,
+ * and a child forked from a connected process inherits its state without its
+ * threads, its shared memory buffer belongs to the parent. Tracing is disabled
+ * in such a child.
+ */
+static pthread_mutex_t ptrace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t ptrace_atfork_once = PTHREAD_ONCE_INIT;
 
-int ptrace_init(void)
+static void ptrace_atfork_prepare(void)
+{
+    /* don't fork while a process is connecting */
+    pthread_mutex_lock(&ptrace_lock);
+}
+
+static void ptrace_atfork_parent(void)
+{
+    pthread_mutex_unlock(&ptrace_lock);
+}
+
+static void ptrace_atfork_child(void)
+{
+    static const char msg[] = "\033[33mPTRACE: tracing disabled in a child "
+                              "of a connected process\n\033[0m";
+    ssize_t ret;
+
+    /* an armed state is inherited as is, the child connects by itself */
+    if (PTRACE_STATE_RUNNING == ptrace_state) {
+        ptrace_state = PTRACE_STATE_FORKED;
+        /* no stdio between fork and exec */
+        ret = write(STDERR_FILENO, msg, sizeof(msg) - 1);
+        (void)ret;
+    }
+
+    pthread_mutex_unlock(&ptrace_lock);
+}
+
+static void ptrace_atfork_register(void)
+{
+    pthread_atfork(ptrace_atfork_prepare,
+                   ptrace_atfork_parent,
+                   ptrace_atfork_child);
+}
+
+static bool ptrace_connect(void)
 {
     ::perfetto::TracingInitArgs args;
 
-    if (ptrace_initialized)
-        return 0;
+    if (PTRACE_STATE_ARMED != ptrace_state)
+        return false;
 
-    fprintf(stderr, "\033[33mPTRACE %s\n\033[0m", PTRACE_VERSION);
-    args.backends |= perfetto::kSystemBackend;
-    //args.backends |= perfetto::kInProcessBackend;
-    ::perfetto::Tracing::Initialize(args);
+    pthread_mutex_lock(&ptrace_lock);
 
-    if (!::perfetto::TrackEvent::Register()) {
-        fprintf(stderr, "\033[33mPTRACE: init failed\n\033[0m");
-        return -1;
+    if (PTRACE_STATE_ARMED == ptrace_state) {
+        args.backends |= perfetto::kSystemBackend;
+        //args.backends |= perfetto::kInProcessBackend;
+        ::perfetto::Tracing::Initialize(args);
+
+        if (::perfetto::TrackEvent::Register()) {
+            ptrace_state = PTRACE_STATE_RUNNING;
+            fprintf(stderr, "\033[33mPTRACE: init OK, pid %d\n\033[0m",
+                    getpid());
+        } else {
+            /* PTRACE_INIT() arms it again */
+            ptrace_state = PTRACE_STATE_NONE;
+            fprintf(stderr, "\033[33mPTRACE: init failed, pid %d\n\033[0m",
+                    getpid());
+        }
     }
 
-    ptrace_initialized = true;
-    fprintf(stderr, "\033[33mPTRACE: init OK\n\033[0m");
+    pthread_mutex_unlock(&ptrace_lock);
+
+    return PTRACE_STATE_RUNNING == ptrace_state;
+}
+
+int ptrace_init(void)
+{
+    int ret = 0;
+
+    pthread_once(&ptrace_atfork_once, ptrace_atfork_register);
+
+    pthread_mutex_lock(&ptrace_lock);
+
+    if (PTRACE_STATE_FORKED == ptrace_state) {
+        fprintf(stderr, "\033[33mPTRACE: tracing disabled, pid %d was forked "
+                "from a connected process\n\033[0m", getpid());
+        ret = -1;
+    } else if (PTRACE_STATE_NONE == ptrace_state) {
+        fprintf(stderr, "\033[33mPTRACE %s\n\033[0m", PTRACE_VERSION);
+        ptrace_state = PTRACE_STATE_ARMED;
+    }
+
+    pthread_mutex_unlock(&ptrace_lock);
+
+    return ret;
+}
+
+int ptrace_set_thread_name(const char *name)
+{
+    if (!name || !PTRACE_ACTIVE())
+        return -1;
+
+    auto track = ::perfetto::ThreadTrack::Current();
+    auto desc = track.Serialize();
+    desc.mutable_thread()->set_thread_name(name);
+    ::perfetto::TrackEvent::SetTrackDescriptor(track, desc);
+
+    return 0;
+}
+
+int ptrace_set_process_name(const char *name)
+{
+    if (!name || !PTRACE_ACTIVE())
+        return -1;
+
+    auto track = ::perfetto::ProcessTrack::Current();
+    auto desc = track.Serialize();
+    desc.mutable_process()->set_process_name(name);
+    ::perfetto::TrackEvent::SetTrackDescriptor(track, desc);
 
     return 0;
 }
+
+/* splitmix64, so that (id ^ parent uuid) of different tracks won't collide */
+static uint64_t ptrace_track_id(void)
+{
+    static std::atomic<uint64_t> seq(0);
+    uint64_t z = (seq.fetch_add(1) + 1) * 0x9e3779b97f4a7c15ULL;
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+
+    return z ^ (z >> 31);
+}
+
+/*
+ * The descriptor is cached by perfetto's track registry, which emits it once
+ * on every sequence that uses the track.
+ */
+ptrace_track_t ptrace_track_create(const char *name, ptrace_track_t parent)
+{
+    if (!name || !PTRACE_ACTIVE())
+        return 0;
+
+    ::perfetto::Track track(ptrace_track_id(), parent ?
+            PTRACE_TRACK(parent) : ::perfetto::Track::MakeProcessTrack());
+    auto desc = track.Serialize();
+    desc.set_name(name);
+    ::perfetto::TrackEvent::SetTrackDescriptor(track, desc);
+
+    return track.uuid;
+}
+
+/*
+ * A fiber owns a track, the slices begun while it runs on a thread are put on
+ * its track, so they nest correctly even if the fiber migrates to another
+ * thread before they end. The thread's own track shows which fiber it runs.
+ *
+ * Slices are ended on the track of the fiber running at that time, so a slice
+ * begun on the thread must not be ended while a fiber runs, and vice versa.
+ */
+ptrace_fiber_t ptrace_fiber_create(const char *name)
+{
+    struct ptrace_fiber *fiber;
+
+    if (!name)
+        return NULL;
+
+    fiber = new (std::nothrow) struct ptrace_fiber;
+    if (fiber) {
+        fiber->name = name;
+        fiber->track = ptrace_track_create(name, 0);
+        fiber->switched = false;
+    }
+
+    return fiber;
+}
+
+void ptrace_fiber_switch(ptrace_fiber_t fiber)
+{
+    struct ptrace_fiber *prev = ptrace_fiber_cur;
+
+    if (prev == fiber)
+        return;
+
+    /* the track is created late if traced was not connected yet */
+    if (fiber && !fiber->track)
+        fiber->track = ptrace_track_create(fiber->name, 0);
+
+    /* only if begun, a session may have started since prev was switched in */
+    if (prev && prev->switched) {
+        if (PTRACE_ACTIVE())
+            TRACE_EVENT_END(STR(PTRACE_CAT_FIBER));
+        prev->switched = false;
+    }
+
+    if (fiber && PTRACE_ACTIVE() &&
+        TRACE_EVENT_CATEGORY_ENABLED(STR(PTRACE_CAT_FIBER))) {
+        TRACE_EVENT_BEGIN(STR(PTRACE_CAT_FIBER),
+                          ::perfetto::StaticString{fiber->name});
+        fiber->switched = true;
+    }
+
+    ptrace_fiber_cur = fiber;
+}
+
+void ptrace_fiber_destroy(ptrace_fiber_t fiber)
+{
+    if (!fiber)
+        return;
+
+    if (ptrace_fiber_cur == fiber)
+        ptrace_fiber_switch(NULL);
+
+    if (fiber->track && PTRACE_ACTIVE())
+        ::perfetto::TrackEvent::EraseTrackDescriptor(PTRACE_TRACK(fiber->track));
+
+    delete fiber;
+}
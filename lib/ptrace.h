@@ -1,10 +1,21 @@
 #ifndef __PTRACE_H__
 #define __PTRACE_H__
 
-#ifdef ENABLE_PTRACE
-
 #include <stdint.h>
 
+/*
+ * track handle, what 0 means depends on the macro:
+ * - PTRACE_BEGIN/END/SCOPE_*TRACK(): the current thread, or the fiber running
+ *   on it
+ * - PTRACE_TRACK_CREATE() parent and PTRACE_COUNTER_*TRACK_*(): the process
+ */
+typedef uint64_t ptrace_track_t;
+
+/* fiber handle, NULL means the thread itself */
+typedef struct ptrace_fiber *ptrace_fiber_t;
+
+#ifdef ENABLE_PTRACE
+
 typedef uint32_t    u32;
 typedef int32_t     i32;
 typedef uint64_t    u64;
@@ -15,6 +26,7 @@ typedef const char *str;
 #define PTRACE_CAT0 ptrace0
 #define PTRACE_CAT1 ptrace1
 #define PTRACE_CAT2 ptrace2
+#define PTRACE_CAT_FIBER ptrace_fiber   /* fiber switches on thread tracks */
 
 #define _PTRACE_BEGIN_FUNC_NAME(cat) ptrace_begin_##cat
 #define _PTRACE_BEGIN_FUNC(cat) \
@@ -41,9 +53,32 @@ typedef const char *str;
 #define _PTRACE_COUNTER_FUNC(cat, type) \
     void _PTRACE_COUNTER_FUNC_NAME(cat, type)(const char *track, type val)
 
+#define _PTRACE_BEGIN_TRACK_FUNC_NAME(cat) ptrace_begin_track_##cat
+#define _PTRACE_BEGIN_TRACK_FUNC(cat) \
+        ptrace_track_t _PTRACE_BEGIN_TRACK_FUNC_NAME(cat)(\
+        ptrace_track_t track, const char *name)
+
+#define _PTRACE_END_TRACK_FUNC_NAME(cat) ptrace_end_track_##cat
+#define _PTRACE_END_TRACK_FUNC(cat) \
+        void _PTRACE_END_TRACK_FUNC_NAME(cat)(const ptrace_track_t *track)
+
+#define _PTRACE_COUNTER_TRACK_FUNC_NAME(cat, type) \
+        ptrace_counter_track_##cat##_##type
+#define _PTRACE_COUNTER_TRACK_FUNC(cat, type) \
+    void _PTRACE_COUNTER_TRACK_FUNC_NAME(cat, type)(\
+    ptrace_track_t track, const char *name, type val)
+
 /* api for category x */
 #define PTRACE_INIT ptrace_init
 
+#define PTRACE_SET_THREAD_NAME(name)        ptrace_set_thread_name(name)
+#define PTRACE_SET_PROCESS_NAME(name)       ptrace_set_process_name(name)
+#define PTRACE_TRACK_CREATE(name, parent)   ptrace_track_create(name, parent)
+
+#define PTRACE_FIBER_CREATE(name)           ptrace_fiber_create(name)
+#define PTRACE_FIBER_SWITCH(fiber)          ptrace_fiber_switch(fiber)
+#define PTRACE_FIBER_DESTROY(fiber)         ptrace_fiber_destroy(fiber)
+
 #define PTRACE_END_CAT(cat)                       _PTRACE_END_FUNC_NAME(cat)((const char **)0)
 #define PTRACE_BEGIN_CAT(cat, name)               _PTRACE_BEGIN_FUNC_NAME(cat)(name)
 #define PTRACE_BEGIN_CAT_I32(cat, name, arg, val) _PTRACE_BEGIN_FUNC_1_NAME(cat, i32)(name, arg, val)
@@ -114,6 +149,37 @@ typedef const char *str;
 #define PTRACE_COUNTER_CAT_FLT(cat, track, val) _PTRACE_COUNTER_FUNC_NAME(cat, float)(track, val)
 #define PTRACE_COUNTER_CAT_DBL(cat, track, val) _PTRACE_COUNTER_FUNC_NAME(cat, double)(track, val)
 
+/*
+ * events on a track created by PTRACE_TRACK_CREATE(), the track of
+ * PTRACE_END_CAT_TRACK() must be an lvalue (a ptrace_track_t variable)
+ */
+#define PTRACE_BEGIN_CAT_TRACK(cat, track, name) \
+        _PTRACE_BEGIN_TRACK_FUNC_NAME(cat)(track, name)
+#define PTRACE_END_CAT_TRACK(cat, track) \
+        _PTRACE_END_TRACK_FUNC_NAME(cat)(&(track))
+
+#define __PTRACE_SCOPE_CAT_TRACK(cat, track, name, line) \
+        ptrace_track_t ptrace_dummy_##line \
+        __attribute__((cleanup (_PTRACE_END_TRACK_FUNC_NAME(cat)), unused)) = \
+        _PTRACE_BEGIN_TRACK_FUNC_NAME(cat)(track, name)
+#define _PTRACE_SCOPE_CAT_TRACK(cat, track, name, line) \
+        __PTRACE_SCOPE_CAT_TRACK(cat, track, name, line)
+#define PTRACE_SCOPE_CAT_TRACK(cat, track, name) \
+        _PTRACE_SCOPE_CAT_TRACK(cat, track, name, __LINE__)
+
+#define PTRACE_COUNTER_CAT_TRACK_I32(cat, track, name, val) \
+        _PTRACE_COUNTER_TRACK_FUNC_NAME(cat, i32)(track, name, val)
+#define PTRACE_COUNTER_CAT_TRACK_U32(cat, track, name, val) \
+        _PTRACE_COUNTER_TRACK_FUNC_NAME(cat, u32)(track, name, val)
+#define PTRACE_COUNTER_CAT_TRACK_I64(cat, track, name, val) \
+        _PTRACE_COUNTER_TRACK_FUNC_NAME(cat, i64)(track, name, val)
+#define PTRACE_COUNTER_CAT_TRACK_U64(cat, track, name, val) \
+        _PTRACE_COUNTER_TRACK_FUNC_NAME(cat, u64)(track, name, val)
+#define PTRACE_COUNTER_CAT_TRACK_FLT(cat, track, name, val) \
+        _PTRACE_COUNTER_TRACK_FUNC_NAME(cat, float)(track, name, val)
+#define PTRACE_COUNTER_CAT_TRACK_DBL(cat, track, name, val) \
+        _PTRACE_COUNTER_TRACK_FUNC_NAME(cat, double)(track, name, val)
+
 
 
 /* category 0 */
@@ -164,25 +230,49 @@ typedef const char *str;
 #define PTRACE_COUNTER_FLT(name, val) PTRACE_COUNTER_CAT_FLT(PTRACE_CAT0, name, val)
 #define PTRACE_COUNTER_DBL(name, val) PTRACE_COUNTER_CAT_DBL(PTRACE_CAT0, name, val)
 
-
-
-#define _PTRACE_DECLARE_FUNCS(cat)              \
-    extern _PTRACE_BEGIN_FUNC(cat);             \
-    extern _PTRACE_BEGIN_FUNC_1(cat, i32);      \
-    extern _PTRACE_BEGIN_FUNC_1(cat, u32);      \
-    extern _PTRACE_BEGIN_FUNC_1(cat, i64);      \
-    extern _PTRACE_BEGIN_FUNC_1(cat, u64);      \
-    extern _PTRACE_BEGIN_FUNC_1(cat, str);      \
-    extern _PTRACE_BEGIN_FUNC_2(cat, i32, i32); \
-    extern _PTRACE_BEGIN_FUNC_2(cat, i32, u32); \
-    extern _PTRACE_BEGIN_FUNC_2(cat, u32, u32); \
-    extern _PTRACE_END_FUNC(cat);               \
-    extern _PTRACE_COUNTER_FUNC(cat, u32);      \
-    extern _PTRACE_COUNTER_FUNC(cat, i32);      \
-    extern _PTRACE_COUNTER_FUNC(cat, u64);      \
-    extern _PTRACE_COUNTER_FUNC(cat, i64);      \
-    extern _PTRACE_COUNTER_FUNC(cat, float);    \
-    extern _PTRACE_COUNTER_FUNC(cat, double);
+#define PTRACE_BEGIN_TRACK(track, name) PTRACE_BEGIN_CAT_TRACK(PTRACE_CAT0, track, name)
+#define PTRACE_END_TRACK(track)         PTRACE_END_CAT_TRACK(PTRACE_CAT0, track)
+#define PTRACE_SCOPE_TRACK(track, name) PTRACE_SCOPE_CAT_TRACK(PTRACE_CAT0, track, name)
+#define PTRACE_COUNTER_TRACK_I32(track, name, val) \
+        PTRACE_COUNTER_CAT_TRACK_I32(PTRACE_CAT0, track, name, val)
+#define PTRACE_COUNTER_TRACK_U32(track, name, val) \
+        PTRACE_COUNTER_CAT_TRACK_U32(PTRACE_CAT0, track, name, val)
+#define PTRACE_COUNTER_TRACK_I64(track, name, val) \
+        PTRACE_COUNTER_CAT_TRACK_I64(PTRACE_CAT0, track, name, val)
+#define PTRACE_COUNTER_TRACK_U64(track, name, val) \
+        PTRACE_COUNTER_CAT_TRACK_U64(PTRACE_CAT0, track, name, val)
+#define PTRACE_COUNTER_TRACK_FLT(track, name, val) \
+        PTRACE_COUNTER_CAT_TRACK_FLT(PTRACE_CAT0, track, name, val)
+#define PTRACE_COUNTER_TRACK_DBL(track, name, val) \
+        PTRACE_COUNTER_CAT_TRACK_DBL(PTRACE_CAT0, track, name, val)
+
+
+
+#define _PTRACE_DECLARE_FUNCS(cat)                  \
+    extern _PTRACE_BEGIN_FUNC(cat);                 \
+    extern _PTRACE_BEGIN_FUNC_1(cat, i32);          \
+    extern _PTRACE_BEGIN_FUNC_1(cat, u32);          \
+    extern _PTRACE_BEGIN_FUNC_1(cat, i64);          \
+    extern _PTRACE_BEGIN_FUNC_1(cat, u64);          \
+    extern _PTRACE_BEGIN_FUNC_1(cat, str);          \
+    extern _PTRACE_BEGIN_FUNC_2(cat, i32, i32);     \
+    extern _PTRACE_BEGIN_FUNC_2(cat, i32, u32);     \
+    extern _PTRACE_BEGIN_FUNC_2(cat, u32, u32);     \
+    extern _PTRACE_END_FUNC(cat);                   \
+    extern _PTRACE_COUNTER_FUNC(cat, u32);          \
+    extern _PTRACE_COUNTER_FUNC(cat, i32);          \
+    extern _PTRACE_COUNTER_FUNC(cat, u64);          \
+    extern _PTRACE_COUNTER_FUNC(cat, i64);          \
+    extern _PTRACE_COUNTER_FUNC(cat, float);        \
+    extern _PTRACE_COUNTER_FUNC(cat, double);       \
+    extern _PTRACE_BEGIN_TRACK_FUNC(cat);           \
+    extern _PTRACE_END_TRACK_FUNC(cat);             \
+    extern _PTRACE_COUNTER_TRACK_FUNC(cat, u32);    \
+    extern _PTRACE_COUNTER_TRACK_FUNC(cat, i32);    \
+    extern _PTRACE_COUNTER_TRACK_FUNC(cat, u64);    \
+    extern _PTRACE_COUNTER_TRACK_FUNC(cat, i64);    \
+    extern _PTRACE_COUNTER_TRACK_FUNC(cat, float);  \
+    extern _PTRACE_COUNTER_TRACK_FUNC(cat, double);
 
 
 
@@ -192,6 +282,15 @@ extern "C" {
 
 extern int ptrace_init(void);
 
+extern int ptrace_set_thread_name(const char *name);
+extern int ptrace_set_process_name(const char *name);
+extern ptrace_track_t ptrace_track_create(const char *name,
+                                          ptrace_track_t parent);
+
+extern ptrace_fiber_t ptrace_fiber_create(const char *name);
+extern void ptrace_fiber_switch(ptrace_fiber_t fiber);
+extern void ptrace_fiber_destroy(ptrace_fiber_t fiber);
+
 _PTRACE_DECLARE_FUNCS(PTRACE_CAT0)
 _PTRACE_DECLARE_FUNCS(PTRACE_CAT1)
 _PTRACE_DECLARE_FUNCS(PTRACE_CAT2)
@@ -206,6 +305,13 @@ _PTRACE_DECLARE_FUNCS(PTRACE_CAT2)
 
 #define PTRACE_INIT()
 
+#define PTRACE_SET_THREAD_NAME(name)
+#define PTRACE_SET_PROCESS_NAME(name)
+#define PTRACE_TRACK_CREATE(name, parent) ((ptrace_track_t)0)
+#define PTRACE_FIBER_CREATE(name) ((ptrace_fiber_t)0)
+#define PTRACE_FIBER_SWITCH(fiber)
+#define PTRACE_FIBER_DESTROY(fiber)
+
 #define PTRACE_BEGIN_CAT(cat, name)
 #define PTRACE_BEGIN_CAT_I32(cat, name, arg, val)
 #define PTRACE_BEGIN_CAT_U32(cat, name, arg, val)
@@ -240,6 +346,15 @@ _PTRACE_DECLARE_FUNCS(PTRACE_CAT2)
 #define PTRACE_COUNTER_CAT_U64(cat, name, val)
 #define PTRACE_COUNTER_CAT_FLT(cat, name, val)
 #define PTRACE_COUNTER_CAT_DBL(cat, name, val)
+#define PTRACE_BEGIN_CAT_TRACK(cat, track, name)
+#define PTRACE_END_CAT_TRACK(cat, track)
+#define PTRACE_SCOPE_CAT_TRACK(cat, track, name)
+#define PTRACE_COUNTER_CAT_TRACK_I32(cat, track, name, val)
+#define PTRACE_COUNTER_CAT_TRACK_U32(cat, track, name, val)
+#define PTRACE_COUNTER_CAT_TRACK_I64(cat, track, name, val)
+#define PTRACE_COUNTER_CAT_TRACK_U64(cat, track, name, val)
+#define PTRACE_COUNTER_CAT_TRACK_FLT(cat, track, name, val)
+#define PTRACE_COUNTER_CAT_TRACK_DBL(cat, track, name, val)
 
 #define PTRACE_BEGIN(name)
 #define PTRACE_BEGIN_I32(name, arg, val)
@@ -275,6 +390,15 @@ _PTRACE_DECLARE_FUNCS(PTRACE_CAT2)
 #define PTRACE_COUNTER_U64(name, val)
 #define PTRACE_COUNTER_FLT(name, val)
 #define PTRACE_COUNTER_DBL(name, val)
+#define PTRACE_BEGIN_TRACK(track, name)
+#define PTRACE_END_TRACK(track)
+#define PTRACE_SCOPE_TRACK(track, name)
+#define PTRACE_COUNTER_TRACK_I32(track, name, val)
+#define PTRACE_COUNTER_TRACK_U32(track, name, val)
+#define PTRACE_COUNTER_TRACK_I64(track, name, val)
+#define PTRACE_COUNTER_TRACK_U64(track, name, val)
+#define PTRACE_COUNTER_TRACK_FLT(track, name, val)
+#define PTRACE_COUNTER_TRACK_DBL(track, name, val)
 
 #endif /* ENABLE_PTRACE */
 
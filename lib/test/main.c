@@ -28,12 +28,29 @@ void func_a(unsigned num)
 
 int main(int argc, char *argv[])
 {
-    PTRACE_INIT();
+    if (PTRACE_INIT() < 0) {
+        fprintf(stderr, "PTRACE_INIT failed\n");
+        return -1;
+    }
+
+    if (PTRACE_SET_PROCESS_NAME("libptrace_test") < 0 ||
+        PTRACE_SET_THREAD_NAME("main") < 0) {
+        fprintf(stderr, "PTRACE_SET_*_NAME failed\n");
+        return -1;
+    }
+
+    ptrace_track_t track = PTRACE_TRACK_CREATE("loop_track", 0);
+    if (!track) {
+        fprintf(stderr, "PTRACE_TRACK_CREATE failed\n");
+        return -1;
+    }
 
     unsigned i;
     for (i = 0; i < 10; i++) {
         PTRACE_SCOPE_I32("main_loop", "i", i);
+        PTRACE_SCOPE_TRACK(track, "loop");
         PTRACE_COUNTER_I32("counter_i", i);
+        PTRACE_COUNTER_TRACK_I32(track, "track_counter_i", i);
 
         func_a(i);
         func_b();
@@ -2,11 +2,15 @@
 
 extern int ptrace_combine_main(int argc, char *argv[]);
 extern int ptrace_main(int argc, char *argv[]);
+extern int ptrace_ctl_main(int argc, char *argv[]);
 
 int main(int argc, char *argv[])
 {
     if (strstr(argv[0], "combine"))
         return ptrace_combine_main(argc, argv);
 
+    if (argc > 1 && 0 == strcmp(argv[1], "ctl"))
+        return ptrace_ctl_main(argc - 1, argv + 1);
+
     return ptrace_main(argc, argv);
 }
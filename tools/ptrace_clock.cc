@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+
+#include "ptrace_clock.h"
+
+int64_t ptrace_clock_offset(const struct ptrace_clock_sample *samples,
+                            int cnt, uint64_t t)
+{
+    int lo, hi, mid;
+    const struct ptrace_clock_sample *a, *b;
+
+    if (cnt <= 0)
+        return 0;
+    if (1 == cnt)
+        return samples[0].offset;
+
+    /* the segment [a, b] holding t, or the one at the end nearest to it */
+    lo = 0;
+    hi = cnt - 1;
+    while (hi - lo > 1) {
+        mid = lo + (hi - lo) / 2;
+        if (t < samples[mid].time)
+            hi = mid;
+        else
+            lo = mid;
+    }
+
+    a = &samples[lo];
+    b = &samples[hi];
+    if (b->time == a->time)
+        return a->offset;
+
+    /* the offset moves by ppm, the product in double keeps ns precision */
+    return a->offset + (int64_t)((double)(b->offset - a->offset)
+                                 * (double)(int64_t)(t - a->time)
+                                 / (double)(b->time - a->time));
+}
+
+int ptrace_clock_save(const char *path,
+                      const struct ptrace_clock_sample *samples, int cnt)
+{
+    int i;
+    FILE *fp;
+
+    fp = fopen(path, "w");
+    if (!fp) {
+        fprintf(stderr, "open %s failed, errno = %d\n", path, errno);
+        return -1;
+    }
+
+    fprintf(fp, "# client boot time, offset (server - client), error, ns\n");
+    for (i = 0; i < cnt; i++)
+        fprintf(fp, "%" PRIu64 " %" PRId64 " %" PRIu64 "\n",
+                samples[i].time, samples[i].offset, samples[i].error);
+
+    if (fclose(fp) != 0) {
+        fprintf(stderr, "write %s failed, errno = %d\n", path, errno);
+        return -1;
+    }
+
+    return 0;
+}
+
+int ptrace_clock_load(const char *path,
+                      struct ptrace_clock_sample **samples, int *cnt)
+{
+    int n = 0, size = 0;
+    char line[128];
+    FILE *fp;
+    struct ptrace_clock_sample s, *buf = NULL, *tmp;
+
+    fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "open %s failed, errno = %d\n", path, errno);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        if ('#' == line[0] || '\n' == line[0])
+            continue;
+
+        if (sscanf(line, "%" SCNu64 " %" SCNd64 " %" SCNu64,
+                   &s.time, &s.offset, &s.error) != 3
+            || (n && s.time < buf[n - 1].time)) {
+            fprintf(stderr, "invalid clock sample in %s: %s", path, line);
+            goto _err;
+        }
+
+        if (n == size) {
+            size = size ? size * 2 : 64;
+            tmp = (struct ptrace_clock_sample *)realloc(buf,
+                                                        size * sizeof(*buf));
+            if (!tmp)
+                goto _err;
+            buf = tmp;
+        }
+        buf[n++] = s;
+    }
+
+    fclose(fp);
+
+    if (0 == n) {
+        fprintf(stderr, "no clock sample in %s\n", path);
+        free(buf);
+        return -1;
+    }
+
+    *samples = buf;
+    *cnt = n;
+
+    return 0;
+
+_err:
+    fclose(fp);
+    free(buf);
+
+    return -1;
+}
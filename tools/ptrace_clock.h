@@ -0,0 +1,33 @@
+#ifndef __PTRACE_CLOCK_H__
+#define __PTRACE_CLOCK_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * The offset between two hosts' boot clocks, measured again and again during
+ * a session since the clocks drift apart. Samples are sorted by time.
+ */
+struct ptrace_clock_sample {
+    uint64_t time;          /* client's boot time, nanosecond */
+    int64_t offset;         /* server's boot time - client's, at time */
+    uint64_t error;         /* the true offset is within offset +/- error */
+};
+
+/*
+ * The offset at client time t, linearly interpolated between the samples
+ * around it. Before the first and after the last sample the nearest segment
+ * is extended, a single sample is a constant offset.
+ */
+extern int64_t ptrace_clock_offset(const struct ptrace_clock_sample *samples,
+                                   int cnt, uint64_t t);
+
+/* text file, one "time offset error" line per sample */
+extern int ptrace_clock_save(const char *path,
+                             const struct ptrace_clock_sample *samples, int cnt);
+
+/* the samples are malloc()ed, free them with free() */
+extern int ptrace_clock_load(const char *path,
+                             struct ptrace_clock_sample **samples, int *cnt);
+
+#endif /* __PTRACE_CLOCK_H__ */
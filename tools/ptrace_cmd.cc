@@ -1,11 +1,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
 #include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/wait.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <poll.h>
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -14,9 +19,23 @@
 #include <pthread.h>
 #include <signal.h>
 #include <errno.h>
+#include <zlib.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
 
 #include "perfetto.h"
 #include "ptrace_msg.h"
+#include "ptrace_clock.h"
+#include "ptrace_combine.h"
+#include "ptrace_config.h"
+#include "ptrace_ctl.h"
+#include "ptrace_crc.h"
+#include "ptrace_netem.h"
 
 enum ptrace_msg_id_e {
     PTRACE_MSG_ID_CONNECT = 0,
@@ -28,17 +47,129 @@ enum ptrace_msg_id_e {
     PTRACE_MSG_ID_FILE_BEGIN,
     PTRACE_MSG_ID_FILE_CONTENT,
     PTRACE_MSG_ID_FILE_END,
+    PTRACE_MSG_ID_FILE_ACK,
+    PTRACE_MSG_ID_CLOCK,
+};
+
+/*
+ * PTRACE_MSG_ID_CLOCK response, the server's boot time when the probe was
+ * received (t2) and when it is answered (t3).
+ */
+struct ptrace_msg_clock_data {
+    uint64_t t2;            /* nanosecond */
+    uint64_t t3;            /* nanosecond */
 };
 
+/* PTRACE_MSG_ID_TIME request, sent again and again as the clocks drift */
 struct ptrace_msg_time_data {
-    uint64_t boot_time;     /* nanosecond */
-    uint64_t trans_delay;   /* nanosecond */
+    uint64_t time;          /* client's boot time of the estimate */
+    int64_t offset;         /* server's boot time - client's, nanosecond */
+    uint64_t error;         /* the true offset is within offset +/- error */
+};
+
+/*
+ * PTRACE_MSG_ID_START_TRACING/STOP_TRACING request, optional: without it the
+ * server acts at once. A coordinator sends them to its clients as well.
+ */
+struct ptrace_msg_tracing_data {
+    uint64_t at;            /* receiver's boot time to act at */
+};
+
+/*
+ * How long a tracing session took to capture and to complete, boot times of
+ * the host which ran it, 0 where unknown.
+ */
+struct ptrace_msg_tracing_stats {
+    uint64_t start;         /* start asked */
+    uint64_t started;       /* all the data sources have started */
+    uint64_t first_data;    /* the first data in traced's buffers */
+    uint64_t first_file;    /* the first bytes in the file */
+    uint64_t stop;          /* stop asked */
+    uint64_t flushed;       /* the producers have flushed */
+    uint64_t closed;        /* the file is complete */
+};
+
+/* and its response, sent when the receiver has acted */
+struct ptrace_msg_tracing_rsp {
+    int32_t success;
+    uint64_t actual;        /* receiver's boot time it acted at, 0: it didn't */
+    struct ptrace_msg_tracing_stats stats;  /* STOP_TRACING: of the session */
+};
+
+/*
+ * PTRACE_MSG_ID_CONNECT response. A coordinated client does not start or
+ * stop tracing on its own, it waits for the coordinator's requests.
+ */
+struct ptrace_msg_connect_rsp {
+    int32_t success;
+    uint8_t coordinated;
+};
+
+/* PTRACE_MSG_ID_FILE_BEGIN request */
+enum ptrace_file_channel_e {
+    PTRACE_FILE_CHANNEL_UDP = 0,    /* FILE_CONTENT/FILE_ACK messages */
+    PTRACE_FILE_CHANNEL_TCP,        /* a TCP connection to the server */
+};
+
+enum ptrace_file_codec_e {
+    PTRACE_FILE_CODEC_NONE = 0,
+    PTRACE_FILE_CODEC_ZLIB,         /* a zlib stream, or zlib chunks by UDP */
+};
+
+/*
+ * A streamed file is sent over TCP while it is still growing, its size and
+ * CRC are only known at the end and come with FILE_END.
+ */
+#define PTRACE_FILE_FLAG_STREAM 0x1
+
+struct ptrace_msg_file_info {
+    uint64_t size;          /* file size in bytes */
+    uint32_t crc;           /* CRC32C of the whole file */
+    uint32_t chunk_size;    /* payload size of every chunk except the last */
+    uint8_t channel;        /* PTRACE_FILE_CHANNEL_XXX */
+    uint8_t codec;          /* PTRACE_FILE_CODEC_XXX the client prefers */
+    uint8_t flags;          /* PTRACE_FILE_FLAG_XXX */
+};
+
+/*
+ * PTRACE_MSG_ID_FILE_CONTENT notification. Chunks always cover chunk_size
+ * bytes of the file, with PTRACE_FILE_CODEC_ZLIB a chunk whose payload is
+ * shorter than that is compressed on its own.
+ */
+struct ptrace_msg_file_chunk {
+    uint64_t offset;
+    uint32_t crc;           /* CRC32C of the chunk before compression */
+    char data[0];
+};
+
+/* max chunks in flight, every one of them can be selectively acked */
+#define PTRACE_FILE_WINDOW  512
+
+/* PTRACE_MSG_ID_FILE_ACK notification */
+struct ptrace_msg_file_ack {
+    uint64_t cum_chunks;    /* chunks [0, cum_chunks) are received */
+    uint64_t sack[PTRACE_FILE_WINDOW / 64]; /* bit i: chunk cum_chunks+1+i */
+};
+
+/*
+ * PTRACE_MSG_ID_FILE_BEGIN response. If the server already holds a part of
+ * the same file (same size and CRC) from an interrupted transfer on the same
+ * channel, only the rest of it is sent again.
+ */
+struct ptrace_msg_file_rsp {
+    int32_t success;
+    uint16_t port;          /* TCP channel port in network order, or 0 */
+    uint8_t codec;          /* PTRACE_FILE_CODEC_XXX the server accepts */
+    uint64_t resume_offset; /* TCP: bytes [0, resume_offset) are received */
+    struct ptrace_msg_file_ack resume;  /* UDP: chunks received */
 };
 
 enum ptrace_working_mode_e {
     PTRACE_WORKING_MODE_ALONE = 0,
     PTRACE_WORKING_MODE_CLIENT,
     PTRACE_WORKING_MODE_SERVER,
+    PTRACE_WORKING_MODE_BENCH,
+    PTRACE_WORKING_MODE_COORD,
 };
 
 #define PTRACE_FAILURE  0
@@ -48,12 +179,23 @@ static const char *g_working_mode_name[] = {
     "alone",
     "client",
     "server",
+    "bench",
+    "coord",
 };
 
 struct ptrace_config {
     struct sockaddr_in addr;    /* server address */
     uint8_t work_mode;          /* working mode: PTRACE_WORKING_MODE_XXX */
     uint8_t no_wait;            /* don't wait client, tracking immediately */
+    uint8_t zlevel;             /* upload compression level, 0: disabled */
+    uint8_t udp_only;           /* upload by UDP even if TCP works */
+    uint8_t stream;             /* upload the trace while tracing */
+    uint32_t sched_ms;          /* start/stop both hosts this far ahead */
+    uint32_t nclients;          /* clients a coordinator waits for */
+    uint32_t rotate_mb;         /* a new file at this size, 0: never */
+    uint32_t rotate_s;          /* a new file at this age, 0: never */
+    char netem[128];            /* emulated network, 'bench' mode only */
+    char ctl_path[108];         /* control socket, started by it if set */
     char cfg_file[128];         /* config file */
     char out_file[128];         /* output tracking file */
     char clnt_file[128];        /* client's tracking file */
@@ -66,407 +208,3456 @@ static const char *g_program_name;
 
 static int g_running;
 
-static pid_t g_tracing_pid;
+static char g_send_buff[PTRACE_MSG_BATCH][PTRACE_MSG_BUFF_SIZE];
+
+
+static int simple_request(struct ptrace_msg_ctx *ctx, struct sockaddr_in *dest,
+                          uint8_t msg_id, void *data, int data_len,
+                          uint32_t timeout_ms)
+{
+    int32_t success = 0;
+    struct ptrace_msg *rsp = NULL;
+
+    if (0 == ptrace_msg_request(ctx, dest, msg_id,
+                                data, data_len, &rsp, timeout_ms)) {
+        success = PTRACE_MSG_DATA(rsp, int32_t);
+        ptrace_msg_free(rsp);
+    }
+
+    return success ? 0 : -1;
+}
+
+static int simple_response(struct ptrace_msg_ctx *ctx,
+                           struct ptrace_msg *req, int32_t success)
+{
+    return ptrace_msg_response(ctx, req, &success, sizeof(success));
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, buf, len);
+        if (n < 0) {
+            if (EINTR == errno)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * The tracing session, run by traced with us as its consumer: traced writes
+ * the trace into g_cfg.out_file, as `perfetto -o` does, and tells us when the
+ * session has started and stopped.
+ *
+ * How long it takes is measured along the way: from the start asked to the
+ * first data the producers commit into traced's buffers, seen in TraceStats,
+ * and to the first bytes of the file, both polled by a probe thread every
+ * TRACING_PROBE_US; from the stop asked to the file complete.
+ */
+#define TRACING_FLUSH_TIMEOUT_MS    5000
+#define TRACING_PROBE_US            1000
+
+/* shared with the SDK's callbacks, which may outlive the session */
+struct tracing_state {
+    std::mutex lock;
+    std::condition_variable cond;
+    struct ptrace_msg_tracing_stats stats = {};
+    int stopping = 0;       /* the stop is asked, the probe quits */
+    std::string error;      /* traced failed the session, or is gone */
+    ::perfetto::TracingSession *session = NULL;     /* for the probe */
+    int fd = -1;            /* the output file, for the probe */
+    int probing = 0;
+    pthread_t probe;
+};
+
+struct tracing {
+    std::unique_ptr<::perfetto::TracingSession> session;
+    std::shared_ptr<struct tracing_state> state;
+};
+
+static struct tracing g_tracing;
+static struct ptrace_msg_tracing_stats g_tracing_stats;    /* the last one */
+
+static void tracing_init(void)
+{
+    static int inited;
+    ::perfetto::TracingInitArgs args;
+
+    if (inited)
+        return;
+
+    args.backends |= ::perfetto::kSystemBackend;
+    ::perfetto::Tracing::Initialize(args);
+    inited = 1;
+}
+
+static int tracing_failed(void)
+{
+    std::lock_guard<std::mutex> lk(g_tracing.state->lock);
+
+    if (g_tracing.state->error.empty())
+        return 0;
+
+    fprintf(stderr, "tracing failed: %s\n", g_tracing.state->error.c_str());
+
+    return 1;
+}
+
+/*
+ * Once the session has started: the first data is somewhere between the
+ * probe before and the one which sees it, the time of the latter is kept.
+ */
+static void *probe_thread(void *arg)
+{
+    int data = 1, file = 1, seen_data, seen_file;
+    uint64_t bytes, now;
+    struct stat st;
+    struct tracing_state *state = (struct tracing_state *)arg;
+    ::perfetto::TracingSession::GetTraceStatsCallbackArgs args;
+    std::unique_lock<std::mutex> lk(state->lock);
+
+    state->cond.wait(lk, [state] {
+            return state->stats.started || state->stopping; });
+
+    while (!state->stopping && (data || file)) {
+        lk.unlock();
+
+        seen_data = seen_file = 0;
+        if (data) {
+            args = state->session->GetTraceStatsBlocking();
+            if (!args.success || ptrace_stats_bytes_written(
+                        args.trace_stats_data.data(),
+                        args.trace_stats_data.size(), &bytes) < 0)
+                data = 0;   /* no TraceStats, give up on them */
+            else
+                seen_data = bytes > 0;
+        }
+        if (file && 0 == fstat(state->fd, &st))
+            seen_file = st.st_size > 0;
+        now = ::perfetto::base::GetBootTimeNs().count();
+
+        lk.lock();
+        if (seen_data) {
+            state->stats.first_data = now;
+            data = 0;
+        }
+        if (seen_file) {
+            state->stats.first_file = now;
+            file = 0;
+        }
+        state->cond.wait_for(lk, std::chrono::microseconds(TRACING_PROBE_US),
+                             [state] { return state->stopping; });
+    }
+
+    return NULL;
+}
+
+static void stop_probe(struct tracing_state *state)
+{
+    if (!state->probing)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lk(state->lock);
+        state->stopping = 1;
+        state->cond.notify_all();
+    }
+    pthread_join(state->probe, NULL);
+    state->probing = 0;
+}
+
+/* "<n>ms" from one step of the session to another, "-" if either is unknown */
+static const char *tracing_latency(char *buf, size_t size,
+                                   uint64_t from, uint64_t to)
+{
+    if (!from || !to || to < from)
+        return "-";
+
+    snprintf(buf, size, "%.1fms", (double)(to - from) / 1000000.0);
+
+    return buf;
+}
+
+static void print_tracing_stats(const char *who,
+                                const struct ptrace_msg_tracing_stats *stats)
+{
+    char b[5][32];
+
+    printf("%s: started %s, first data %s, first write %s after the start; "
+           "flushed %s, closed %s after the stop\n", who,
+           tracing_latency(b[0], sizeof(b[0]), stats->start, stats->started),
+           tracing_latency(b[1], sizeof(b[1]), stats->start, stats->first_data),
+           tracing_latency(b[2], sizeof(b[2]), stats->start, stats->first_file),
+           tracing_latency(b[3], sizeof(b[3]), stats->stop, stats->flushed),
+           tracing_latency(b[4], sizeof(b[4]), stats->stop, stats->closed));
+}
+
+/*
+ * Set a session up with g_cfg.cfg_file, started now or, if deferred, by
+ * trigger_tracing() later.
+ */
+static int setup_tracing(int deferred)
+{
+    int fd;
+    std::string buf;
+    ::perfetto::TraceConfig cfg;
+    std::shared_ptr<struct tracing_state> state;
+
+    if (ptrace_config_load(g_cfg.cfg_file, &buf) < 0
+        || !cfg.ParseFromString(buf))
+        return -1;
+    cfg.set_deferred_start(deferred);
+    cfg.set_write_into_file(true);  /* else traced keeps it for a reader */
+
+    fd = open(g_cfg.out_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "open %s failed, errno = %d\n", g_cfg.out_file, errno);
+        return -1;
+    }
+
+    tracing_init();
+
+    state = std::make_shared<struct tracing_state>();
+    g_tracing.state = state;
+    g_tracing.session = ::perfetto::Tracing::NewTrace(::perfetto::kSystemBackend);
+    g_tracing.session->SetOnErrorCallback(
+        [state](::perfetto::TracingError err) {
+            std::lock_guard<std::mutex> lk(state->lock);
+            state->error = err.message;
+            state->cond.notify_all();
+        });
+    g_tracing.session->Setup(cfg, fd);  /* traced gets a dup */
+
+    /* ours is kept for the probe to watch the file grow */
+    state->session = g_tracing.session.get();
+    state->fd = fd;
+    if (0 == pthread_create(&state->probe, NULL, probe_thread, state.get()))
+        state->probing = 1;
+    else
+        fprintf(stderr, "create probe thread failed, no latencies\n");
+
+    return 0;
+}
+
+static void free_tracing(void)
+{
+    stop_probe(g_tracing.state.get());
+    close(g_tracing.state->fd);
+    g_tracing.session.reset();
+    g_tracing.state.reset();
+}
+
+/* start is when it was asked */
+static int begin_tracing(uint64_t start)
+{
+    struct tracing_state *state = g_tracing.state.get();
+
+    /* returns once all the data sources have started */
+    g_tracing.session->StartBlocking();
+
+    {
+        std::lock_guard<std::mutex> lk(state->lock);
+        state->stats.start = start;
+        state->stats.started = ::perfetto::base::GetBootTimeNs().count();
+        state->cond.notify_all();
+    }
+
+    return tracing_failed() ? -1 : 0;
+}
+
+static int start_tracing(void)
+{
+    uint64_t start = ::perfetto::base::GetBootTimeNs().count();
+
+    if (g_tracing.session)
+        return 0;
+
+    printf("start tracing...\n");
+
+    if (setup_tracing(0) < 0)
+        return -1;
+
+    if (begin_tracing(start) < 0) {
+        free_tracing();
+        return -1;
+    }
+
+    printf("tracing started\n");
+
+    return 0;
+}
+
+/*
+ * Set the session up in advance, traced creates the buffers and the data
+ * sources get ready, so trigger_tracing() only has to start them.
+ */
+static int arm_tracing(void)
+{
+    if (g_tracing.session)
+        return 0;
+
+    printf("arm tracing\n");
+
+    return setup_tracing(1);
+}
+
+static int trigger_tracing(void)
+{
+    return begin_tracing(::perfetto::base::GetBootTimeNs().count());
+}
+
+/*
+ * Begin to stop: the producers flush what they have got, then the session
+ * is stopped by wait_tracing(). Like `perfetto` on SIGTERM.
+ */
+static int signal_tracing(void)
+{
+    std::shared_ptr<struct tracing_state> state = g_tracing.state;
+
+    if (!g_tracing.session)
+        return 0;
+
+    {
+        std::lock_guard<std::mutex> lk(state->lock);
+        state->stats.stop = ::perfetto::base::GetBootTimeNs().count();
+        state->stopping = 1;
+        state->cond.notify_all();
+    }
+
+    g_tracing.session->Flush([state](bool success) {
+            std::lock_guard<std::mutex> lk(state->lock);
+            state->stats.flushed = ::perfetto::base::GetBootTimeNs().count();
+            state->cond.notify_all();
+        }, TRACING_FLUSH_TIMEOUT_MS);
+
+    return 0;
+}
+
+/*
+ * returns once traced has written the rest of the trace, its latencies are
+ * kept in g_tracing_stats
+ */
+static int wait_tracing(void)
+{
+    int rc;
+    struct tracing_state *state = g_tracing.state.get();
+
+    if (!g_tracing.session)
+        return 0;
+
+    stop_probe(state);
+
+    {
+        std::unique_lock<std::mutex> lk(state->lock);
+        state->cond.wait_for(lk,
+                std::chrono::milliseconds(TRACING_FLUSH_TIMEOUT_MS + 1000),
+                [state] {
+                    return state->stats.flushed || !state->error.empty(); });
+    }
+
+    g_tracing.session->StopBlocking();
+    rc = tracing_failed() ? -1 : 0;
+
+    {
+        std::lock_guard<std::mutex> lk(state->lock);
+        state->stats.closed = ::perfetto::base::GetBootTimeNs().count();
+        g_tracing_stats = state->stats;
+    }
+    if (g_tracing_stats.started)
+        print_tracing_stats("tracing latency", &g_tracing_stats);
+
+    free_tracing();
+
+    return rc;
+}
+
+static int stop_tracing(void)
+{
+    if (!g_tracing.session)
+        return 0;
+
+    printf("stop tracing...\n");
+
+    if (signal_tracing() < 0)
+        return -1;
+
+    return wait_tracing();
+}
+
+/*
+ * An action taken by a thread at a boot time instant. It sleeps until a bit
+ * before and spins the rest, as a sleep wakes up tens of us late.
+ */
+#define SCHED_SPIN_NS   (200 * 1000)
+
+struct sched_action {
+    uint64_t at;            /* boot time to act at */
+    int (*fn)(void);
+    int rc;
+    uint64_t actual;        /* boot time fn returned at */
+    int efd;                /* eventfd written when done, or -1 */
+    pthread_t tid;
+};
+
+static void *sched_thread(void *arg)
+{
+    struct sched_action *act = (struct sched_action *)arg;
+    uint64_t wake, val = 1;
+    struct timespec ts;
+
+    if (act->at > (uint64_t)::perfetto::base::GetBootTimeNs().count()
+                  + SCHED_SPIN_NS) {
+        wake = act->at - SCHED_SPIN_NS;
+        ts.tv_sec = wake / 1000000000;
+        ts.tv_nsec = wake % 1000000000;
+        while (EINTR == clock_nanosleep(CLOCK_BOOTTIME, TIMER_ABSTIME,
+                                        &ts, NULL)) {}
+    }
+
+    while ((uint64_t)::perfetto::base::GetBootTimeNs().count() < act->at) {}
+
+    act->rc = act->fn();
+    act->actual = ::perfetto::base::GetBootTimeNs().count();
+
+    if (act->efd >= 0 && write(act->efd, &val, sizeof(val)) < 0)
+        fprintf(stderr, "notify schedule failed, errno = %d\n", errno);
+
+    return NULL;
+}
+
+static int sched_action_start(struct sched_action *act, uint64_t at,
+                              int (*fn)(void), int efd)
+{
+    act->at = at;
+    act->fn = fn;
+    act->rc = -1;
+    act->actual = 0;
+    act->efd = efd;
+
+    if (0 != pthread_create(&act->tid, NULL, sched_thread, act)) {
+        fprintf(stderr, "create schedule thread failed\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* returns 1 if the server is a coordinator, which starts and stops us */
+static int connect_server(struct ptrace_msg_ctx *ctx, struct sockaddr_in *dest)
+{
+    int rc = -1;
+    struct ptrace_msg *rsp = NULL;
+    struct ptrace_msg_connect_rsp *crsp;
+
+    printf("connect to server(%s:%d)\n",
+           inet_ntoa(dest->sin_addr), ntohs(dest->sin_port));
+
+    if (ptrace_msg_request(ctx, dest, PTRACE_MSG_ID_CONNECT,
+                           NULL, 0, &rsp, 3000) < 0)
+        return -1;
+
+    crsp = PTRACE_MSG_DATA_PTR(rsp, struct ptrace_msg_connect_rsp);
+    if (rsp->data_len >= sizeof(crsp->success) && crsp->success)
+        rc = (rsp->data_len >= sizeof(*crsp) && crsp->coordinated) ? 1 : 0;
+    ptrace_msg_free(rsp);
+
+    return rc;
+}
+
+static void disconnect_server(struct ptrace_msg_ctx *ctx, struct sockaddr_in *dest)
+{
+    printf("disconnect server\n");
+    simple_request(ctx, dest, PTRACE_MSG_ID_DISCONNECT, NULL, 0, 3000);
+}
+
+/*
+ * Clock offset estimation by NTP-style probes. A probe sent at t1 by the
+ * client is received at t2 and answered at t3 by the server, and the answer
+ * arrives at t4, so with o the offset of the server's clock:
+ *
+ *   t2 = t1 + o + d1,  t4 = t3 - o + d2   (d1, d2 >= 0: one-way delays)
+ *   o = ((t2 - t1) + (t3 - t4)) / 2 + (d2 - d1) / 2
+ *
+ * The first term is the estimate, the second its unknown error, bounded by
+ * half the round trip time rtt = (t4 - t1) - (t3 - t2). Queueing only ever
+ * adds delay, the probes with the smallest rtt are the most accurate.
+ */
+#define CLOCK_PROBES        200
+#define CLOCK_KEEP          (CLOCK_PROBES / 8)
+#define CLOCK_MIN_SAMPLES   16
+#define CLOCK_INTERVAL_US   1000
+#define CLOCK_RESYNC_SECONDS    60
+
+struct clock_sample {
+    uint64_t time;          /* (t1 + t4) / 2 */
+    int64_t offset;
+    uint64_t rtt;
+};
+
+struct clock_estimate {
+    uint64_t time;          /* client's boot time it holds at */
+    int64_t offset;         /* server's clock - client's, nanosecond */
+    uint64_t error;         /* the true offset is within offset +/- error */
+    uint64_t min_rtt;
+    int samples;            /* probes answered */
+};
+
+static int cmp_clock_sample(const void *a, const void *b)
+{
+    uint64_t x = ((const struct clock_sample *)a)->rtt;
+    uint64_t y = ((const struct clock_sample *)b)->rtt;
+
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static int clock_probe(struct ptrace_msg_ctx *ctx, struct sockaddr_in *dest,
+                       struct clock_sample *sample)
+{
+    uint64_t t1, t4;
+    struct ptrace_msg *rsp = NULL;
+    struct ptrace_msg_clock_data *data;
+
+    /*
+     * A retransmitted probe would not measure the round trip. t1 and t4 are
+     * the kernel's timestamps, free of the scheduling delays around the
+     * system calls, where it gives them.
+     */
+    if (ptrace_msg_request_once(ctx, dest, PTRACE_MSG_ID_CLOCK,
+                                NULL, 0, &rsp, 1000, &t1) < 0)
+        return -1;
+    t4 = rsp->rx_time;
+
+    data = PTRACE_MSG_DATA_PTR(rsp, struct ptrace_msg_clock_data);
+    if (rsp->data_len < sizeof(*data) || data->t3 < data->t2
+        || t4 - t1 < data->t3 - data->t2) {
+        ptrace_msg_free(rsp);
+        return -1;
+    }
+
+    sample->time = t1 + (t4 - t1) / 2;
+    sample->offset = ((int64_t)(data->t2 - t1) + (int64_t)(data->t3 - t4)) / 2;
+    sample->rtt = (t4 - t1) - (data->t3 - data->t2);
+    ptrace_msg_free(rsp);
+
+    return 0;
+}
+
+/*
+ * Every kept sample says the offset is within its offset +/- rtt/2, the
+ * estimate is the intersection of those intervals. Drift or a timestamp
+ * taken late can make it empty, then the best sample alone is used.
+ */
+static int estimate_clock(struct ptrace_msg_ctx *ctx, struct sockaddr_in *dest,
+                          struct clock_estimate *est)
+{
+    int i, cnt = 0, keep;
+    int64_t lo, hi, dt = 0;
+    struct clock_sample samples[CLOCK_PROBES];
+
+    for (i = 0; i < CLOCK_PROBES; i++) {
+        if (0 == clock_probe(ctx, dest, &samples[cnt]))
+            cnt++;
+        else if (0 == cnt && i >= CLOCK_MIN_SAMPLES)
+            break;  /* the server is gone */
+        usleep(CLOCK_INTERVAL_US);
+    }
+
+    if (cnt < CLOCK_MIN_SAMPLES) {
+        fprintf(stderr, "only %d of %d clock probes answered\n",
+                cnt, CLOCK_PROBES);
+        return -1;
+    }
+
+    qsort(samples, cnt, sizeof(samples[0]), cmp_clock_sample);
+    keep = cnt < CLOCK_KEEP ? cnt : CLOCK_KEEP;
+
+    lo = samples[0].offset - (int64_t)(samples[0].rtt / 2);
+    hi = samples[0].offset + (int64_t)((samples[0].rtt + 1) / 2);
+    for (i = 0; i < keep; i++)
+        dt += (int64_t)(samples[i].time - samples[0].time) / keep;
+    for (i = 1; i < keep; i++) {
+        if (samples[i].offset - (int64_t)(samples[i].rtt / 2) > lo)
+            lo = samples[i].offset - (int64_t)(samples[i].rtt / 2);
+        if (samples[i].offset + (int64_t)((samples[i].rtt + 1) / 2) < hi)
+            hi = samples[i].offset + (int64_t)((samples[i].rtt + 1) / 2);
+    }
+
+    if (lo > hi) {
+        lo = samples[0].offset - (int64_t)(samples[0].rtt / 2);
+        hi = samples[0].offset + (int64_t)((samples[0].rtt + 1) / 2);
+        dt = 0;
+    }
+
+    est->time = samples[0].time + dt;
+    est->offset = lo + (hi - lo) / 2;
+    est->error = (hi - lo + 1) / 2;
+    est->min_rtt = samples[0].rtt;
+    est->samples = cnt;
+
+    printf("clock offset: %" PRId64 "ns +/- %" PRIu64 "ns, %d/%d probes, "
+           "min rtt %" PRIu64 "ns\n",
+           est->offset, est->error, cnt, CLOCK_PROBES, est->min_rtt);
+
+    return 0;
+}
+
+static int send_time(struct ptrace_msg_ctx *ctx, struct sockaddr_in *dest,
+                     const struct clock_estimate *est)
+{
+    struct ptrace_msg_time_data data;
+
+    data.time = est->time;
+    data.offset = est->offset;
+    data.error = est->error;
+
+    return simple_request(ctx, dest,
+                          PTRACE_MSG_ID_TIME, &data, sizeof(data), 3000);
+}
+
+/*
+ * The periodic resync of a client runs in a thread, from a message context of
+ * its own, so neither the control loop nor the coordinator's requests wait
+ * for its probes. The main thread sends the estimates: the server keeps the
+ * samples by the address of the client's context.
+ */
+struct clock_resync {
+    struct sockaddr_in dest;
+    pthread_t tid;
+    int running;
+    std::mutex lock;
+    std::condition_variable cond;
+    int stopping;
+    int ready;                  /* est is not sent yet */
+    struct clock_estimate est;
+};
+
+static void *resync_thread(void *arg)
+{
+    int rc;
+    struct clock_resync *rs = (struct clock_resync *)arg;
+    struct clock_estimate est;
+    struct ptrace_msg_ctx *ctx;
+    std::unique_lock<std::mutex> lk(rs->lock);
+
+    ctx = ptrace_msg_ctx_create(NULL);
+    if (!ctx) {
+        fprintf(stderr, "create resync context failed, no resync\n");
+        return NULL;
+    }
+
+    while (!rs->cond.wait_for(lk, std::chrono::seconds(CLOCK_RESYNC_SECONDS),
+                              [rs] { return rs->stopping; })) {
+        lk.unlock();
+        printf("\n");
+        rc = estimate_clock(ctx, &rs->dest, &est);
+        lk.lock();
+
+        if (0 == rc) {
+            rs->est = est;
+            rs->ready = 1;
+        }
+    }
+
+    lk.unlock();
+    ptrace_msg_ctx_destroy(ctx);
+
+    return NULL;
+}
+
+static void start_resync(struct clock_resync *rs, struct sockaddr_in *dest)
+{
+    memcpy(&rs->dest, dest, sizeof(rs->dest));
+    rs->stopping = rs->ready = 0;
+    rs->running = 0 == pthread_create(&rs->tid, NULL, resync_thread, rs);
+    if (!rs->running)
+        fprintf(stderr, "create resync thread failed, no resync\n");
+}
+
+/* send the latest estimate of the thread, if any, and keep it in *est */
+static void poll_resync(struct ptrace_msg_ctx *ctx, struct clock_resync *rs,
+                        struct clock_estimate *est)
+{
+    {
+        std::lock_guard<std::mutex> lk(rs->lock);
+        if (!rs->ready)
+            return;
+        *est = rs->est;
+        rs->ready = 0;
+    }
+
+    send_time(ctx, &rs->dest, est);
+}
+
+static void stop_resync(struct ptrace_msg_ctx *ctx, struct clock_resync *rs,
+                        struct clock_estimate *est)
+{
+    if (!rs->running)
+        return;
+
+    {
+        std::lock_guard<std::mutex> lk(rs->lock);
+        rs->stopping = 1;
+        rs->cond.notify_all();
+    }
+    pthread_join(rs->tid, NULL);
+    rs->running = 0;
+    poll_resync(ctx, rs, est);
+}
+
+static int start_server_tracing(struct ptrace_msg_ctx *ctx,
+                                struct sockaddr_in *dest)
+{
+    printf("start server tracing\n");
+    return simple_request(ctx, dest,
+                          PTRACE_MSG_ID_START_TRACING, NULL, 0, 3000);
+}
+
+/* stats: the latencies of the server's session, zeroed if unknown */
+static int stop_server_tracing(struct ptrace_msg_ctx *ctx,
+                               struct sockaddr_in *dest,
+                               struct ptrace_msg_tracing_stats *stats)
+{
+    int rc = -1;
+    struct ptrace_msg *rsp = NULL;
+    struct ptrace_msg_tracing_rsp *trsp;
+
+    printf("stop server tracing\n");
+
+    memset(stats, 0, sizeof(*stats));
+    if (ptrace_msg_request(ctx, dest, PTRACE_MSG_ID_STOP_TRACING,
+                           NULL, 0, &rsp, 3000) < 0)
+        return -1;
+
+    trsp = PTRACE_MSG_DATA_PTR(rsp, struct ptrace_msg_tracing_rsp);
+    if (rsp->data_len >= sizeof(trsp->success) && trsp->success) {
+        rc = 0;
+        if (rsp->data_len >= sizeof(*trsp))
+            *stats = trsp->stats;
+    }
+    ptrace_msg_free(rsp);
+
+    return rc;
+}
+
+/*
+ * The server's latencies, and how far apart the two hosts began to capture:
+ * when their data sources started and when their first data came, the
+ * server's times moved onto our clock.
+ */
+static void print_start_skew(const struct clock_estimate *est,
+                             const struct ptrace_msg_tracing_stats *server)
+{
+    const struct ptrace_msg_tracing_stats *client = &g_tracing_stats;
+
+    if (!server->started)
+        return;
+
+    print_tracing_stats("server tracing latency", server);
+    if (!client->started)
+        return;
+
+    printf("start skew measured: %+.1fus started",
+           (double)(int64_t)(client->started + est->offset - server->started)
+           / 1000.0);
+    if (client->first_data && server->first_data)
+        printf(", %+.1fus first data",
+               (double)(int64_t)(client->first_data + est->offset
+                                 - server->first_data) / 1000.0);
+    printf(" (client - server), +/- %.1fus clock error\n",
+           est->error / 1000.0);
+}
+
+/*
+ * Start or stop the tracing of both hosts at one instant g_cfg.sched_ms
+ * ahead: the server's instant is ours moved by the clock offset, each host
+ * arms itself in advance and acts on time, then the skew is reported.
+ */
+static int sched_tracing(struct ptrace_msg_ctx *ctx, struct sockaddr_in *dest,
+                         const struct clock_estimate *est, int start)
+{
+    int rc;
+    uint64_t now;
+    struct sched_action act;
+    struct ptrace_msg *rsp = NULL;
+    struct ptrace_msg_tracing_data data;
+    struct ptrace_msg_tracing_rsp *trsp;
+    const char *what = start ? "start" : "stop";
+
+    if (start && arm_tracing() < 0)
+        return -1;
+
+    now = ::perfetto::base::GetBootTimeNs().count();
+    data.at = now + (uint64_t)g_cfg.sched_ms * 1000000 + est->offset;
+    printf("%s tracing of both hosts in %ums\n", what, g_cfg.sched_ms);
+    if (sched_action_start(&act, data.at - est->offset,
+                           start ? trigger_tracing : signal_tracing, -1) < 0) {
+        if (start)
+            stop_tracing();
+        return -1;
+    }
+
+    /* answered after the server has acted */
+    rc = ptrace_msg_request(ctx, dest, start ? PTRACE_MSG_ID_START_TRACING
+                                             : PTRACE_MSG_ID_STOP_TRACING,
+                            &data, sizeof(data), &rsp, g_cfg.sched_ms + 3000);
+
+    pthread_join(act.tid, NULL);
+    if (start && act.rc < 0)
+        stop_tracing();         /* disarm */
+    else if (!start && 0 == act.rc)
+        act.rc = wait_tracing();
+
+    trsp = 0 == rc ? PTRACE_MSG_DATA_PTR(rsp, struct ptrace_msg_tracing_rsp)
+                   : NULL;
+    if (!trsp || rsp->data_len < sizeof(*trsp) || !trsp->success) {
+        fprintf(stderr, "server %s tracing failed\n", what);
+        rc = -1;
+    } else if (trsp->actual) {
+        printf("%s skew: %+.1fus (client - server), %.1fus/%.1fus after "
+               "the instant, +/- %.1fus clock error\n", what,
+               (double)(int64_t)(act.actual + est->offset - trsp->actual)
+               / 1000.0,
+               (double)(int64_t)(act.actual - act.at) / 1000.0,
+               (double)(int64_t)(trsp->actual - data.at) / 1000.0,
+               est->error / 1000.0);
+        if (!start)
+            print_start_skew(est, &trsp->stats);
+    } else {
+        printf("the server was %s already\n", start ? "tracing" : "stopped");
+    }
+
+    ptrace_msg_free(rsp);
+
+    return (rc < 0 || act.rc < 0) ? -1 : 0;
+}
+
+static uint64_t now_ns(void)
+{
+    return ::perfetto::base::GetBootTimeNs().count();
+}
+
+struct file_sender {
+    struct ptrace_msg_ctx *ctx;
+    struct sockaddr_in *dest;
+    int fd;
+    uint64_t size;
+    uint32_t chunk_size;
+    uint64_t nchunks;
+    uint64_t sent_bytes;            /* payload bytes put on the wire */
+    int codec;                      /* PTRACE_FILE_CODEC_XXX */
+    uint64_t base;                  /* the first chunk not acked */
+    uint64_t next;                  /* the next chunk never sent */
+    uint64_t acked_cnt;
+    std::vector<uint8_t> acked;
+    std::vector<uint64_t> sent_ns;  /* when last sent, for the timeout */
+    std::vector<uint8_t> resent;    /* retransmitted, no RTT sample */
+    std::vector<char> raw;          /* a chunk before compression */
+    double cwnd;                    /* congestion window, in chunks */
+    uint64_t srtt;                  /* nanosecond */
+    uint64_t rto;                   /* nanosecond */
+    int batch_cnt;                  /* chunks queued in g_send_buff */
+    struct ptrace_msg *batch[PTRACE_MSG_BATCH];
+};
+
+#define FILE_CWND_MIN       4
+#define FILE_RTO_MIN        (2ULL * 1000 * 1000)
+#define FILE_RTO_MAX        (1000ULL * 1000 * 1000)
+#define FILE_STALL_TIMEOUT  (10ULL * 1000 * 1000 * 1000)
+
+static int flush_chunks(struct file_sender *fs)
+{
+    int rc = 0;
+
+    if (fs->batch_cnt > 0)
+        rc = ptrace_msg_send_batch(fs->ctx, fs->batch, fs->batch_cnt);
+    fs->batch_cnt = 0;
+
+    return rc;
+}
+
+/* queue a chunk, they are sent by sendmmsg() once the batch is full */
+static int send_chunk(struct file_sender *fs, uint64_t idx)
+{
+    ssize_t n;
+    uLongf zlen;
+    struct ptrace_msg *msg = (struct ptrace_msg *)g_send_buff[fs->batch_cnt];
+    struct ptrace_msg_file_chunk *chunk;
+    uint64_t offset = idx * fs->chunk_size;
+
+    chunk = PTRACE_MSG_DATA_PTR(msg, struct ptrace_msg_file_chunk);
+    chunk->offset = offset;
+
+    n = pread(fs->fd, fs->raw.data(), fs->chunk_size, offset);
+    if (n <= 0) {
+        fprintf(stderr, "read chunk %" PRIu64 " failed, errno = %d\n",
+                idx, errno);
+        return -1;
+    }
+
+    chunk->crc = ptrace_crc32c(0, fs->raw.data(), n);
+
+    zlen = fs->chunk_size;
+    if (PTRACE_FILE_CODEC_ZLIB == fs->codec
+        && Z_OK == compress2((Bytef *)chunk->data, &zlen,
+                             (Bytef *)fs->raw.data(), n, g_cfg.zlevel)
+        && zlen < (uLongf)n)
+        n = zlen;
+    else
+        memcpy(chunk->data, fs->raw.data(), n);
+    fs->sent_bytes += n;
+
+    msg->id = PTRACE_MSG_ID_FILE_CONTENT;
+    msg->type = PTRACE_MSG_TYPE_NTF;
+    msg->data_len = sizeof(*chunk) + n;
+    memcpy(&msg->dest, fs->dest, sizeof(msg->dest));
+
+    fs->batch[fs->batch_cnt++] = msg;
+    if (PTRACE_MSG_BATCH == fs->batch_cnt)
+        return flush_chunks(fs);
+
+    return 0;
+}
+
+static void handle_file_ack(struct file_sender *fs,
+                            const struct ptrace_msg_file_ack *ack)
+{
+    uint64_t i, idx, now = now_ns();
+    uint64_t newly_acked = 0;
+    int sampled = 0;
+
+    for (i = fs->base; i < ack->cum_chunks && i < fs->next; i++) {
+        if (fs->acked[i])
+            continue;
+
+        /* Karn: only sample chunks which are never retransmitted */
+        if (!fs->resent[i] && i + 1 == ack->cum_chunks) {
+            uint64_t rtt = now - fs->sent_ns[i];
+            fs->srtt = fs->srtt ? (fs->srtt * 7 + rtt) / 8 : rtt;
+            sampled = 1;
+        }
+
+        fs->acked[i] = 1;
+        newly_acked++;
+    }
+
+    for (i = 0; i < PTRACE_FILE_WINDOW; i++) {
+        idx = ack->cum_chunks + 1 + i;
+        if (idx >= fs->next)
+            break;
+        if ((ack->sack[i / 64] & (1ULL << (i % 64))) && !fs->acked[idx]) {
+            fs->acked[idx] = 1;
+            newly_acked++;
+        }
+    }
+
+    while (fs->base < fs->next && fs->acked[fs->base])
+        fs->base++;
+
+    fs->acked_cnt += newly_acked;
+
+    /* slow start, then additive increase */
+    if (fs->cwnd < PTRACE_FILE_WINDOW / 4)
+        fs->cwnd += newly_acked;
+    else
+        fs->cwnd += (double)newly_acked / fs->cwnd;
+    if (fs->cwnd > PTRACE_FILE_WINDOW)
+        fs->cwnd = PTRACE_FILE_WINDOW;
+
+    /* a backed off rto is kept until a clean sample comes */
+    if (sampled) {
+        fs->rto = fs->srtt * 4;
+        if (fs->rto < FILE_RTO_MIN)
+            fs->rto = FILE_RTO_MIN;
+    }
+}
+
+static int retransmit_chunks(struct file_sender *fs)
+{
+    uint64_t i, now = now_ns();
+    int lost = 0;
+
+    for (i = fs->base; i < fs->next; i++) {
+        if (fs->acked[i] || now - fs->sent_ns[i] < fs->rto)
+            continue;
+
+        if (send_chunk(fs, i) < 0)
+            return -1;
+
+        fs->sent_ns[i] = now;
+        fs->resent[i] = 1;
+        lost = 1;
+    }
+
+    if (flush_chunks(fs) < 0)
+        return -1;
+
+    if (lost) {
+        fs->cwnd /= 2;
+        if (fs->cwnd < FILE_CWND_MIN)
+            fs->cwnd = FILE_CWND_MIN;
+        fs->rto *= 2;
+        if (fs->rto > FILE_RTO_MAX)
+            fs->rto = FILE_RTO_MAX;
+    }
+
+    return 0;
+}
+
+/* skip the chunks the server kept from an interrupted transfer */
+static void resume_chunks(struct file_sender *fs,
+                          const struct ptrace_msg_file_ack *ack)
+{
+    uint64_t i, idx;
+
+    for (i = 0; i < ack->cum_chunks && i < fs->nchunks; i++)
+        fs->acked[i] = 1;
+
+    for (i = 0; i < PTRACE_FILE_WINDOW; i++) {
+        idx = ack->cum_chunks + 1 + i;
+        if (idx >= fs->nchunks)
+            break;
+        if (ack->sack[i / 64] & (1ULL << (i % 64)))
+            fs->acked[idx] = 1;
+    }
+
+    for (i = 0; i < fs->nchunks; i++)
+        fs->acked_cnt += fs->acked[i];
+
+    while (fs->base < fs->nchunks && fs->acked[fs->base])
+        fs->base++;
+    fs->next = fs->base;
+
+    if (fs->acked_cnt)
+        printf("resume from chunk %" PRIu64 ", %" PRIu64 "/%" PRIu64
+               " chunks received\n",
+               fs->base, fs->acked_cnt, fs->nchunks);
+}
+
+/*
+ * Sliding window upload: up to cwnd chunks are in flight, the server acks them
+ * cumulatively and selectively, and unacked chunks are retransmitted after rto.
+ */
+static int send_file_udp(struct ptrace_msg_ctx *ctx, struct sockaddr_in *dest,
+                         int fd, uint64_t size, uint32_t crc, uint64_t *sent)
+{
+    int i, n, percent = -1;
+    struct ptrace_msg *rsp = NULL, *rsps[PTRACE_MSG_BATCH];
+    struct ptrace_msg_file_info info;
+    struct ptrace_msg_file_rsp *frsp;
+    struct file_sender fs;
+    uint64_t last_progress;
+
+    fs.ctx = ctx;
+    fs.dest = dest;
+    fs.fd = fd;
+    fs.size = size;
+    fs.chunk_size = sizeof(g_send_buff[0]) - sizeof(struct ptrace_msg)
+                    - sizeof(struct ptrace_msg_file_chunk);
+    fs.nchunks = (fs.size + fs.chunk_size - 1) / fs.chunk_size;
+    fs.base = fs.next = fs.acked_cnt = 0;
+    fs.acked.assign(fs.nchunks, 0);
+    fs.sent_ns.assign(fs.nchunks, 0);
+    fs.resent.assign(fs.nchunks, 0);
+    fs.raw.resize(fs.chunk_size);
+    fs.cwnd = FILE_CWND_MIN;
+    fs.srtt = 0;
+    fs.rto = FILE_RTO_MIN * 10;
+    fs.batch_cnt = 0;
+    fs.sent_bytes = 0;
+
+    memset(&info, 0, sizeof(info));
+    info.size = fs.size;
+    info.crc = crc;
+    info.chunk_size = fs.chunk_size;
+    info.channel = PTRACE_FILE_CHANNEL_UDP;
+    info.codec = g_cfg.zlevel ? PTRACE_FILE_CODEC_ZLIB : PTRACE_FILE_CODEC_NONE;
+    if (ptrace_msg_request(ctx, dest, PTRACE_MSG_ID_FILE_BEGIN,
+                           &info, sizeof(info), &rsp, 3000) < 0)
+        return -1;
+
+    frsp = PTRACE_MSG_DATA_PTR(rsp, struct ptrace_msg_file_rsp);
+    if (rsp->data_len < sizeof(*frsp) || !frsp->success) {
+        ptrace_msg_free(rsp);
+        return -1;
+    }
+    fs.codec = frsp->codec;
+    resume_chunks(&fs, &frsp->resume);
+    ptrace_msg_free(rsp);
+
+    last_progress = now_ns();
+    while (fs.base < fs.nchunks) {
+        while (fs.next < fs.nchunks && fs.next < fs.base + (uint64_t)fs.cwnd) {
+            if (!fs.acked[fs.next]) {
+                if (send_chunk(&fs, fs.next) < 0)
+                    return -1;
+                fs.sent_ns[fs.next] = now_ns();
+            }
+            fs.next++;
+        }
+        if (flush_chunks(&fs) < 0)
+            return -1;
+
+        n = ptrace_msg_recv_batch(ctx, rsps, PTRACE_MSG_BATCH,
+                                  fs.rto / 1000000 + 1);
+        for (i = 0; i < n; i++) {
+            if (PTRACE_MSG_ID_FILE_ACK == rsps[i]->id &&
+                rsps[i]->data_len >= sizeof(struct ptrace_msg_file_ack)) {
+                uint64_t base = fs.base;
+                handle_file_ack(&fs, PTRACE_MSG_DATA_PTR(rsps[i],
+                                struct ptrace_msg_file_ack));
+                if (fs.base != base)
+                    last_progress = now_ns();
+            }
+        }
+
+        if (retransmit_chunks(&fs) < 0)
+            return -1;
+
+        if (now_ns() - last_progress > FILE_STALL_TIMEOUT) {
+            fprintf(stderr, "\nsend stalled at chunk %" PRIu64 "/%" PRIu64 "\n",
+                    fs.base, fs.nchunks);
+            return -1;
+        }
+
+        if (fs.nchunks && (int)(fs.acked_cnt * 100 / fs.nchunks) != percent) {
+            percent = fs.acked_cnt * 100 / fs.nchunks;
+            printf("\b\b\b\b%d%%", percent);
+            fflush(stdout);
+        }
+    }
+
+    *sent = fs.sent_bytes;
+
+    return 0;
+}
+
+#define FILE_TCP_SEND_BYTES (4 * 1024 * 1024)
+#define FILE_ZBUFF_SIZE     (256 * 1024)
+
+static int sendfile_all(int sockfd, int fd, uint64_t start, uint64_t size,
+                        uint64_t *sent)
+{
+    ssize_t n;
+    off_t offset = start;
+
+    while ((uint64_t)offset < size) {
+        n = sendfile(sockfd, fd, &offset, FILE_TCP_SEND_BYTES);
+        if (n <= 0) {
+            if (n < 0 && EINTR == errno)
+                continue;
+            fprintf(stderr, "\nsendfile failed, errno = %d\n", errno);
+            return -1;
+        }
+
+        *sent += n;
+        printf("\b\b\b\b%" PRIu64 "%%", (uint64_t)offset * 100 / size);
+        fflush(stdout);
+    }
+
+    return 0;
+}
+
+struct file_deflater {
+    int fd;                         /* the file to compress */
+    int out;                        /* write end of the pipe to the socket */
+    int rc;
+    uint64_t start;                 /* where to start in the file */
+    std::atomic<uint64_t> done;     /* the file is compressed up to here */
+};
+
+/* compress the whole file into the pipe, while the caller sends the pipe */
+static void *deflate_thread(void *arg)
+{
+    struct file_deflater *fz = (struct file_deflater *)arg;
+    int ret = Z_OK, flush = Z_NO_FLUSH;
+    ssize_t n;
+    z_stream zs;
+    char *in, *out;
+
+    memset(&zs, 0, sizeof(zs));
+    in = (char *)malloc(FILE_ZBUFF_SIZE);
+    out = (char *)malloc(FILE_ZBUFF_SIZE);
+    if (!in || !out || Z_OK != deflateInit(&zs, g_cfg.zlevel)) {
+        fprintf(stderr, "init deflate failed\n");
+        goto _out;
+    }
+
+    while (Z_FINISH != flush) {
+        n = pread(fz->fd, in, FILE_ZBUFF_SIZE, fz->start + zs.total_in);
+        if (n < 0) {
+            if (EINTR == errno)
+                continue;
+            fprintf(stderr, "\nread file failed, errno = %d\n", errno);
+            break;
+        }
+
+        flush = n ? Z_NO_FLUSH : Z_FINISH;
+        zs.next_in = (Bytef *)in;
+        zs.avail_in = n;
+        do {
+            zs.next_out = (Bytef *)out;
+            zs.avail_out = FILE_ZBUFF_SIZE;
+            ret = deflate(&zs, flush);
+            if (write_all(fz->out, out, FILE_ZBUFF_SIZE - zs.avail_out) < 0)
+                goto _end;
+        } while (0 == zs.avail_out);
+
+        fz->done = fz->start + zs.total_in;
+    }
+
+    fz->rc = (Z_STREAM_END == ret) ? 0 : -1;
+
+_end:
+    deflateEnd(&zs);
+_out:
+    free(in);
+    free(out);
+    close(fz->out);
+
+    return NULL;
+}
+
+/*
+ * Send the file as a zlib stream, compressed by another thread into a pipe
+ * which is spliced to the socket, so compression overlaps with the network.
+ */
+static int send_deflated(int sockfd, int fd, uint64_t start, uint64_t size,
+                         uint64_t *sent)
+{
+    int rc = 0;
+    int pipefd[2];
+    ssize_t n;
+    pthread_t tid;
+    struct file_deflater fz;
+
+    if (pipe(pipefd) < 0) {
+        fprintf(stderr, "create pipe failed, errno = %d\n", errno);
+        return -1;
+    }
+    fcntl(pipefd[1], F_SETPIPE_SZ, FILE_ZBUFF_SIZE * 4);
+
+    fz.fd = fd;
+    fz.out = pipefd[1];
+    fz.rc = -1;
+    fz.start = start;
+    fz.done = start;
+    if (0 != pthread_create(&tid, NULL, deflate_thread, &fz)) {
+        fprintf(stderr, "create deflate thread failed\n");
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return -1;
+    }
+
+    for (;;) {
+        n = splice(pipefd[0], NULL, sockfd, NULL, FILE_ZBUFF_SIZE,
+                   SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (0 == n)
+            break;
+        if (n < 0) {
+            if (EINTR == errno)
+                continue;
+            fprintf(stderr, "\nsplice to socket failed, errno = %d\n", errno);
+            rc = -1;
+            break;
+        }
+
+        *sent += n;
+        printf("\b\b\b\b%" PRIu64 "%%",
+               size ? (uint64_t)fz.done * 100 / size : 100);
+        fflush(stdout);
+    }
+
+    /* the thread gets EPIPE and stops if we bailed out early */
+    close(pipefd[0]);
+    pthread_join(tid, NULL);
+
+    return rc < 0 ? -1 : fz.rc;
+}
+
+/*
+ * Bulk upload over a TCP connection negotiated with FILE_BEGIN. A plain file
+ * is pushed by sendfile() so it never passes through user space, otherwise
+ * it is streamed through zlib.
+ * Returns 1 if the server doesn't offer a TCP channel.
+ */
+static int send_file_tcp(struct ptrace_msg_ctx *ctx, struct sockaddr_in *dest,
+                         int fd, uint64_t size, uint32_t crc, uint64_t *sent)
+{
+    int rc, codec, sockfd;
+    uint64_t start;
+    struct sockaddr_in addr;
+    struct ptrace_msg *rsp = NULL;
+    struct ptrace_msg_file_info info;
+    struct ptrace_msg_file_rsp *frsp;
+
+    memset(&info, 0, sizeof(info));
+    info.size = size;
+    info.crc = crc;
+    info.chunk_size = 0;
+    info.channel = PTRACE_FILE_CHANNEL_TCP;
+    info.codec = g_cfg.zlevel ? PTRACE_FILE_CODEC_ZLIB : PTRACE_FILE_CODEC_NONE;
+    if (ptrace_msg_request(ctx, dest, PTRACE_MSG_ID_FILE_BEGIN,
+                           &info, sizeof(info), &rsp, 3000) < 0)
+        return -1;
+
+    frsp = PTRACE_MSG_DATA_PTR(rsp, struct ptrace_msg_file_rsp);
+    if (rsp->data_len < sizeof(*frsp) || !frsp->success || !frsp->port) {
+        ptrace_msg_free(rsp);
+        return 1;
+    }
+
+    memcpy(&addr, dest, sizeof(addr));
+    addr.sin_port = frsp->port;
+    codec = frsp->codec;
+    start = frsp->resume_offset < size ? frsp->resume_offset : size;
+    ptrace_msg_free(rsp);
+
+    if (start)
+        printf("resume from %" PRIu64 " bytes\n", start);
+
+    sockfd = ptrace_msg_tcp_connect(&addr);
+    if (sockfd < 0)
+        return -1;
+
+    if (PTRACE_FILE_CODEC_ZLIB == codec)
+        rc = send_deflated(sockfd, fd, start, size, sent);
+    else
+        rc = sendfile_all(sockfd, fd, start, size, sent);
+
+    close(sockfd);
+
+    return rc;
+}
+
+#define FILE_SEND_RETRIES   3
+
+static int send_file(struct ptrace_msg_ctx *ctx, struct sockaddr_in *dest,
+                     const char *path)
+{
+    int fd, rc, retry;
+    uint32_t crc;
+    struct stat st;
+    uint64_t start, sent = 0;
+
+    if (NULL == dest || NULL == path || '\0' == path[0])
+        return -1;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "open %s failed, errno = %d\n", path, errno);
+        return -1;
+    }
+
+    fstat(fd, &st);
+    printf("send %s to %s:%u, bytes = %lld(%.1fMB)\n",
+            path, inet_ntoa(dest->sin_addr), ntohs(dest->sin_port),
+            (long long)st.st_size, (double)(st.st_size) / 1024.0 / 1024.0);
+
+    if (ptrace_crc32c_file(fd, st.st_size, &crc) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    /* the server keeps what it received, a retry only sends the rest */
+    start = now_ns();
+    for (retry = 0; retry <= FILE_SEND_RETRIES; retry++) {
+        if (retry)
+            printf("\nsend failed, retry %d/%d\n", retry, FILE_SEND_RETRIES);
+
+        rc = g_cfg.udp_only ? 1 :
+             send_file_tcp(ctx, dest, fd, st.st_size, crc, &sent);
+        if (rc > 0) {
+            if (!g_cfg.udp_only)
+                printf("no TCP channel, send by UDP\n");
+            rc = send_file_udp(ctx, dest, fd, st.st_size, crc, &sent);
+        }
+
+        /* the server checks the whole file digest before answering */
+        if (0 == rc)
+            rc = simple_request(ctx, dest, PTRACE_MSG_ID_FILE_END,
+                                NULL, 0, 10000);
+        if (0 == rc)
+            break;
+    }
+
+    close(fd);
+
+    if (rc < 0)
+        return -1;
+
+    printf("\nsend complete, %.1fMB/s, %.1fMB on the wire\n",
+           (double)st.st_size / 1024.0 / 1024.0
+           / ((double)(now_ns() - start + 1) / 1000000000.0),
+           (double)sent / 1024.0 / 1024.0);
+
+    return 0;
+}
+
+/*
+ * Live upload: while traced is writing the trace, a thread follows the
+ * file with inotify and ships every new byte over one TCP connection, so
+ * only the tail written since the last flush is left to send at the stop.
+ */
+struct file_streamer {
+    const char *path;
+    int fd;                         /* the growing trace file */
+    int sockfd;
+    int codec;
+    int zinit;
+    int stop_fd;                    /* eventfd, the file is complete */
+    int rc;
+    pthread_t tid;
+    uint64_t pos;                   /* the file is shipped up to here */
+    uint64_t live;                  /* shipped before the stop */
+    uint64_t sent;                  /* bytes on the wire */
+    z_stream zs;
+    char *zin;
+    char *zout;
+};
+
+#define FILE_STREAM_POLL_MS 1000
+
+static int stream_deflate(struct file_streamer *fs, int flush)
+{
+    int ret;
+    size_t len;
+
+    do {
+        fs->zs.next_out = (Bytef *)fs->zout;
+        fs->zs.avail_out = FILE_ZBUFF_SIZE;
+        ret = deflate(&fs->zs, flush);
+        if (Z_STREAM_ERROR == ret)
+            return -1;
+
+        len = FILE_ZBUFF_SIZE - fs->zs.avail_out;
+        if (write_all(fs->sockfd, fs->zout, len) < 0) {
+            fprintf(stderr, "\nstream write failed, errno = %d\n", errno);
+            return -1;
+        }
+        fs->sent += len;
+    } while (0 == fs->zs.avail_out);
+
+    return 0;
+}
+
+/* ship the file from fs->pos up to size */
+static int stream_ship(struct file_streamer *fs, uint64_t size)
+{
+    ssize_t n;
+    off_t offset;
+
+    while (fs->pos < size) {
+        if (PTRACE_FILE_CODEC_ZLIB != fs->codec) {
+            offset = fs->pos;
+            n = sendfile(fs->sockfd, fs->fd, &offset, size - fs->pos);
+        } else {
+            n = pread(fs->fd, fs->zin, size - fs->pos < FILE_ZBUFF_SIZE ?
+                      size - fs->pos : FILE_ZBUFF_SIZE, fs->pos);
+        }
+        if (n <= 0) {
+            if (n < 0 && EINTR == errno)
+                continue;
+            fprintf(stderr, "\nstream file failed, errno = %d\n", errno);
+            return -1;
+        }
+
+        if (PTRACE_FILE_CODEC_ZLIB == fs->codec) {
+            fs->zs.next_in = (Bytef *)fs->zin;
+            fs->zs.avail_in = n;
+            if (stream_deflate(fs, Z_NO_FLUSH) < 0)
+                return -1;
+        } else {
+            fs->sent += n;
+        }
+        fs->pos += n;
+    }
+
+    return 0;
+}
+
+static void *stream_thread(void *arg)
+{
+    struct file_streamer *fs = (struct file_streamer *)arg;
+    int ifd, wd = -1, stop = 0;
+    uint64_t val;
+    struct stat st;
+    struct pollfd pfds[2];
+    char events[4096];
+
+    ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    for (;;) {
+        /* the session may not have created the file yet */
+        if (fs->fd < 0)
+            fs->fd = open(fs->path, O_RDONLY);
+        if (fs->fd >= 0 && wd < 0 && ifd >= 0)
+            wd = inotify_add_watch(ifd, fs->path, IN_MODIFY | IN_CLOSE_WRITE);
+
+        if (fs->fd >= 0 && 0 == fstat(fs->fd, &st)
+            && stream_ship(fs, st.st_size) < 0)
+            break;
+
+        if (stop) {
+            if (fs->fd < 0)
+                fprintf(stderr, "open %s failed, errno = %d\n",
+                        fs->path, errno);
+            else if (PTRACE_FILE_CODEC_ZLIB != fs->codec
+                     || 0 == stream_deflate(fs, Z_FINISH))
+                fs->rc = 0;
+            break;
+        }
+
+        /* without a watch the file is polled */
+        pfds[0].fd = fs->stop_fd;
+        pfds[0].events = POLLIN;
+        pfds[1].fd = wd >= 0 ? ifd : -1;
+        pfds[1].events = POLLIN;
+        if (poll(pfds, 2, FILE_STREAM_POLL_MS) < 0 && EINTR != errno)
+            break;
+
+        if (pfds[0].revents & POLLIN) {
+            if (read(fs->stop_fd, &val, sizeof(val)) < 0) {}
+            fs->live = fs->pos;
+            stop = 1;   /* one more round for the tail */
+        }
+
+        if (pfds[1].revents & POLLIN)
+            while (read(ifd, events, sizeof(events)) > 0) {}
+    }
+
+    if (ifd >= 0)
+        close(ifd);
+
+    /* the server takes the end of the connection as the end of the file */
+    close(fs->sockfd);
+    fs->sockfd = -1;
+
+    return NULL;
+}
+
+static void free_file_streamer(struct file_streamer *fs)
+{
+    if (fs->fd >= 0)
+        close(fs->fd);
+    if (fs->sockfd >= 0)
+        close(fs->sockfd);
+    if (fs->stop_fd >= 0)
+        close(fs->stop_fd);
+    if (fs->zinit)
+        deflateEnd(&fs->zs);
+    free(fs->zin);
+    free(fs->zout);
+    delete fs;
+}
+
+/*
+ * Start streaming path to the server, it must be called after the tracing
+ * is started. Returns NULL if the server doesn't offer a TCP channel or
+ * anything fails, then the file is uploaded at the end as usual.
+ */
+static struct file_streamer *stream_file_begin(struct ptrace_msg_ctx *ctx,
+        struct sockaddr_in *dest, const char *path)
+{
+    struct file_streamer *fs;
+    struct sockaddr_in addr;
+    struct ptrace_msg *rsp = NULL;
+    struct ptrace_msg_file_info info;
+    struct ptrace_msg_file_rsp *frsp;
+
+    memset(&info, 0, sizeof(info));
+    info.channel = PTRACE_FILE_CHANNEL_TCP;
+    info.codec = g_cfg.zlevel ? PTRACE_FILE_CODEC_ZLIB : PTRACE_FILE_CODEC_NONE;
+    info.flags = PTRACE_FILE_FLAG_STREAM;
+    if (ptrace_msg_request(ctx, dest, PTRACE_MSG_ID_FILE_BEGIN,
+                           &info, sizeof(info), &rsp, 3000) < 0)
+        return NULL;
+
+    frsp = PTRACE_MSG_DATA_PTR(rsp, struct ptrace_msg_file_rsp);
+    if (rsp->data_len < sizeof(*frsp) || !frsp->success || !frsp->port) {
+        printf("the server can't take a stream, upload at the end\n");
+        ptrace_msg_free(rsp);
+        return NULL;
+    }
+
+    fs = new struct file_streamer;
+    memset(&fs->zs, 0, sizeof(fs->zs));
+    fs->path = path;
+    fs->fd = -1;
+    fs->codec = frsp->codec;
+    fs->zinit = 0;
+    fs->rc = -1;
+    fs->pos = fs->live = fs->sent = 0;
+    fs->zin = fs->zout = NULL;
+    fs->stop_fd = eventfd(0, EFD_CLOEXEC);
+    memcpy(&addr, dest, sizeof(addr));
+    addr.sin_port = frsp->port;
+    ptrace_msg_free(rsp);
+
+    if (PTRACE_FILE_CODEC_ZLIB == fs->codec) {
+        fs->zin = (char *)malloc(FILE_ZBUFF_SIZE);
+        fs->zout = (char *)malloc(FILE_ZBUFF_SIZE);
+        fs->zinit = fs->zin && fs->zout
+                    && Z_OK == deflateInit(&fs->zs, g_cfg.zlevel);
+    }
+
+    fs->sockfd = ptrace_msg_tcp_connect(&addr);
+    if (fs->sockfd < 0 || fs->stop_fd < 0
+        || (PTRACE_FILE_CODEC_ZLIB == fs->codec && !fs->zinit)
+        || 0 != pthread_create(&fs->tid, NULL, stream_thread, fs)) {
+        fprintf(stderr, "start streaming failed\n");
+        free_file_streamer(fs);
+        return NULL;
+    }
+
+    printf("streaming %s to %s:%u\n", path, inet_ntoa(addr.sin_addr),
+           ntohs(addr.sin_port));
+
+    return fs;
+}
+
+/*
+ * The tracing is stopped and the file is complete: ship the tail, then
+ * FILE_END gives the server the final size and CRC. A broken stream is
+ * left to send_file(), which resumes from what the server holds.
+ */
+static int stream_file_end(struct ptrace_msg_ctx *ctx,
+                           struct sockaddr_in *dest, struct file_streamer *fs)
+{
+    int rc = -1;
+    uint64_t val = 1, start;
+    const char *path = fs->path;
+    struct stat st;
+    struct ptrace_msg_file_info info;
+
+    start = now_ns();
+    if (write(fs->stop_fd, &val, sizeof(val)) < 0) {}
+    pthread_join(fs->tid, NULL);
+
+    memset(&info, 0, sizeof(info));
+    info.channel = PTRACE_FILE_CHANNEL_TCP;
+    info.flags = PTRACE_FILE_FLAG_STREAM;
+    if (fs->fd >= 0 && 0 == fstat(fs->fd, &st)
+        && 0 == ptrace_crc32c_file(fs->fd, st.st_size, &info.crc)) {
+        info.size = st.st_size;
+
+        /* sent even for a broken stream, so a retry can resume it */
+        rc = simple_request(ctx, dest, PTRACE_MSG_ID_FILE_END,
+                            &info, sizeof(info), 10000);
+        if (0 == rc && 0 == fs->rc && fs->pos == info.size)
+            printf("stream complete, %.1fMB while tracing, %.1fMB in %.3fs"
+                   " after the stop, %.1fMB on the wire\n",
+                   (double)fs->live / 1024.0 / 1024.0,
+                   (double)(info.size - fs->live) / 1024.0 / 1024.0,
+                   (double)(now_ns() - start) / 1000000000.0,
+                   (double)fs->sent / 1024.0 / 1024.0);
+        else
+            rc = -1;
+    }
+
+    free_file_streamer(fs);
+
+    if (rc < 0) {
+        printf("stream failed, upload the file\n");
+        rc = send_file(ctx, dest, path);
+    }
+
+    return rc;
+}
+
+struct server_conn;
+
+struct file_receiver {
+    struct server_conn *owner;
+    const char *path;
+    int fd;
+    int done;
+    int stream;                     /* size and crc come with FILE_END */
+    uint64_t size;
+    uint32_t crc;                   /* CRC32C of the whole file */
+    uint8_t channel;                /* PTRACE_FILE_CHANNEL_XXX */
+    uint32_t chunk_size;
+    uint64_t nchunks;
+    int codec;                      /* PTRACE_FILE_CODEC_XXX */
+    uint64_t recv_bytes;            /* TCP: bytes [0, recv_bytes) are received */
+    uint64_t cum;                   /* chunks [0, cum) are received */
+    uint64_t recv_cnt;
+    uint32_t unacked;
+    std::vector<uint8_t> received;
+    std::vector<char> raw;          /* a chunk after decompression */
+
+    /* TCP channel, driven by the event loop */
+    int lfd;
+    int sockfd;
+    int pipefd[2];                  /* plain: socket -> pipe -> file */
+    int zinit;                      /* zlib: socket -> inflate -> file */
+    z_stream zs;
+    char *zin;
+    char *zout;
+    struct ptrace_msg *end_req;     /* FILE_END waiting for the channel */
+};
+
+#define FILE_ACK_EVERY  16
+
+static void init_file_receiver(struct file_receiver *fr,
+                               struct server_conn *owner, const char *path)
+{
+    fr->owner = owner;
+    fr->path = path;
+    fr->fd = -1;
+    fr->done = 0;
+    fr->stream = 0;
+    fr->end_req = NULL;
+    fr->lfd = -1;
+    fr->sockfd = -1;
+    fr->pipefd[0] = fr->pipefd[1] = -1;
+    fr->zinit = 0;
+    fr->zin = fr->zout = NULL;
+}
+
+static void fill_file_ack(struct file_receiver *fr,
+                          struct ptrace_msg_file_ack *ack)
+{
+    uint64_t i, idx;
+
+    memset(ack, 0, sizeof(*ack));
+    ack->cum_chunks = fr->cum;
+    for (i = 0; i < PTRACE_FILE_WINDOW; i++) {
+        idx = fr->cum + 1 + i;
+        if (idx >= fr->nchunks)
+            break;
+        if (fr->received[idx])
+            ack->sack[i / 64] |= 1ULL << (i % 64);
+    }
+}
+
+static void send_file_ack(struct ptrace_msg_ctx *ctx,
+                          struct file_receiver *fr, struct sockaddr_in *dest)
+{
+    struct ptrace_msg_file_ack ack;
+
+    fill_file_ack(fr, &ack);
+    ptrace_msg_notify(ctx, dest, PTRACE_MSG_ID_FILE_ACK, &ack, sizeof(ack));
+    fr->unacked = 0;
+}
+
+static void recv_file_chunk(struct ptrace_msg_ctx *ctx,
+                            struct file_receiver *fr, struct ptrace_msg *msg)
+{
+    uint64_t idx;
+    uint32_t len, raw_len;
+    uLongf zlen;
+    int in_order;
+    const char *data;
+    struct ptrace_msg_file_chunk *chunk;
+
+    if (fr->fd < 0 || PTRACE_FILE_CHANNEL_UDP != fr->channel
+        || msg->data_len <= sizeof(*chunk))
+        return;
+
+    chunk = PTRACE_MSG_DATA_PTR(msg, struct ptrace_msg_file_chunk);
+    len = msg->data_len - sizeof(*chunk);
+    idx = chunk->offset / fr->chunk_size;
+    if (chunk->offset % fr->chunk_size || idx >= fr->nchunks) {
+        fprintf(stderr, "invalid chunk: offset = %" PRIu64 ", len = %u\n",
+                chunk->offset, len);
+        return;
+    }
+
+    raw_len = fr->size - chunk->offset < fr->chunk_size ?
+              fr->size - chunk->offset : fr->chunk_size;
+    if (len > raw_len
+        || (len < raw_len && PTRACE_FILE_CODEC_ZLIB != fr->codec)) {
+        fprintf(stderr, "invalid chunk: offset = %" PRIu64 ", len = %u\n",
+                chunk->offset, len);
+        return;
+    }
+
+    in_order = (idx == fr->cum);
+    if (!fr->received[idx]) {
+        data = chunk->data;
+        if (len < raw_len) {
+            zlen = raw_len;
+            fr->raw.resize(fr->chunk_size);
+            if (Z_OK != uncompress((Bytef *)fr->raw.data(), &zlen,
+                                   (Bytef *)chunk->data, len)
+                || zlen != raw_len) {
+                fprintf(stderr, "inflate chunk %" PRIu64 " failed\n", idx);
+                return;
+            }
+            data = fr->raw.data();
+        }
+
+        /* a corrupted chunk is dropped and retransmitted as a lost one */
+        if (chunk->crc != ptrace_crc32c(0, data, raw_len)) {
+            fprintf(stderr, "chunk %" PRIu64 " crc mismatch\n", idx);
+            return;
+        }
+
+        if (pwrite(fr->fd, data, raw_len, chunk->offset) != (ssize_t)raw_len) {
+            fprintf(stderr, "write chunk failed, errno = %d\n", errno);
+            return;
+        }
+
+        fr->received[idx] = 1;
+        fr->recv_cnt++;
+        while (fr->cum < fr->nchunks && fr->received[fr->cum])
+            fr->cum++;
+        fr->done = (fr->cum == fr->nchunks);
+
+        if (fr->recv_cnt % 128 == 0 || fr->cum == fr->nchunks) {
+            printf("\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b>%" PRIu64 " Bytes",
+                   fr->recv_cnt * fr->chunk_size < fr->size ?
+                   fr->recv_cnt * fr->chunk_size : fr->size);
+            fflush(stdout);
+        }
+    } else {
+        in_order = 0;   /* duplicate, the ack was lost */
+    }
+
+    /* ack at once on loss, duplicate or completion, otherwise ack every N */
+    if (!in_order || fr->cum < fr->recv_cnt || fr->cum == fr->nchunks
+        || ++fr->unacked >= FILE_ACK_EVERY)
+        send_file_ack(ctx, fr, &msg->src);
+}
+
+#define FILE_SPLICE_BYTES   (1024 * 1024)
+#define FILE_TCP_ROUNDS     16  /* reads per wakeup, other peers wait */
+
+/* release the TCP channel, what is already in the file is kept */
+static void close_file_tcp(struct ptrace_msg_ctx *ctx, struct file_receiver *fr)
+{
+    if (fr->lfd >= 0) {
+        ptrace_msg_ctx_del_fd(ctx, fr->lfd);
+        close(fr->lfd);
+        fr->lfd = -1;
+    }
+
+    if (fr->sockfd >= 0) {
+        ptrace_msg_ctx_del_fd(ctx, fr->sockfd);
+        close(fr->sockfd);
+        fr->sockfd = -1;
+    }
+
+    if (fr->pipefd[0] >= 0) {
+        close(fr->pipefd[0]);
+        close(fr->pipefd[1]);
+        fr->pipefd[0] = fr->pipefd[1] = -1;
+    }
+
+    if (fr->zinit) {
+        inflateEnd(&fr->zs);
+        fr->zinit = 0;
+    }
+    free(fr->zin);
+    free(fr->zout);
+    fr->zin = fr->zout = NULL;
+
+    /* the client gave up on it */
+    ptrace_msg_free(fr->end_req);
+    fr->end_req = NULL;
+}
+
+/*
+ * Move what the socket has into the file by splice(). Returns 1 if more data
+ * is expected, 0 when the file is complete and -1 on error.
+ */
+static int splice_from_socket(struct file_receiver *fr)
+{
+    int i;
+    ssize_t n, m;
+    loff_t offset = fr->recv_bytes;
+
+    for (i = 0; i < FILE_TCP_ROUNDS
+                && (fr->stream || fr->recv_bytes < fr->size); i++) {
+        n = splice(fr->sockfd, NULL, fr->pipefd[1], NULL, FILE_SPLICE_BYTES,
+                   SPLICE_F_MOVE | SPLICE_F_MORE | SPLICE_F_NONBLOCK);
+        if (n <= 0) {
+            if (n < 0 && EINTR == errno)
+                continue;
+            if (n < 0 && EAGAIN == errno)
+                return 1;
+            if (0 == n && fr->stream)
+                return 0;   /* a stream ends with the connection */
+            fprintf(stderr, "\nsplice from socket failed, n = %zd, "
+                    "errno = %d\n", n, errno);
+            return -1;
+        }
+
+        while (n > 0) {
+            m = splice(fr->pipefd[0], NULL, fr->fd, &offset, n, SPLICE_F_MOVE);
+            if (m <= 0) {
+                if (m < 0 && EINTR == errno)
+                    continue;
+                fprintf(stderr, "\nsplice to file failed, errno = %d\n", errno);
+                return -1;
+            }
+            n -= m;
+            fr->recv_bytes = offset;
+        }
+    }
+
+    return (fr->stream || fr->recv_bytes < fr->size) ? 1 : 0;
+}
+
+/* inflate what the socket has into the file, returns like above */
+static int inflate_from_socket(struct file_receiver *fr)
+{
+    int i, ret;
+    ssize_t n;
+    uint32_t len;
+
+    for (i = 0; i < FILE_TCP_ROUNDS; i++) {
+        n = read(fr->sockfd, fr->zin, FILE_ZBUFF_SIZE);
+        if (n <= 0) {
+            if (n < 0 && EINTR == errno)
+                continue;
+            if (n < 0 && EAGAIN == errno)
+                return 1;
+            fprintf(stderr, "\nread socket failed, n = %zd, errno = %d\n",
+                    n, errno);
+            return -1;
+        }
+
+        fr->zs.next_in = (Bytef *)fr->zin;
+        fr->zs.avail_in = n;
+        do {
+            fr->zs.next_out = (Bytef *)fr->zout;
+            fr->zs.avail_out = FILE_ZBUFF_SIZE;
+            ret = inflate(&fr->zs, Z_NO_FLUSH);
+            if (Z_OK != ret && Z_STREAM_END != ret && Z_BUF_ERROR != ret) {
+                fprintf(stderr, "\ninflate failed, ret = %d\n", ret);
+                return -1;
+            }
+
+            len = FILE_ZBUFF_SIZE - fr->zs.avail_out;
+            if ((!fr->stream && fr->recv_bytes + len > fr->size)
+                || pwrite(fr->fd, fr->zout, len, fr->recv_bytes) != len) {
+                fprintf(stderr, "\nwrite file failed, errno = %d\n", errno);
+                return -1;
+            }
+            fr->recv_bytes += len;
+        } while (0 == fr->zs.avail_out && Z_STREAM_END != ret);
+
+        if (Z_STREAM_END == ret)
+            return (fr->stream || fr->recv_bytes == fr->size) ? 0 : -1;
+    }
+
+    return 1;
+}
+
+static void finish_file(struct ptrace_msg_ctx *ctx, struct server_conn *sc,
+                        struct ptrace_msg *msg);
+
+/* the TCP channel is over, answer the FILE_END that waited for it */
+static void end_file_tcp(struct ptrace_msg_ctx *ctx, struct file_receiver *fr)
+{
+    struct ptrace_msg *end_req = fr->end_req;
+
+    fr->end_req = NULL;
+    close_file_tcp(ctx, fr);
+
+    if (end_req) {
+        finish_file(ctx, fr->owner, end_req);
+        ptrace_msg_free(end_req);
+    }
+}
+
+static void on_file_data(struct ptrace_msg_ctx *ctx, int fd, uint32_t events,
+                         void *arg)
+{
+    int rc;
+    struct file_receiver *fr = (struct file_receiver *)arg;
+
+    if (PTRACE_FILE_CODEC_ZLIB == fr->codec)
+        rc = inflate_from_socket(fr);
+    else
+        rc = splice_from_socket(fr);
+
+    printf("\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b>%" PRIu64 " Bytes",
+           fr->recv_bytes);
+    fflush(stdout);
+
+    if (rc > 0)
+        return;
+
+    fr->done = (0 == rc);
+    end_file_tcp(ctx, fr);
+}
+
+static void on_file_accept(struct ptrace_msg_ctx *ctx, int fd, uint32_t events,
+                           void *arg)
+{
+    struct file_receiver *fr = (struct file_receiver *)arg;
+
+    fr->sockfd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fr->sockfd < 0) {
+        if (EAGAIN == errno || EINTR == errno)
+            return;
+        fprintf(stderr, "accept failed, errno = %d\n", errno);
+        end_file_tcp(ctx, fr);
+        return;
+    }
+
+    /* one connection per FILE_BEGIN */
+    ptrace_msg_ctx_del_fd(ctx, fr->lfd);
+    close(fr->lfd);
+    fr->lfd = -1;
+
+    if (PTRACE_FILE_CODEC_ZLIB == fr->codec) {
+        memset(&fr->zs, 0, sizeof(fr->zs));
+        fr->zin = (char *)malloc(FILE_ZBUFF_SIZE);
+        fr->zout = (char *)malloc(FILE_ZBUFF_SIZE);
+        fr->zinit = (Z_OK == inflateInit(&fr->zs));
+        if (!fr->zin || !fr->zout || !fr->zinit) {
+            fprintf(stderr, "init inflate failed\n");
+            end_file_tcp(ctx, fr);
+            return;
+        }
+    } else {
+        if (pipe2(fr->pipefd, O_CLOEXEC) < 0) {
+            fprintf(stderr, "create pipe failed, errno = %d\n", errno);
+            fr->pipefd[0] = fr->pipefd[1] = -1;
+            end_file_tcp(ctx, fr);
+            return;
+        }
+        fcntl(fr->pipefd[1], F_SETPIPE_SZ, FILE_SPLICE_BYTES);
+    }
+
+    if (ptrace_msg_ctx_add_fd(ctx, fr->sockfd, EPOLLIN, on_file_data, fr) < 0)
+        end_file_tcp(ctx, fr);
+}
+
+/*
+ * Answer FILE_BEGIN with the port of a new TCP listener, the file is received
+ * from the connection the client makes to it by the event loop.
+ */
+static void recv_file_tcp(struct ptrace_msg_ctx *ctx, struct file_receiver *fr,
+                          struct ptrace_msg *req,
+                          struct ptrace_msg_file_rsp *rsp)
+{
+    struct sockaddr_in addr;
+
+    close_file_tcp(ctx, fr);
+
+    memcpy(&addr, &g_cfg.addr, sizeof(addr));
+    addr.sin_port = 0;
+
+    if (fr->fd >= 0)
+        fr->lfd = ptrace_msg_tcp_listen(&addr);
+    if (fr->lfd >= 0 &&
+        ptrace_msg_ctx_add_fd(ctx, fr->lfd, EPOLLIN, on_file_accept, fr) < 0) {
+        close(fr->lfd);
+        fr->lfd = -1;
+    }
+
+    if (fr->lfd >= 0) {
+        rsp->success = PTRACE_SUCCESS;
+        rsp->port = addr.sin_port;
+        rsp->resume_offset = fr->recv_bytes;
+    }
+    ptrace_msg_response(ctx, req, rsp, sizeof(*rsp));
+}
+
+/* forget what was received, the next FILE_BEGIN starts from scratch */
+static void reset_file_receiver(struct file_receiver *fr)
+{
+    fr->done = 0;
+    fr->recv_bytes = 0;
+    fr->cum = fr->recv_cnt = 0;
+    fr->unacked = 0;
+    fr->received.assign(fr->nchunks, 0);
+}
+
+static void recv_file_begin(struct ptrace_msg_ctx *ctx,
+                            struct file_receiver *fr, struct ptrace_msg *msg)
+{
+    int resume;
+    struct ptrace_msg_file_rsp rsp;
+    struct ptrace_msg_file_info *info = \
+            PTRACE_MSG_DATA_PTR(msg, struct ptrace_msg_file_info);
+
+    memset(&rsp, 0, sizeof(rsp));
+
+    if (msg->data_len < sizeof(*info) ||
+        (PTRACE_FILE_CHANNEL_UDP == info->channel && 0 == info->chunk_size) ||
+        (PTRACE_FILE_CHANNEL_UDP == info->channel
+         && (info->flags & PTRACE_FILE_FLAG_STREAM))) {
+        ptrace_msg_response(ctx, msg, &rsp, sizeof(rsp));
+        return;
+    }
+
+    /* a FILE_BEGIN retry abandons the connection of the previous one */
+    close_file_tcp(ctx, fr);
+
+    resume = fr->fd >= 0 && !fr->stream
+             && !(info->flags & PTRACE_FILE_FLAG_STREAM)
+             && fr->size == info->size && fr->crc == info->crc
+             && fr->channel == info->channel
+             && fr->chunk_size == info->chunk_size;
+    if (resume) {
+        printf("\nresuming client file, %" PRIu64 " bytes/%" PRIu64
+               " chunks received\n",
+               fr->recv_bytes, fr->recv_cnt);
+    } else {
+        printf("receiving client file, save as %s\n", fr->path);
+        if (fr->fd >= 0)
+            close(fr->fd);
+        fr->stream = !!(info->flags & PTRACE_FILE_FLAG_STREAM);
+        fr->size = fr->stream ? 0 : info->size;
+        fr->crc = fr->stream ? 0 : info->crc;
+        fr->channel = info->channel;
+        fr->chunk_size = info->chunk_size;
+        fr->nchunks = fr->chunk_size ?
+                (fr->size + fr->chunk_size - 1) / fr->chunk_size : 0;
+        reset_file_receiver(fr);
+        fr->fd = open(fr->path, O_CREAT | O_RDWR | O_TRUNC, 0664);
+        if (fr->fd < 0)
+            fprintf(stderr, "create %s failed, errno = %d\n",
+                    fr->path, errno);
+    }
+
+    /* the codec may change on resume, what is stored is the plain file */
+    fr->codec = (PTRACE_FILE_CODEC_ZLIB == info->codec) ?
+                PTRACE_FILE_CODEC_ZLIB : PTRACE_FILE_CODEC_NONE;
+    rsp.codec = fr->codec;
+
+    if (PTRACE_FILE_CHANNEL_TCP == info->channel) {
+        recv_file_tcp(ctx, fr, msg, &rsp);
+    } else {
+        rsp.success = fr->fd >= 0 ? PTRACE_SUCCESS : PTRACE_FAILURE;
+        fill_file_ack(fr, &rsp.resume);
+        ptrace_msg_response(ctx, msg, &rsp, sizeof(rsp));
+    }
+}
+
+/* the whole file digest must match before the file is combined */
+static int check_file_digest(struct file_receiver *fr)
+{
+    uint32_t crc;
+
+    if (ptrace_crc32c_file(fr->fd, fr->size, &crc) < 0)
+        return -1;
+
+    if (crc != fr->crc) {
+        fprintf(stderr, "\nclient file digest mismatch: %08x != %08x\n",
+                crc, fr->crc);
+        reset_file_receiver(fr);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* state of the server, shared by all clients */
+struct server_sched;
+
+struct ptrace_server {
+    time_t start_time;
+    int nclients;           /* clients ever connected */
+    int nconns;             /* clients connected now */
+    int quit;
+    int combine;            /* combine the client files with ours */
+    struct server_sched *sched; /* a scheduled start/stop in progress */
+    struct server_conn *conns;  /* the clients, the latest first */
+    int coord;              /* coordinator: the clients to wait for, or 0 */
+    int stage;              /* coordinator: COORD_XXX */
+};
+
+/*
+ * State of a client, kept in ptrace_msg_conn::data. A coordinator keeps it
+ * after the client is gone, until the traces are merged.
+ */
+struct server_conn {
+    struct ptrace_server *server;
+    struct server_conn *next;
+    struct sockaddr_in addr;
+    int index;
+    int connected;
+    int started;            /* asked to start by the coordinator */
+    uint64_t at;            /* coordinator's instant of the latest request */
+    struct ptrace_msg_tracing_stats stats;  /* of its session, once stopped */
+    int received;           /* its trace is received */
+    std::vector<struct ptrace_clock_sample> clock;  /* by time */
+    struct file_receiver fr;
+    char clnt_file[128];
+    char comb_file[128];
+};
+
+/* the files of the 1st client keep their names, "-N" is added for others */
+static void conn_file_name(char *buf, size_t size, const char *path, int index)
+{
+    const char *dot, *slash;
+
+    dot = strrchr(path, '.');
+    slash = strrchr(path, '/');
+    if (0 == index) {
+        snprintf(buf, size, "%s", path);
+    } else if (!dot || (slash && dot < slash)) {
+        snprintf(buf, size, "%s-%d", path, index);
+    } else {
+        snprintf(buf, size, "%.*s-%d%s", (int)(dot - path), path, index, dot);
+    }
+}
+
+static struct server_conn *server_conn_get(struct ptrace_server *server,
+                                           struct ptrace_msg_conn *conn)
+{
+    struct server_conn *sc;
+
+    if (conn->data)
+        return (struct server_conn *)conn->data;
+
+    sc = new struct server_conn;
+    sc->server = server;
+    sc->next = server->conns;
+    server->conns = sc;
+    memcpy(&sc->addr, &conn->addr, sizeof(sc->addr));
+    sc->index = server->nclients++;
+    sc->connected = 0;
+    sc->started = 0;
+    sc->at = 0;
+    memset(&sc->stats, 0, sizeof(sc->stats));
+    sc->received = 0;
+    conn_file_name(sc->clnt_file, sizeof(sc->clnt_file),
+                   g_cfg.clnt_file, sc->index);
+    conn_file_name(sc->comb_file, sizeof(sc->comb_file),
+                   g_cfg.comb_file, sc->index);
+    init_file_receiver(&sc->fr, sc, sc->clnt_file);
+    conn->data = sc;
+
+    return sc;
+}
+
+static void server_conn_free(struct ptrace_msg_ctx *ctx,
+                             struct ptrace_msg_conn *conn, void *arg)
+{
+    struct ptrace_server *server = (struct ptrace_server *)arg;
+    struct server_conn *sc = (struct server_conn *)conn->data, **pp;
+
+    if (!sc)
+        return;
+
+    if (sc->connected)
+        server->nconns--;
+    sc->connected = 0;
+
+    close_file_tcp(ctx, &sc->fr);
+    if (sc->fr.fd >= 0)
+        close(sc->fr.fd);
+    sc->fr.fd = -1;
+    conn->data = NULL;
+
+    if (server->coord)
+        return;
+
+    for (pp = &server->conns; *pp != sc; pp = &(*pp)->next) {}
+    *pp = sc->next;
+    delete sc;
+}
+
+static void finish_file(struct ptrace_msg_ctx *ctx, struct server_conn *sc,
+                        struct ptrace_msg *msg)
+{
+    char path[160];
+    struct file_receiver *fr = &sc->fr;
+
+    if (fr->stream) {
+        fr->done = fr->done && fr->recv_bytes == fr->size;
+        fr->stream = 0; /* a retry of the upload can resume it */
+    }
+
+    if (fr->fd < 0 || !fr->done || check_file_digest(fr) < 0) {
+        simple_response(ctx, msg, PTRACE_FAILURE);
+        return;
+    }
+
+    close(fr->fd);
+    fr->fd = -1;
+    simple_response(ctx, msg, PTRACE_SUCCESS);
+    printf("\nreceive complete\n");
+    sc->received = 1;
+    if (!sc->server->combine)
+        return;
+
+    /* kept to combine the files again by ptrace-combine */
+    snprintf(path, sizeof(path), "%s.clock", sc->clnt_file);
+    ptrace_clock_save(path, sc->clock.data(), sc->clock.size());
+
+    /* a coordinator merges the traces of all clients at the end */
+    if (sc->server->coord)
+        return;
+
+    printf("combining file:\n  + %s\n  + %s\n  = %s\n",
+           g_cfg.out_file, sc->clnt_file, sc->comb_file);
+    combine_file(g_cfg.out_file, sc->clnt_file, sc->comb_file,
+                 sc->clock.data(), sc->clock.size());
+}
+
+static void recv_file_end(struct ptrace_msg_ctx *ctx, struct server_conn *sc,
+                          struct ptrace_msg *msg)
+{
+    struct file_receiver *fr = &sc->fr;
+    struct ptrace_msg_file_info *info = (struct ptrace_msg_file_info *)msg->data;
+
+    if (fr->stream && msg->data_len >= sizeof(*info)) {
+        fr->size = info->size;
+        fr->crc = info->crc;
+    }
+
+    /* the TCP channel may be still draining, answer when it is over */
+    if (fr->lfd >= 0 || fr->sockfd >= 0) {
+        ptrace_msg_free(fr->end_req);
+        fr->end_req = ptrace_msg_dup(msg);
+        if (fr->end_req)
+            return;
+    }
+
+    finish_file(ctx, sc, msg);
+}
+
+/* a START/STOP_TRACING waiting for its instant */
+struct server_sched {
+    struct sched_action act;
+    struct ptrace_msg *req;
+    int start;
+};
+
+/* the thread must have been joined */
+static void server_sched_free(struct ptrace_msg_ctx *ctx,
+                              struct ptrace_server *server)
+{
+    struct server_sched *ss = server->sched;
+
+    ptrace_msg_ctx_del_fd(ctx, ss->act.efd);
+    close(ss->act.efd);
+    ptrace_msg_free(ss->req);
+    delete ss;
+    server->sched = NULL;
+}
+
+static void on_sched_done(struct ptrace_msg_ctx *ctx, int fd, uint32_t events,
+                          void *arg)
+{
+    uint64_t val;
+    struct ptrace_server *server = (struct ptrace_server *)arg;
+    struct server_sched *ss = server->sched;
+    struct ptrace_msg_tracing_rsp rsp;
+
+    if (read(fd, &val, sizeof(val)) < 0)
+        return;
+
+    pthread_join(ss->act.tid, NULL);
+    printf("\n%s tracing at %" PRIu64 " ns, %.1fus after the instant\n",
+           ss->start ? "started" : "stopped", ss->act.actual,
+           (double)(int64_t)(ss->act.actual - ss->act.at) / 1000.0);
+
+    if (ss->start) {
+        if (ss->act.rc < 0)
+            stop_tracing();     /* disarm */
+        else if (0 == server->start_time)
+            server->start_time = time(NULL);
+    } else if (0 == ss->act.rc) {
+        ss->act.rc = wait_tracing();
+    }
+
+    if (ss->req) {
+        memset(&rsp, 0, sizeof(rsp));
+        rsp.success = 0 == ss->act.rc ? PTRACE_SUCCESS : PTRACE_FAILURE;
+        rsp.actual = ss->act.actual;
+        if (!ss->start)
+            rsp.stats = g_tracing_stats;
+        ptrace_msg_response(ctx, ss->req, &rsp, sizeof(rsp));
+    }
+
+    server_sched_free(ctx, server);
+}
+
+/*
+ * Arm now if starting, start or stop at the instant and answer req then, if
+ * there is one. req is taken in any case.
+ */
+static int server_sched(struct ptrace_msg_ctx *ctx,
+                        struct ptrace_server *server, uint64_t at, int start,
+                        struct ptrace_msg *req)
+{
+    int efd;
+    struct server_sched *ss;
+
+    if (server->sched || (start && arm_tracing() < 0)) {
+        ptrace_msg_free(req);
+        return -1;
+    }
+
+    ss = new struct server_sched;
+    ss->start = start;
+    ss->req = req;
+    efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (efd < 0)
+        goto _err;
+
+    if (ptrace_msg_ctx_add_fd(ctx, efd, EPOLLIN, on_sched_done, server) < 0)
+        goto _err;
+
+    if (sched_action_start(&ss->act, at,
+                           start ? trigger_tracing : signal_tracing, efd) < 0) {
+        ptrace_msg_ctx_del_fd(ctx, efd);
+        goto _err;
+    }
+
+    server->sched = ss;
+    return 0;
+
+_err:
+    if (efd >= 0)
+        close(efd);
+    ptrace_msg_free(ss->req);
+    delete ss;
+    if (start)
+        stop_tracing();
+
+    return -1;
+}
+
+/* start or stop at the instant of the request and answer then */
+static void server_sched_tracing(struct ptrace_msg_ctx *ctx,
+                                 struct ptrace_server *server,
+                                 struct ptrace_msg *msg, int start)
+{
+    struct ptrace_msg_tracing_data *data = \
+            (struct ptrace_msg_tracing_data *)msg->data;
+    struct ptrace_msg_tracing_rsp rsp;
+    struct ptrace_msg *req;
+
+    memset(&rsp, 0, sizeof(rsp));
+    rsp.success = PTRACE_FAILURE;
+
+    /* another client has started or stopped it already */
+    if (start == !!g_tracing.session) {
+        rsp.success = PTRACE_SUCCESS;
+        if (!start)
+            rsp.stats = g_tracing_stats;
+        ptrace_msg_response(ctx, msg, &rsp, sizeof(rsp));
+        return;
+    }
+
+    req = ptrace_msg_dup(msg);
+    if (!req || server_sched(ctx, server, data->at, start, req) < 0)
+        ptrace_msg_response(ctx, msg, &rsp, sizeof(rsp));
+}
+
+static void server_handle_msg(struct ptrace_msg_ctx *ctx,
+                              struct ptrace_msg_conn *conn,
+                              struct ptrace_msg *msg, void *arg)
+{
+    int rc;
+    struct ptrace_server *server = (struct ptrace_server *)arg;
+    struct server_conn *sc = NULL;
+
+    /* probes are stateless, a client resyncs from a socket of its own */
+    if (PTRACE_MSG_ID_ECHO != msg->id && PTRACE_MSG_ID_CLOCK != msg->id)
+        sc = server_conn_get(server, conn);
+
+    switch (msg->id) {
+        case PTRACE_MSG_ID_CONNECT:
+        {
+            struct ptrace_msg_connect_rsp crsp;
+
+            memset(&crsp, 0, sizeof(crsp));
+
+            /* host sc->index + 1 of the merged trace */
+            if (server->coord && sc->index >= PTRACE_COMBINE_MAX_HOSTS) {
+                ptrace_msg_response(ctx, msg, &crsp, sizeof(crsp));
+                printf("client #%d rejected, at most %d clients are merged\n",
+                       sc->index, PTRACE_COMBINE_MAX_HOSTS);
+                break;
+            }
+
+            crsp.success = PTRACE_SUCCESS;
+            crsp.coordinated = !!server->coord;
+            ptrace_msg_response(ctx, msg, &crsp, sizeof(crsp));
+            if (!sc->connected) {
+                sc->connected = 1;
+                server->nconns++;
+            }
+            printf("client #%d connected: %s:%d\n", sc->index,
+                   inet_ntoa(msg->src.sin_addr), ntohs(msg->src.sin_port));
+            break;
+        }
+
+        case PTRACE_MSG_ID_DISCONNECT:
+            simple_response(ctx, msg, PTRACE_SUCCESS);
+            printf("client #%d disconnected\n", sc->index);
+            ptrace_msg_conn_del(ctx, conn);
+            if (0 == server->nconns && !server->coord)
+                server->quit = 1;
+            break;
+
+        case PTRACE_MSG_ID_ECHO:
+            /* run 2 times */
+            ::perfetto::base::GetBootTimeNs().count();
+            ::perfetto::base::GetBootTimeNs().count();
+            ptrace_msg_response(ctx, msg, NULL, 0);
+            break;
+
+        case PTRACE_MSG_ID_CLOCK:
+        {
+            struct ptrace_msg_clock_data data;
+
+            /* t2 is when the kernel received the probe, t3 as late as can be */
+            data.t2 = msg->rx_time;
+            data.t3 = ::perfetto::base::GetBootTimeNs().count();
+            ptrace_msg_response(ctx, msg, &data, sizeof(data));
+            break;
+        }
+
+        case PTRACE_MSG_ID_TIME:
+        {
+            struct ptrace_msg_time_data *data = \
+                    (struct ptrace_msg_time_data *)(msg->data);
+            struct ptrace_clock_sample sample;
+            std::vector<struct ptrace_clock_sample>::iterator it;
+
+            if (msg->data_len < sizeof(*data)) {
+                simple_response(ctx, msg, PTRACE_FAILURE);
+                break;
+            }
+
+            sample.time = data->time;
+            sample.offset = data->offset;
+            sample.error = data->error;
+            it = sc->clock.end();
+            while (it != sc->clock.begin() && (it - 1)->time > sample.time)
+                it--;
+            sc->clock.insert(it, sample);
+            simple_response(ctx, msg, PTRACE_SUCCESS);
+
+            printf("client #%d clock offset: %" PRId64 " ns +/- %" PRIu64
+                   " ns\n",
+                   sc->index, data->offset, data->error);
+
+            break;
+        }
+
+        case PTRACE_MSG_ID_START_TRACING:
+            if (msg->data_len >= sizeof(struct ptrace_msg_tracing_data)) {
+                server_sched_tracing(ctx, server, msg, 1);
+                break;
+            }
+
+            /* the first client starts the tracing, the others join it */
+            rc = start_tracing();
+            if (0 == rc && 0 == server->start_time)
+                server->start_time = time(NULL);
+            simple_response(ctx, msg, 0 == rc ? PTRACE_SUCCESS : PTRACE_FAILURE);
+            break;
+
+        case PTRACE_MSG_ID_STOP_TRACING:
+        {
+            struct ptrace_msg_tracing_rsp trsp;
+
+            if (msg->data_len >= sizeof(struct ptrace_msg_tracing_data)) {
+                server_sched_tracing(ctx, server, msg, 0);
+                break;
+            }
+
+            /* and the first one to stop ends it, all get its latencies */
+            printf("\n");
+            rc = stop_tracing();
+            memset(&trsp, 0, sizeof(trsp));
+            trsp.success = 0 == rc ? PTRACE_SUCCESS : PTRACE_FAILURE;
+            trsp.stats = g_tracing_stats;
+            ptrace_msg_response(ctx, msg, &trsp, sizeof(trsp));
+            break;
+        }
+
+        case PTRACE_MSG_ID_FILE_BEGIN:
+            recv_file_begin(ctx, &sc->fr, msg);
+            break;
+
+        case PTRACE_MSG_ID_FILE_CONTENT:
+            recv_file_chunk(ctx, &sc->fr, msg);
+            break;
+
+        case PTRACE_MSG_ID_FILE_END:
+            recv_file_end(ctx, sc, msg);
+            break;
+
+        default:
+            fprintf(stderr, "unknown msg: id = %u\n", msg->id);
+            break;
+    }
+}
+
+/*
+ * Coordinator: once g_cfg.nclients clients have connected and synced their
+ * clocks, they and the coordinator start at one instant, and stop at one
+ * instant after CTRL-C. Each client is asked to act at the instant converted
+ * to its own clock and answers when it has. Clients joining later are
+ * started on their own. The traces are merged into one at the end.
+ */
+#define COORD_LEAD_MS   1000    /* default lead time, -T sets it */
+
+enum coord_stage_e {
+    COORD_WAITING = 0,      /* for the clients to sync */
+    COORD_TRACING,
+    COORD_STOPPING,         /* and waiting for the clients' traces */
+};
+
+static uint32_t coord_lead_ms(void)
+{
+    return g_cfg.sched_ms ? g_cfg.sched_ms : COORD_LEAD_MS;
+}
+
+static struct server_conn *coord_find(struct ptrace_server *server,
+                                      const struct sockaddr_in *addr)
+{
+    struct server_conn *sc;
+
+    for (sc = server->conns; sc; sc = sc->next) {
+        if (sc->connected
+            && sc->addr.sin_addr.s_addr == addr->sin_addr.s_addr
+            && sc->addr.sin_port == addr->sin_port)
+            return sc;
+    }
+
+    return NULL;
+}
+
+static void coord_on_tracing(struct ptrace_msg_ctx *ctx,
+        struct ptrace_msg *req, struct ptrace_msg *rsp, void *arg)
+{
+    int start = PTRACE_MSG_ID_START_TRACING == req->id;
+    uint64_t actual;
+    struct ptrace_server *server = (struct ptrace_server *)arg;
+    struct server_conn *sc = coord_find(server, &req->dest);
+    struct ptrace_msg_tracing_rsp *trsp;
+
+    if (!sc)
+        return;
+
+    trsp = rsp ? PTRACE_MSG_DATA_PTR(rsp, struct ptrace_msg_tracing_rsp) : NULL;
+    if (!trsp || rsp->data_len < sizeof(*trsp) || !trsp->success) {
+        fprintf(stderr, "\nclient #%d %s tracing failed\n",
+                sc->index, start ? "start" : "stop");
+        return;
+    }
+
+    if (!trsp->actual) {
+        printf("\nclient #%d was %s already\n",
+               sc->index, start ? "tracing" : "stopped");
+        return;
+    }
+
+    actual = trsp->actual + ptrace_clock_offset(sc->clock.data(),
+                                                sc->clock.size(),
+                                                trsp->actual);
+    printf("\nclient #%d %s tracing, %+.1fus from the instant\n", sc->index,
+           start ? "started" : "stopped",
+           (double)(int64_t)(actual - sc->at) / 1000.0);
+
+    if (!start)
+        sc->stats = trsp->stats;
+}
+
+/* ask a client to start or stop at the coordinator's boot time at */
+static void coord_request(struct ptrace_msg_ctx *ctx,
+                          struct ptrace_server *server,
+                          struct server_conn *sc, uint64_t at, int start)
+{
+    int64_t offset;
+    struct ptrace_msg_tracing_data data;
+
+    /* the offset is sampled on the client's clock, look it up there */
+    offset = sc->clock.back().offset;
+    offset = ptrace_clock_offset(sc->clock.data(), sc->clock.size(),
+                                 at - offset);
+    data.at = at - offset;
+    sc->at = at;
+
+    if (ptrace_msg_request_async(ctx, &sc->addr,
+                                 start ? PTRACE_MSG_ID_START_TRACING
+                                       : PTRACE_MSG_ID_STOP_TRACING,
+                                 &data, sizeof(data), 0,
+                                 coord_lead_ms() + 3000,
+                                 coord_on_tracing, server) < 0)
+        fprintf(stderr, "client #%d %s tracing failed\n",
+                sc->index, start ? "start" : "stop");
+}
+
+/* start the synced clients not started yet, and the coordinator at first */
+static void coord_start(struct ptrace_msg_ctx *ctx,
+                        struct ptrace_server *server)
+{
+    int n = 0;
+    uint64_t at;
+    struct server_conn *sc;
+
+    at = ::perfetto::base::GetBootTimeNs().count()
+         + (uint64_t)coord_lead_ms() * 1000000;
+
+    if (COORD_WAITING == server->stage) {
+        server->stage = COORD_TRACING;
+        if (server_sched(ctx, server, at, 1, NULL) < 0)
+            fprintf(stderr, "start tracing failed\n");
+    }
+
+    for (sc = server->conns; sc; sc = sc->next) {
+        if (sc->connected && !sc->clock.empty() && !sc->started) {
+            coord_request(ctx, server, sc, at, 1);
+            sc->started = 1;
+            n++;
+        }
+    }
+
+    printf("start tracing of %d client(s) in %ums\n", n, coord_lead_ms());
+}
+
+static void coord_stop(struct ptrace_msg_ctx *ctx,
+                       struct ptrace_server *server)
+{
+    int n = 0;
+    uint64_t at;
+    struct server_conn *sc;
+
+    at = ::perfetto::base::GetBootTimeNs().count()
+         + (uint64_t)coord_lead_ms() * 1000000;
+
+    server->stage = COORD_STOPPING;
+    if (server_sched(ctx, server, at, 0, NULL) < 0)
+        fprintf(stderr, "stop tracing failed\n");
+
+    for (sc = server->conns; sc; sc = sc->next) {
+        if (sc->connected && sc->started) {
+            coord_request(ctx, server, sc, at, 0);
+            n++;
+        }
+    }
+
+    printf("\nstop tracing of %d client(s) in %ums\n", n, coord_lead_ms());
+    printf("waiting for the clients' traces, CTRL-C again to give up\n");
+    g_running = 1;
+}
 
-static char g_send_buff[8192];
+/* move the session on, returns 1 when it is over */
+static int coord_update(struct ptrace_msg_ctx *ctx,
+                        struct ptrace_server *server)
+{
+    int synced = 0, pending = 0;
+    struct server_conn *sc;
 
-extern int combine_file(const char *f1, const char *f2,
-                        const char *fc, int64_t time_diff_ns);
+    if (COORD_STOPPING == server->stage)
+        return !g_running || (!server->sched && 0 == server->nconns);
 
+    /* a start in progress ends first */
+    if (server->sched)
+        return 0;
 
-static int simple_request(struct sockaddr_in *dest, uint8_t msg_id,
-                          void *data, int data_len, uint32_t timeout_ms)
-{
-    int32_t success = 0;
-    struct ptrace_msg *rsp = NULL;
+    if (COORD_TRACING == server->stage) {
+        if (!g_running || 0 == server->nconns) {
+            coord_stop(ctx, server);
+            return 0;
+        }
+    } else if (!g_running) {
+        return 1;
+    }
 
-    if (0 == ptrace_msg_request(dest, msg_id,
-                                data, data_len, &rsp, timeout_ms)) {
-        success = PTRACE_MSG_DATA(rsp, int32_t);
-        ptrace_msg_free(rsp);
+    for (sc = server->conns; sc; sc = sc->next) {
+        if (sc->connected && !sc->clock.empty()) {
+            synced++;
+            if (!sc->started)
+                pending++;
+        }
     }
 
-    return success ? 0 : -1;
-}
+    if (pending && (COORD_TRACING == server->stage
+                    || synced >= server->coord))
+        coord_start(ctx, server);
 
-static int simple_response(struct ptrace_msg *req, int32_t success)
-{
-    return ptrace_msg_response(req, &success, sizeof(success));
+    return 0;
 }
 
-static int start_tracing(void)
+/*
+ * The clients' latencies, and how far apart from the coordinator they began
+ * to capture, their times moved onto the coordinator's clock.
+ */
+static void coord_report(struct ptrace_server *server)
 {
-    pid_t pid;
+    char who[64];
+    int64_t offset;
+    struct server_conn *sc;
+    const struct ptrace_msg_tracing_stats *coord = &g_tracing_stats;
 
-    if (g_tracing_pid)
-        return 0;
+    for (sc = server->conns; sc; sc = sc->next) {
+        if (!sc->stats.started || sc->clock.empty())
+            continue;
 
-    printf("start tracing...\n");
+        snprintf(who, sizeof(who), "client #%d tracing latency", sc->index);
+        print_tracing_stats(who, &sc->stats);
+        if (!coord->started)
+            continue;
 
-    pid = fork();
+        offset = ptrace_clock_offset(sc->clock.data(), sc->clock.size(),
+                                     sc->stats.started);
+        printf("client #%d start skew measured: %+.1fus started", sc->index,
+               (double)(int64_t)(sc->stats.started + offset - coord->started)
+               / 1000.0);
+        if (sc->stats.first_data && coord->first_data)
+            printf(", %+.1fus first data",
+                   (double)(int64_t)(sc->stats.first_data + offset
+                                     - coord->first_data) / 1000.0);
+        printf(" (client - coordinator)\n");
+    }
+}
 
-    if (0 == pid) { /* children */
-        execlp("perfetto",
-               "perfetto",
-               "--txt",
-               "-c", g_cfg.cfg_file,
-               "-o", g_cfg.out_file,
-               NULL);
+/* one trace of all hosts, the clients in the order they connected */
+static void coord_merge(struct ptrace_server *server)
+{
+    int i, n = 0;
+    struct server_conn *sc;
+    struct ptrace_combine_input *inputs;
 
-        /* should never reach here */
-        fprintf(stderr, "failed to start perfetto, please check whether "
-                "perfetto is installed or the configuraton file is correct\n");
-        exit(EXIT_FAILURE);
+    for (sc = server->conns; sc; sc = sc->next) {
+        if (sc->received)
+            n++;
     }
 
-    /* parent */
-    if (pid < 0) {
-        fprintf(stderr, "create tracing process failed, errno = %d\n", errno);
-        return -1;
+    if (0 == n) {
+        printf("no client trace received\n");
+        return;
     }
 
-    usleep(50*1000);
-    if (waitpid(pid, NULL, WNOHANG) > 0) {
-        fprintf(stderr, "tracing process exit abnormally\n");
-        return -1;
+    inputs = (struct ptrace_combine_input *)calloc(n, sizeof(*inputs));
+    if (!inputs)
+        return;
+
+    i = n;
+    for (sc = server->conns; sc; sc = sc->next) {
+        if (sc->received) {
+            i--;
+            inputs[i].file = sc->clnt_file;
+            inputs[i].clock = sc->clock.data();
+            inputs[i].nclock = sc->clock.size();
+        }
     }
 
-    printf("tracing process running: %d\n", pid);
-    g_tracing_pid = pid;
+    printf("merging file:\n  + %s\n", g_cfg.out_file);
+    for (i = 0; i < n; i++)
+        printf("  + %s (host %d)\n", inputs[i].file, i + 1);
+    printf("  = %s\n", g_cfg.comb_file);
 
-    return 0;
+    combine_files(g_cfg.out_file, inputs, n, g_cfg.comb_file);
+    free(inputs);
 }
 
-static int stop_tracing(void)
+/*
+ * Rotation (-r, ctl rotate): the trace goes on in the next file, the 1st
+ * file's name with "-N" added. The new session is started before the old one
+ * is stopped, they overlap a bit rather than leave a gap. Each file is the
+ * trace of a session of its own, with its descriptors, interned data and
+ * clock snapshots, so it is loaded on its own.
+ */
+struct rotation {
+    int segment;            /* the file being written, 0: the 1st */
+    char base_file[128];    /* the 1st file */
+    time_t start_time;      /* of the file being written */
+};
+
+static struct rotation g_rotation;
+
+static void rotate_init(time_t start_time)
 {
-    int rc;
-    pid_t pid;
-    int wstatus;
+    g_rotation.segment = 0;
+    snprintf(g_rotation.base_file, sizeof(g_rotation.base_file), "%s",
+             g_cfg.out_file);
+    g_rotation.start_time = start_time;
+}
 
-    if (!g_tracing_pid)
-        return 0;
+/* -r: the file being written is big or old enough */
+static int rotate_due(void)
+{
+    struct stat st;
 
-    printf("stop tracing...\n");
+    if (g_cfg.rotate_mb && 0 == stat(g_cfg.out_file, &st)
+        && (uint64_t)st.st_size >= (uint64_t)g_cfg.rotate_mb * 1024 * 1024)
+        return 1;
 
-    rc = kill(g_tracing_pid, SIGTERM);
-    if (rc < 0) {
-        if (ESRCH == errno) {
-            fprintf(stderr, "tracing process %d not found\n", g_tracing_pid);
-            g_tracing_pid = 0;
-            return 0;
-        }
+    return g_cfg.rotate_s
+           && time(NULL) - g_rotation.start_time >= (time_t)g_cfg.rotate_s;
+}
 
-        fprintf(stderr, "sig to tracing process failed, errno = %d\n", errno);
-        return -1;
-    }
+/* returns 0 once the file before, copied to prev, is complete */
+static int rotate_tracing(char *prev, size_t size)
+{
+    struct tracing old;
+
+    snprintf(prev, size, "%s", g_cfg.out_file);
+    conn_file_name(g_cfg.out_file, sizeof(g_cfg.out_file),
+                   g_rotation.base_file, g_rotation.segment + 1);
+    printf("\nrotate to %s\n", g_cfg.out_file);
 
-    pid = waitpid(g_tracing_pid, &wstatus, 0);
-    if (pid != g_tracing_pid) {
-        fprintf(stderr, "wait tracing process failed, errno = %d\n", errno);
+    old = std::move(g_tracing);
+    if (start_tracing() < 0) {
+        g_tracing = std::move(old);
+        snprintf(g_cfg.out_file, sizeof(g_cfg.out_file), "%s", prev);
         return -1;
     }
+    g_rotation.segment++;
+    g_rotation.start_time = time(NULL);
 
-    g_tracing_pid = 0;
+    std::swap(g_tracing, old);
+    stop_tracing();
+    g_tracing = std::move(old);
 
     return 0;
 }
 
-static int connect_server(struct sockaddr_in *dest)
-{
-    printf("connect to server(%s:%d)\n",
-           inet_ntoa(dest->sin_addr), ntohs(dest->sin_port));
-
-    return simple_request(dest, PTRACE_MSG_ID_CONNECT, NULL, 0, 3000);
-}
+/*
+ * Control socket (-U): automation starts, marks and stops the tracing around
+ * exactly the interval of interest. Marks are instant events of our own, put
+ * in by the SDK. The commands which take a while are left to the main loop
+ * and answered once they are done.
+ */
+PERFETTO_DEFINE_CATEGORIES(
+    ::perfetto::Category("ptrace").SetDescription("ptrace control marks"));
+
+PERFETTO_TRACK_EVENT_STATIC_STORAGE();
+
+struct ctl_state {
+    struct ptrace_ctl *ctl;
+    struct ptrace_ctl_req *start;   /* answered once tracing has started */
+    struct ptrace_ctl_req *stop;    /* answered once the trace is complete */
+    struct ptrace_ctl_req *rotate;  /* answered once the old file is done */
+    time_t start_time;              /* 0: not started yet */
+    int coordinated;                /* started by a coordinator, not by us */
+};
 
-static void disconnect_server(struct sockaddr_in *dest)
-{
-    printf("disconnect server\n");
-    simple_request(dest, PTRACE_MSG_ID_DISCONNECT, NULL, 0, 3000);
-}
+static struct ctl_state g_ctl;
 
-static uint64_t calc_avg(uint64_t *data, unsigned int cnt)
+static void ctl_handle_cmd(struct ptrace_ctl *ctl, struct ptrace_ctl_req *req,
+                           const char *cmd, const char *arg, void *priv)
 {
-    unsigned int i;
-    uint64_t avg = 0;
-
-    for (i = 0; i < cnt; i++)
-        avg += data[i] / cnt;
+    int server = PTRACE_WORKING_MODE_SERVER == g_cfg.work_mode
+                 || PTRACE_WORKING_MODE_COORD == g_cfg.work_mode;
+    long long size = 0;
+    struct stat st;
 
-    return avg;
+    if (0 == strcmp(cmd, "status")) {
+        if (g_ctl.start_time && 0 == stat(g_cfg.out_file, &st))
+            size = st.st_size;
+        ptrace_ctl_reply(req, 1, "state=%s mode=%s file=%s size=%lld "
+                         "elapsed=%ld",
+                         g_ctl.stop || !g_running ? "stopping"
+                         : g_ctl.start_time ? "tracing" : "waiting",
+                         g_working_mode_name[g_cfg.work_mode],
+                         g_cfg.out_file, size,
+                         g_ctl.start_time ? time(NULL) - g_ctl.start_time : 0);
+    } else if (0 == strcmp(cmd, "mark")) {
+        if (!arg[0]) {
+            ptrace_ctl_reply(req, 0, "usage: mark <name>");
+        } else if (!TRACE_EVENT_CATEGORY_ENABLED("ptrace")) {
+            ptrace_ctl_reply(req, 0, "not recorded, no session takes the "
+                             "track events of ptrace");
+        } else {
+            TRACE_EVENT_INSTANT("ptrace", ::perfetto::DynamicString(arg));
+            ptrace_ctl_reply(req, 1, "ts=%" PRIu64, now_ns());
+        }
+    } else if (0 == strcmp(cmd, "start")) {
+        if (server || g_ctl.coordinated)
+            ptrace_ctl_reply(req, 0, "started by the %s",
+                             server ? "clients" : "coordinator");
+        else if (g_ctl.start || g_ctl.start_time)
+            ptrace_ctl_reply(req, 0, "already started");
+        else
+            g_ctl.start = req;
+    } else if (0 == strcmp(cmd, "stop")) {
+        if (g_ctl.stop) {
+            ptrace_ctl_reply(req, 0, "already stopping");
+        } else {
+            g_ctl.stop = req;
+            g_running = 0;
+        }
+    } else if (0 == strcmp(cmd, "rotate")) {
+        if (PTRACE_WORKING_MODE_ALONE != g_cfg.work_mode)
+            ptrace_ctl_reply(req, 0, "only supported in 'alone' mode");
+        else if (!g_ctl.start_time || !g_running)
+            ptrace_ctl_reply(req, 0, "not tracing");
+        else if (g_ctl.rotate)
+            ptrace_ctl_reply(req, 0, "already rotating");
+        else
+            g_ctl.rotate = req;
+    } else {
+        ptrace_ctl_reply(req, 0, "unknown command: %s", cmd);
+    }
 }
 
-static uint64_t calc_max_diff(uint64_t *data, unsigned int cnt)
+static int ctl_init(void)
 {
-    uint64_t min = 0, max = 0;
-    unsigned int i;
+    if (!g_cfg.ctl_path[0])
+        return 0;
 
-    max = min = data[0];
+    g_ctl.ctl = ptrace_ctl_create(g_cfg.ctl_path, ctl_handle_cmd, NULL);
+    if (!g_ctl.ctl)
+        return -1;
 
-    for (i = 0; i < cnt; i++) {
-        if (data[i] < min)
-            min = data[i];
-        if (data[i] > max)
-            max = data[i];
-    }
+    /* connect to traced now, so the marks are not missed at the start */
+    tracing_init();
+    if (!::perfetto::TrackEvent::Register())
+        fprintf(stderr, "register track events failed, no marks\n");
 
-    return max - min;
+    return 0;
 }
 
-#define MEASURE_TIMES   3
-static int measure_delay(struct sockaddr_in *dest, uint64_t *delay_out)
+static void on_ctl(struct ptrace_msg_ctx *ctx, int fd, uint32_t events,
+                   void *arg)
 {
-    int i, rc;
-    uint64_t time, delay, delay_avg, delay_max_diff;
-    uint64_t delays[MEASURE_TIMES];
-    unsigned int cnt;
+    ptrace_ctl_run(g_ctl.ctl, 0);
+}
 
-    printf("measuring the transmission delay...\n");
+/* serve the control socket in the loop of ctx as well */
+static void ctl_watch(struct ptrace_msg_ctx *ctx)
+{
+    if (g_ctl.ctl)
+        ptrace_msg_ctx_add_fd(ctx, ptrace_ctl_fd(g_ctl.ctl), EPOLLIN,
+                              on_ctl, NULL);
+}
 
-    cnt = 0;
-    memset(delays, 0, sizeof(delays));
-    for (i = 0; i < 100; i++) {
-        time = ::perfetto::base::GetBootTimeNs().count();
-        rc = ptrace_msg_request(dest, PTRACE_MSG_ID_ECHO, NULL, 0, NULL, 3000);
-        if (0 == rc) {
-            delay = (::perfetto::base::GetBootTimeNs().count() - time) / 2;
-            delays[cnt++ % MEASURE_TIMES] = delay;
-
-            if (cnt < MEASURE_TIMES) {
-                printf("delay[%d]: %luns\n", i, delay);
-            } else {
-                delay_avg = calc_avg(delays, MEASURE_TIMES);
-                delay_max_diff = calc_max_diff(delays, MEASURE_TIMES);
-                printf("delay[%d]: %luns, avg(3) = %luns, maxdiff = %luns\n",
-                       i, delay, delay_avg, delay_max_diff);
-                if (delay_max_diff <= 10000) {
-                    *delay_out = delay_avg;
-                    return 0;
-                }
-            }
-        } else {
-            printf("delay[%d]: timeout\n", i);
-        }
+/* wait for "start", 0 if it came */
+static int ctl_wait_start(void)
+{
+    printf("waiting for '%s ctl -U %s start'\n",
+           g_program_name, g_cfg.ctl_path);
 
-        usleep(10*1000);
+    while (g_running && !g_ctl.start) {
+        if (ptrace_ctl_run(g_ctl.ctl, 1000) < 0)
+            return -1;
     }
 
-    return -1;
+    return g_ctl.start ? 0 : -1;
 }
 
-static int send_time(struct sockaddr_in *dest, uint64_t delay)
+static void ctl_started(int rc)
 {
-    struct ptrace_msg_time_data data;
+    if (0 == rc)
+        g_ctl.start_time = time(NULL);
 
-    printf("send boot/delay time to server\n");
-    data.trans_delay = delay;
-    data.boot_time = ::perfetto::base::GetBootTimeNs().count();
+    if (!g_ctl.start)
+        return;
 
-    return simple_request(dest, PTRACE_MSG_ID_TIME, &data, sizeof(data), 3000);
+    if (0 == rc)
+        ptrace_ctl_reply(g_ctl.start, 1, "file=%s", g_cfg.out_file);
+    else
+        ptrace_ctl_reply(g_ctl.start, 0, "start tracing failed");
+    g_ctl.start = NULL;
 }
 
-static int start_server_tracing(struct sockaddr_in *dest)
+static void ctl_rotate(void)
 {
-    printf("start server tracing\n");
-    return simple_request(dest, PTRACE_MSG_ID_START_TRACING, NULL, 0, 3000);
+    char prev[128];
+
+    if (rotate_tracing(prev, sizeof(prev)) < 0)
+        ptrace_ctl_reply(g_ctl.rotate, 0, "start tracing failed");
+    else
+        ptrace_ctl_reply(g_ctl.rotate, 1, "file=%s prev=%s",
+                         g_cfg.out_file, prev);
+    g_ctl.rotate = NULL;
 }
 
-static int stop_server_tracing(struct sockaddr_in *dest)
+/* answer "stop" with the trace made, if tracing ever started */
+static void ctl_exit(const char *file)
 {
-    printf("stop server tracing\n");
-    return simple_request(dest, PTRACE_MSG_ID_STOP_TRACING, NULL, 0, 3000);
+    if (g_ctl.stop && !g_ctl.start_time)
+        ptrace_ctl_reply(g_ctl.stop, 0, "stopped before tracing started, "
+                         "no trace recorded");
+    else if (g_ctl.stop)
+        ptrace_ctl_reply(g_ctl.stop, 1, "file=%s", file);
+    g_ctl.stop = NULL;
+
+    ptrace_ctl_destroy(g_ctl.ctl);
+    g_ctl.ctl = NULL;
 }
 
-static int send_file(struct sockaddr_in *dest, const char *path)
+static int server_run(void)
 {
-    int fd;
-    ssize_t n, send_bytes;
+    int rc = 0;
+    struct ptrace_msg_ctx *ctx;
+    struct ptrace_server server;
+    struct server_conn *sc;
     struct stat st;
-    struct ptrace_msg *msg = (struct ptrace_msg *)g_send_buff;
 
-    if (NULL == dest || NULL == path || '\0' == path[0])
+    ctx = ptrace_msg_ctx_create(&g_cfg.addr);
+    if (!ctx)
         return -1;
 
-    fd = open(path, O_RDONLY);
-    if (fd < 0) {
-        fprintf(stderr, "open %s failed, errno = %d\n", path, errno);
-        return -1;
+    memset(&server, 0, sizeof(server));
+    server.combine = 1;
+    if (PTRACE_WORKING_MODE_COORD == g_cfg.work_mode)
+        server.coord = g_cfg.nclients;
+    ptrace_msg_ctx_set_handler(ctx, server_handle_msg, server_conn_free,
+                               &server);
+    ctl_watch(ctx);
+
+    printf("server started at: %s:%d\n",
+            inet_ntoa(g_cfg.addr.sin_addr), ntohs(g_cfg.addr.sin_port));
+    if (server.coord)
+        printf("waiting for %d client(s)\n", server.coord);
+
+    if (g_cfg.no_wait && !server.coord) {
+        start_tracing();
+        server.start_time = time(NULL);
     }
 
-    fstat(fd, &st);
-    printf("send %s to %s:%u, bytes = %ld(%.1fMB)\n",
-            path, inet_ntoa(dest->sin_addr), ntohs(dest->sin_port),
-            st.st_size, (double)(st.st_size) / 1024.0 / 1024.0);
+    /* serve until the last connected client is gone */
+    while (!server.quit) {
+        if (server.coord ? coord_update(ctx, &server) : !g_running)
+            break;
 
-    if (simple_request(dest, PTRACE_MSG_ID_FILE_BEGIN, NULL, 0, 3000) < 0) {
-        close(fd);
-        return -1;
+        g_ctl.start_time = server.start_time;
+
+        if (g_tracing.session && server.start_time
+            && 0 == stat(g_cfg.out_file, &st)) {
+            printf("\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b> %.1lfMB, %lds",
+                   (double)(st.st_size) / 1024.0 / 1024.0,
+                   time(NULL) - server.start_time);
+            fflush(stdout);
+        }
+
+        rc = ptrace_msg_ctx_run(ctx, 1000);
+        if (rc < 0)
+            break;
     }
 
-    send_bytes = 0;
-    msg->id = PTRACE_MSG_ID_FILE_CONTENT;
-    memcpy(&msg->dest, dest, sizeof(msg->dest));
-    while ((n = read(fd, msg->data, sizeof(g_send_buff)-sizeof(*msg))) > 0) {
-        msg->data_len = n;
-        ptrace_msg_reqeust2(msg, NULL, 3000);
-        send_bytes += n;
-        printf("\b\b\b\b%ld%%", send_bytes * 100 / st.st_size);
-        fflush(stdout);
+    g_ctl.start_time = server.start_time;
+
+    if (server.sched) {
+        pthread_join(server.sched->act.tid, NULL);
+        server_sched_free(ctx, &server);
     }
-    printf("\nsend complete\n");
 
-    simple_request(dest, PTRACE_MSG_ID_FILE_END, NULL, 0, 3000);
+    /* the clients left are freed with the context */
+    ptrace_msg_ctx_destroy(ctx);
 
-    close(fd);
+    if (server.coord) {
+        stop_tracing();
+        coord_report(&server);
+        coord_merge(&server);
+    }
+
+    while ((sc = server.conns) != NULL) {
+        server.conns = sc->next;
+        delete sc;
+    }
+
+    return rc < 0 ? -1 : 0;
+}
+
+
+static int server_main(void)
+{
+    server_run();
+    ctl_exit(g_cfg.comb_file);
+
+    printf("server exit\n");
 
     return 0;
 }
 
-static int server_run(void)
+/* a coordinated client serves the coordinator's START/STOP_TRACING */
+static void coord_handle_msg(struct ptrace_msg_ctx *ctx,
+                             struct ptrace_msg_conn *conn,
+                             struct ptrace_msg *msg, void *arg)
 {
-    int rc;
-    int fd = -1;
-    uint64_t file_size;
-    int64_t diff_time;
-    struct ptrace_msg *msg;
-    time_t start_time = 0;
-    struct stat st;
+    struct ptrace_server *coord = (struct ptrace_server *)arg;
+
+    switch (msg->id) {
+        case PTRACE_MSG_ID_START_TRACING:
+        case PTRACE_MSG_ID_STOP_TRACING:
+            if (msg->data_len >= sizeof(struct ptrace_msg_tracing_data))
+                server_sched_tracing(ctx, coord, msg,
+                                     PTRACE_MSG_ID_START_TRACING == msg->id);
+            else
+                simple_response(ctx, msg, PTRACE_FAILURE);
+            break;
+
+        default:
+            /* like a context without a handler, e.g. a stray FILE_ACK */
+            break;
+    }
+}
 
-    if (g_cfg.no_wait) {
-        start_tracing();
-        start_time = time(NULL);
+static int wait_coordinator(struct ptrace_msg_ctx *ctx,
+                            struct ptrace_server *coord)
+{
+    printf("waiting for the coordinator to start tracing\n");
+    ptrace_msg_ctx_set_handler(ctx, coord_handle_msg, NULL, coord);
+
+    while (g_running && !coord->start_time) {
+        if (ptrace_msg_ctx_run(ctx, 1000) < 0)
+            return -1;
     }
 
-    while (g_running) {
-        if (g_tracing_pid && 0 == stat(g_cfg.out_file, &st)) {
-            printf("\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b> %.1lfMB, %lds",
-                   (double)(st.st_size) / 1024.0 / 1024.0,
-                   time(NULL) - start_time);
-            fflush(stdout);
-        }
+    return coord->start_time ? 0 : -1;
+}
 
-        msg = ptrace_msg_recv(1000);
-        if (!msg)
-            continue;
+/*
+ * Benchmark mode: a server and a client in one process, talking over
+ * loopback through an optional emulated network (-E). The real client and
+ * server code is run, the server side in a thread.
+ */
+#define BENCH_REQUESTS      1000
+#define BENCH_SYNC_ROUNDS   5
+#define BENCH_FILE_MB       64
+
+struct bench {
+    struct ptrace_msg_ctx *ctx;     /* server side */
+    struct ptrace_server server;
+    std::atomic<int64_t> diff_time; /* server's last TIME result */
+    std::atomic<int> time_cnt;
+};
 
-        switch (msg->id) {
-            case PTRACE_MSG_ID_CONNECT:
-                simple_response(msg, PTRACE_SUCCESS);
-                printf("client connected: %s:%d\n",
-                       inet_ntoa(msg->src.sin_addr), ntohs(msg->src.sin_port));
-                break;
+static void bench_handle_msg(struct ptrace_msg_ctx *ctx,
+                             struct ptrace_msg_conn *conn,
+                             struct ptrace_msg *msg, void *arg)
+{
+    int id = msg->id;
+    struct bench *b = (struct bench *)arg;
 
-            case PTRACE_MSG_ID_DISCONNECT:
-                simple_response(msg, PTRACE_SUCCESS);
-                printf("client disconnected\n");
-                return 0;
-                break;
+    server_handle_msg(ctx, conn, msg, &b->server);
 
-            case PTRACE_MSG_ID_ECHO:
-                /* run 2 times */
-                ::perfetto::base::GetBootTimeNs().count();
-                ::perfetto::base::GetBootTimeNs().count();
-                ptrace_msg_response(msg, NULL, 0);
-                break;
+    /* both ends share one clock, the true offset is 0 */
+    if (PTRACE_MSG_ID_TIME == id && conn->data
+        && !((struct server_conn *)conn->data)->clock.empty()) {
+        b->diff_time = ((struct server_conn *)conn->data)->clock.back().offset;
+        b->time_cnt++;
+    }
+}
 
-            case PTRACE_MSG_ID_TIME:
-            {
-                uint64_t bootime = ::perfetto::base::GetBootTimeNs().count();
-                struct ptrace_msg_time_data *data = \
-                        (struct ptrace_msg_time_data *)(msg->data);
+static void bench_conn_free(struct ptrace_msg_ctx *ctx,
+                            struct ptrace_msg_conn *conn, void *arg)
+{
+    server_conn_free(ctx, conn, &((struct bench *)arg)->server);
+}
 
-                diff_time = bootime - data->boot_time - data->trans_delay;
-                simple_response(msg, PTRACE_SUCCESS);
+static void *bench_server_thread(void *arg)
+{
+    struct bench *b = (struct bench *)arg;
 
-                printf("server time: %lu ns\n"
-                       "client time: %lu ns\n"
-                       "trans delay: %lu ns\n"
-                       "diff time  : %ld ns\n",
-                       bootime, data->boot_time,
-                       data->trans_delay, diff_time);
+    while (g_running && !b->server.quit) {
+        if (ptrace_msg_ctx_run(b->ctx, 100) < 0)
+            break;
+    }
 
-                break;
-            }
+    return NULL;
+}
 
-            case PTRACE_MSG_ID_START_TRACING:
-                rc = start_tracing();
-                if (0 == rc)
-                    start_time = time(NULL);
-                simple_response(msg, 0 == rc ? PTRACE_SUCCESS : PTRACE_FAILURE);
-                break;
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
 
-            case PTRACE_MSG_ID_STOP_TRACING:
-                printf("\n");
-                rc = stop_tracing();
-                simple_response(msg, 0 == rc ? PTRACE_SUCCESS : PTRACE_FAILURE);
-                break;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
 
-            case PTRACE_MSG_ID_FILE_BEGIN:
-                printf("receiving client file, save as %s\n", g_cfg.clnt_file);
-                file_size = 0;
-                fd = open(g_cfg.clnt_file, O_CREAT | O_WRONLY, 0664);
-                if (fd < 0)
-                    fprintf(stderr, "create %s failed, errno = %d\n",
-                            g_cfg.clnt_file, errno);
-                simple_response(msg, fd >= 0 ? PTRACE_SUCCESS : PTRACE_FAILURE);
-                break;
+static int bench_file_create(char *path, uint64_t size)
+{
+    int fd;
+    uint32_t i;
+    unsigned int seed = 1;
+    uint32_t *buf;
+    uint64_t done;
 
-            case PTRACE_MSG_ID_FILE_CONTENT:
-                if (fd >= 0) {
-                    rc = write(fd, msg->data, msg->data_len);
-                    file_size += msg->data_len;
-                    printf("\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b>%lu Bytes",
-                           file_size);
-                    fflush(stdout);
-                }
-                simple_response(msg, fd >= 0 ? PTRACE_SUCCESS : PTRACE_FAILURE);
-                break;
+    fd = mkstemp(path);
+    if (fd < 0) {
+        fprintf(stderr, "create %s failed, errno = %d\n", path, errno);
+        return -1;
+    }
 
-            case PTRACE_MSG_ID_FILE_END:
-                if (fd >= 0) {
-                    close(fd);
-                    fd = -1;
-                    simple_response(msg, PTRACE_SUCCESS);
-                    printf("\nreceive complete\n");
-
-                    printf("combining file:\n  + %s\n  + %s\n  = %s\n",
-                           g_cfg.out_file, g_cfg.clnt_file, g_cfg.comb_file);
-                    combine_file(g_cfg.out_file, g_cfg.clnt_file,
-                                 g_cfg.comb_file, diff_time);
-                } else {
-                    simple_response(msg, PTRACE_FAILURE);
-                }
-                break;
+    buf = (uint32_t *)malloc(FILE_SPLICE_BYTES);
+    if (!buf) {
+        close(fd);
+        return -1;
+    }
 
-            default:
-                fprintf(stderr, "unknown msg: id = %u\n", msg->id);
-                break;
+    /* incompressible, the transport is what is measured */
+    for (done = 0; done < size; done += FILE_SPLICE_BYTES) {
+        for (i = 0; i < FILE_SPLICE_BYTES / sizeof(*buf); i++)
+            buf[i] = rand_r(&seed);
+        if (write_all(fd, (char *)buf, FILE_SPLICE_BYTES) < 0) {
+            fprintf(stderr, "write %s failed, errno = %d\n", path, errno);
+            break;
         }
-
-        ptrace_msg_free(msg);
     }
 
-    if (fd >= 0)
-        close(fd);
+    free(buf);
+    close(fd);
 
-    return 0;
+    return done >= size ? 0 : -1;
 }
 
+/* upload path by one channel, returns MB/s or a negative value */
+static double bench_upload(struct ptrace_msg_ctx *ctx, struct sockaddr_in *dest,
+                           const char *path, int udp_only)
+{
+    uint64_t start;
 
-static int server_main(void)
+    g_cfg.udp_only = udp_only;
+    start = now_ns();
+    if (send_file(ctx, dest, path) < 0)
+        return -1.0;
+
+    return BENCH_FILE_MB / ((double)(now_ns() - start) / 1000000000.0);
+}
+
+static int bench_main(void)
 {
-    ptrace_msg_init(&g_cfg.addr);
+    int i, j, rc = -1;
+    int req_fail = 0, sync_fail = 0, sync_cnt = 0, sync_out = 0;
+    uint64_t start, bound_sum = 0;
+    uint64_t lat[BENCH_REQUESTS];
+    int64_t err, err_max = 0, err_sum = 0;
+    struct clock_estimate est;
+    double tcp_mbps = 0, udp_mbps = 0;
+    char netem_desc[160] = "none";
+    char src_file[64] = "/tmp/ptrace-bench-XXXXXX";
+    struct sockaddr_in addr;
+    struct ptrace_netem_cfg ncfg;
+    struct ptrace_netem *ne_srv = NULL, *ne_clnt = NULL;
+    struct ptrace_msg_ctx *ctx = NULL;
+    struct bench b;
+    pthread_t tid;
+
+    if (g_cfg.netem[0]) {
+        if (ptrace_netem_parse(g_cfg.netem, &ncfg) < 0)
+            return -1;
+        ptrace_netem_print(&ncfg, netem_desc, sizeof(netem_desc));
+    }
 
-    printf("server started at: %s:%d\n",
-            inet_ntoa(g_cfg.addr.sin_addr), ntohs(g_cfg.addr.sin_port));
+    if (bench_file_create(src_file, (uint64_t)BENCH_FILE_MB << 20) < 0)
+        return -1;
+    snprintf(g_cfg.clnt_file, sizeof(g_cfg.clnt_file), "%s.recv", src_file);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    memcpy(&g_cfg.addr, &addr, sizeof(addr));   /* TCP channel listens here */
+
+    memset(&b.server, 0, sizeof(b.server));
+    b.diff_time = 0;
+    b.time_cnt = 0;
+    b.ctx = ptrace_msg_ctx_create(&addr);
+    ctx = ptrace_msg_ctx_create(NULL);
+    if (!b.ctx || !ctx || ptrace_msg_ctx_local_addr(b.ctx, &addr) < 0)
+        goto _out;
+    ptrace_msg_ctx_set_handler(b.ctx, bench_handle_msg, bench_conn_free, &b);
+
+    /* one emulator per direction */
+    if (g_cfg.netem[0]) {
+        ne_srv = ptrace_netem_create(&ncfg, b.ctx);
+        ne_clnt = ptrace_netem_create(&ncfg, ctx);
+        if (!ne_srv || !ne_clnt)
+            goto _out;
+    }
 
-    server_run();
+    if (pthread_create(&tid, NULL, bench_server_thread, &b)) {
+        fprintf(stderr, "create server thread failed\n");
+        goto _out;
+    }
 
-    ptrace_msg_destroy();
+    if (connect_server(ctx, &addr) < 0)
+        goto _stop;
 
-    printf("server exit\n");
+    printf("bench: %d requests\n", BENCH_REQUESTS);
+    for (i = 0; i < BENCH_REQUESTS; i++) {
+        start = now_ns();
+        if (ptrace_msg_request(ctx, &addr, PTRACE_MSG_ID_ECHO,
+                               NULL, 0, NULL, 3000) < 0)
+            req_fail++;
+        lat[i] = now_ns() - start;
+    }
+    qsort(lat, BENCH_REQUESTS, sizeof(lat[0]), cmp_u64);
 
-    return 0;
+    for (i = 0; i < BENCH_SYNC_ROUNDS; i++) {
+        if (estimate_clock(ctx, &addr, &est) < 0
+            || send_time(ctx, &addr, &est) < 0) {
+            sync_fail++;
+            continue;
+        }
+
+        /* the server thread records the result after responding */
+        for (j = 0; j < 1000 && b.time_cnt != sync_cnt + 1; j++)
+            usleep(1000);
+
+        err = b.diff_time;
+        if (err < 0)
+            err = -err;
+        err_sum += err;
+        if (err > err_max)
+            err_max = err;
+        if ((uint64_t)err > est.error)
+            sync_out++;     /* the bound was wrong */
+        bound_sum += est.error;
+        sync_cnt++;
+    }
+
+    /* the TCP channel does not go through the emulator */
+    if (!g_cfg.netem[0]) {
+        tcp_mbps = bench_upload(ctx, &addr, src_file, 0);
+        if (tcp_mbps < 0)
+            goto _stop;
+    }
+    udp_mbps = bench_upload(ctx, &addr, src_file, 1);
+    if (udp_mbps < 0)
+        goto _stop;
+
+    rc = 0;
+
+_stop:
+    disconnect_server(ctx, &addr);
+    b.server.quit = 1;
+    pthread_join(tid, NULL);
+
+    if (0 == rc) {
+        printf("\n\033[32m"
+"=====================================================================\n"
+"Network             : %s\n"
+"Requests            : %d, %d failed, latency p50 %.1fus, p99 %.1fus, "
+"max %.1fus\n",
+               netem_desc, BENCH_REQUESTS, req_fail,
+               lat[BENCH_REQUESTS / 2] / 1000.0,
+               lat[BENCH_REQUESTS * 99 / 100] / 1000.0,
+               lat[BENCH_REQUESTS - 1] / 1000.0);
+        if (sync_cnt)
+            printf(
+"Clock Offset Error  : %d rounds, %d failed, avg %.1fus, max %.1fus\n"
+"Clock Error Bound   : avg +/- %.1fus, exceeded %d times\n",
+                   BENCH_SYNC_ROUNDS, sync_fail,
+                   (double)err_sum / sync_cnt / 1000.0, err_max / 1000.0,
+                   (double)bound_sum / sync_cnt / 1000.0, sync_out);
+        else
+            printf(
+"Clock Offset Error  : %d rounds, all failed\n", BENCH_SYNC_ROUNDS);
+        if (!g_cfg.netem[0])
+            printf(
+"Upload (TCP)        : %dMB, %.1fMB/s\n", BENCH_FILE_MB, tcp_mbps);
+        printf(
+"Upload (UDP)        : %dMB, %.1fMB/s\n"
+"=====================================================================\033[0m\n",
+               BENCH_FILE_MB, udp_mbps);
+    }
+
+_out:
+    ptrace_netem_destroy(ne_clnt);
+    ptrace_netem_destroy(ne_srv);
+    ptrace_msg_ctx_destroy(ctx);
+    ptrace_msg_ctx_destroy(b.ctx);
+    unlink(src_file);
+    unlink(g_cfg.clnt_file);
+
+    return rc;
 }
 
 static void signal_exit(int signum)
@@ -481,6 +3672,7 @@ static void signal_init(void)
     signal(SIGTERM, signal_exit);
     signal(SIGABRT, signal_exit);
     signal(SIGQUIT, signal_exit);
+    signal(SIGPIPE, SIG_IGN);   /* a broken TCP channel is reported by EPIPE */
 }
 
 static void show_version(void)
@@ -497,7 +3689,8 @@ static void usage(void)
 Options:\n\
   -h                        display this help and exit\n\
   -v                        output version information and exit\n\
-  -c <config file>          configuration file passed to perfetto\n\
+  -c <config file>          perfetto trace config (text format) of the\n\
+                            session\n\
   -e <event category>       tracking events category, similar to option '-c',\n\
                             which can be 'app', 'sys' or 'all', means the\n\
                             <install dir>/etc/XXX.cfg configuration file\n\
@@ -507,30 +3700,65 @@ Options:\n\
                               all - tracing applications and system events\n\
                             if both '-c' and '-e' options are omitted, the\n\
                             <install dir>/etc/app.cfg file is used by default\n\
-  -m <working mode>         working mode, which can be 'server', 'client' or '\n\
-                            'alone' (default if omitted)\n\
+  -m <working mode>         working mode, which can be 'server', 'client',\n\
+                            'alone' (default if omitted), 'coord' or\n\
+                            'bench'. 'coord' is a server which starts and\n\
+                            stops all its clients together and merges their\n\
+                            traces into one, 'bench' measures the request\n\
+                            latency, clock offset error and upload\n\
+                            throughput on loopback\n\
   -o <output file>          output path\n\
-  -s <IP address>           server's IP address, only used in 'server' and \n\
-                            'client' mode\n\
-  -p <port>                 server's UDP port, only used in 'server' and\n\
-                            'client' mode\n\
+  -s <IP address>           server's IP address, only used in 'server',\n\
+                            'coord' and 'client' mode\n\
+  -p <port>                 server's UDP port, only used in 'server',\n\
+                            'coord' and 'client' mode\n\
+  -N <clients>              the clients to wait for before starting them\n\
+                            (default: 1), only used in 'coord' mode\n\
   -n                        do not wait for the client's messages, start\n\
                             tracking directly after running. only used in\n\
-                            'server' mode\n",
-        g_program_name);
+                            'server' mode\n\
+  -z <level>                zlib level (0-9) to compress the client's trace\n\
+                            upload with, 0 disables it (default: 1). only\n\
+                            used in 'client' mode\n\
+  -L                        upload the trace to the server while tracing,\n\
+                            so little is left to send at the stop. only\n\
+                            used in 'client' mode\n\
+  -T <ms>                   start and stop the tracing of both hosts at the\n\
+                            same instant, <ms> after it is agreed on. each\n\
+                            host sets its session up in advance, and the\n\
+                            skew achieved is reported. only used in 'client'\n\
+                            mode, in 'coord' mode it is the lead time of the\n\
+                            instants (default: 1000)\n\
+  -r <size|age>             rotate the trace into a new file, numbered like\n\
+                            <output file>-1, when the file being written has\n\
+                            reached <size> ('<n>M') or <age> ('<n>s'). both\n\
+                            can be given. each file can be loaded on its\n\
+                            own. only used in 'alone' mode\n\
+  -U <socket>               serve a control socket, see '%s ctl -h'. the\n\
+                            tracing waits for 'ctl start' instead of\n\
+                            starting at once, except in 'server' and\n\
+                            'coord' mode\n\
+  -E <network>              emulate a network in 'bench' mode, e.g.\n\
+                            'delay=10,jitter=1,loss=1,reorder=1,rate=100'\n\
+                            (ms, ms, %%, %%, Mbit/s), 'limit=<n>' caps the\n\
+                            datagrams in flight (default: 1000)\n",
+        g_program_name, g_program_name);
 }
 
 static int parse_args(int argc, char *argv[])
 {
     int opt;
     int tmp;
+    int zset = 0;
+    char *end;
     time_t now;
     struct tm tm;
     char prefix[32];
 
     memset(&g_cfg, 0, sizeof(g_cfg));
+    g_cfg.zlevel = Z_BEST_SPEED;
 
-    while ((opt = getopt(argc, argv, "hve:c:m:o:s:p:n")) != -1) {
+    while ((opt = getopt(argc, argv, "hve:c:m:o:s:p:nN:z:LT:r:U:E:")) != -1) {
         switch (opt) {
             case 'h':
                 usage();
@@ -572,7 +3800,7 @@ static int parse_args(int argc, char *argv[])
                     return -1;
                 }
 
-                if (!access(optarg, R_OK)) {
+                if (access(optarg, R_OK) < 0) {
                     fprintf(stderr,
                             "file does not exist or permission denied: %s\n",
                             optarg);
@@ -590,6 +3818,10 @@ static int parse_args(int argc, char *argv[])
                     g_cfg.work_mode = PTRACE_WORKING_MODE_SERVER;
                 } else if (0 == strcmp(optarg, "client")) {
                     g_cfg.work_mode = PTRACE_WORKING_MODE_CLIENT;
+                } else if (0 == strcmp(optarg, "bench")) {
+                    g_cfg.work_mode = PTRACE_WORKING_MODE_BENCH;
+                } else if (0 == strcmp(optarg, "coord")) {
+                    g_cfg.work_mode = PTRACE_WORKING_MODE_COORD;
                 } else {
                     fprintf(stderr, "invalid working mode: %s\n", optarg);
                     return -1;
@@ -620,6 +3852,64 @@ static int parse_args(int argc, char *argv[])
                 g_cfg.no_wait = 1;
                 break;
 
+            case 'N':
+                tmp = atoi(optarg);
+                if (tmp <= 0 || tmp > PTRACE_COMBINE_MAX_HOSTS) {
+                    fprintf(stderr, "invalid number of clients: %s, 1..%d\n",
+                            optarg, PTRACE_COMBINE_MAX_HOSTS);
+                    return -1;
+                }
+                g_cfg.nclients = tmp;
+                break;
+
+            case 'z':
+                tmp = atoi(optarg);
+                if (tmp < 0 || tmp > 9) {
+                    fprintf(stderr, "invalid compression level: %s\n", optarg);
+                    return -1;
+                }
+                g_cfg.zlevel = tmp;
+                zset = 1;
+                break;
+
+            case 'L':
+                g_cfg.stream = 1;
+                break;
+
+            case 'T':
+                if ((tmp = atoi(optarg)) <= 0) {
+                    fprintf(stderr, "invalid schedule lead time: %s\n", optarg);
+                    return -1;
+                }
+                g_cfg.sched_ms = tmp;
+                break;
+
+            case 'r':
+                tmp = (int)strtol(optarg, &end, 10);
+                if (tmp > 0
+                    && (0 == strcmp(end, "M") || 0 == strcmp(end, "MB"))) {
+                    g_cfg.rotate_mb = tmp;
+                } else if (tmp > 0 && 0 == strcmp(end, "s")) {
+                    g_cfg.rotate_s = tmp;
+                } else {
+                    fprintf(stderr, "invalid rotation: %s\n", optarg);
+                    return -1;
+                }
+                break;
+
+            case 'U':
+                if (strlen(optarg) >= sizeof(g_cfg.ctl_path)) {
+                    fprintf(stderr, "control socket path too long: %s\n",
+                            optarg);
+                    return -1;
+                }
+                strcpy(g_cfg.ctl_path, optarg);
+                break;
+
+            case 'E':
+                snprintf(g_cfg.netem, sizeof(g_cfg.netem), "%s", optarg);
+                break;
+
             default:
                 return -1;
                 break;
@@ -627,9 +3917,15 @@ static int parse_args(int argc, char *argv[])
     }
 
     /* default configuration */
+    if (PTRACE_WORKING_MODE_BENCH == g_cfg.work_mode && !zset)
+        g_cfg.zlevel = 0;   /* the benchmark data is incompressible */
+
     if (0 == g_cfg.addr.sin_port)
         g_cfg.addr.sin_port = htons(6000);
 
+    if (0 == g_cfg.nclients)
+        g_cfg.nclients = 1;
+
     if ('\0' == g_cfg.cfg_file[0])
         snprintf(g_cfg.cfg_file, sizeof(g_cfg.cfg_file), "%s/%s",
                  PTRACE_CONFIG_PATH, "app.cfg");
@@ -644,7 +3940,8 @@ static int parse_args(int argc, char *argv[])
         snprintf(g_cfg.out_file, sizeof(g_cfg.out_file), "%s_%s.ptrace",
                 prefix, g_working_mode_name[g_cfg.work_mode]);
 
-    if (PTRACE_WORKING_MODE_SERVER == g_cfg.work_mode) {
+    if (PTRACE_WORKING_MODE_SERVER == g_cfg.work_mode
+        || PTRACE_WORKING_MODE_COORD == g_cfg.work_mode) {
         snprintf(g_cfg.clnt_file, sizeof(g_cfg.out_file), "%s_client.ptrace", prefix);
         snprintf(g_cfg.comb_file, sizeof(g_cfg.out_file), "%s_comb.ptrace", prefix);
     }
@@ -658,20 +3955,46 @@ Trace File          : %s\n",
         g_working_mode_name[g_cfg.work_mode],
         g_cfg.cfg_file, g_cfg.out_file);
 
-    if (PTRACE_WORKING_MODE_ALONE != g_cfg.work_mode) {
+    if (PTRACE_WORKING_MODE_CLIENT == g_cfg.work_mode
+        || PTRACE_WORKING_MODE_SERVER == g_cfg.work_mode
+        || PTRACE_WORKING_MODE_COORD == g_cfg.work_mode) {
         printf("\
 Server Address      : %s:%d\n",
             inet_ntoa(g_cfg.addr.sin_addr),
             ntohs(g_cfg.addr.sin_port));
     }
 
-    if (PTRACE_WORKING_MODE_SERVER == g_cfg.work_mode) {
+    if (PTRACE_WORKING_MODE_SERVER == g_cfg.work_mode
+        || PTRACE_WORKING_MODE_COORD == g_cfg.work_mode) {
         printf("\
 Client Trace File   : %s\n\
 Combined Trace File : %s\n",
             g_cfg.clnt_file, g_cfg.comb_file);
     }
 
+    if (PTRACE_WORKING_MODE_COORD == g_cfg.work_mode) {
+        printf("\
+Clients             : %u\n",
+            g_cfg.nclients);
+    }
+
+    if ((g_cfg.rotate_mb || g_cfg.rotate_s)
+        && PTRACE_WORKING_MODE_ALONE == g_cfg.work_mode) {
+        printf("\
+Rotation            :");
+        if (g_cfg.rotate_mb)
+            printf(" %uMB", g_cfg.rotate_mb);
+        if (g_cfg.rotate_s)
+            printf(" %us", g_cfg.rotate_s);
+        printf("\n");
+    }
+
+    if (g_cfg.ctl_path[0] && PTRACE_WORKING_MODE_BENCH != g_cfg.work_mode) {
+        printf("\
+Control Socket      : %s\n",
+            g_cfg.ctl_path);
+    }
+
         printf("\
 =====================================================================\033[0m\n");
 
@@ -681,10 +4004,16 @@ Combined Trace File : %s\n",
 
 int ptrace_main(int argc, char *argv[])
 {
-    int rc;
-    uint64_t delay;
+    int rc, tracing = 0, coordinated = 0;
+    struct ptrace_server coord;     /* the coordinator's requests, if any */
+    struct clock_estimate est;
+    struct clock_resync resync;
+    struct ptrace_msg_tracing_stats stats;
+    struct ptrace_msg_ctx *ctx = NULL;
+    struct file_streamer *fs = NULL;
     time_t start_time;
     struct stat st;
+    char prev[128];
 
     g_program_name = argv[0];
 
@@ -695,46 +4024,86 @@ int ptrace_main(int argc, char *argv[])
     }
 
     g_running = 1;
+    memset(&coord, 0, sizeof(coord));
+    resync.running = 0;
 
     signal_init();
 
-    if (PTRACE_WORKING_MODE_SERVER == g_cfg.work_mode)
+    if (PTRACE_WORKING_MODE_BENCH != g_cfg.work_mode && ctl_init() < 0)
+        exit(EXIT_FAILURE);
+
+    if (PTRACE_WORKING_MODE_SERVER == g_cfg.work_mode
+        || PTRACE_WORKING_MODE_COORD == g_cfg.work_mode)
         return server_main();
 
+    if (PTRACE_WORKING_MODE_BENCH == g_cfg.work_mode)
+        return bench_main() < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+
     if (PTRACE_WORKING_MODE_CLIENT == g_cfg.work_mode) {
-        ptrace_msg_init(NULL);
+        ctx = ptrace_msg_ctx_create(NULL);
+        if (!ctx)
+            exit(EXIT_FAILURE);
+        ctl_watch(ctx);
 
-        rc = connect_server(&g_cfg.addr);
+        rc = connect_server(ctx, &g_cfg.addr);
         if (rc < 0) {
             fprintf(stderr, "connect server failed\n");
             goto _exit;
         }
+        coordinated = g_ctl.coordinated = rc;
 
-        rc = measure_delay(&g_cfg.addr, &delay);
+        printf("estimating the clock offset, %d probes...\n", CLOCK_PROBES);
+        rc = estimate_clock(ctx, &g_cfg.addr, &est);
         if (rc < 0) {
-            fprintf(stderr, "warning: the delay time may have a large error\n");
+            fprintf(stderr, "estimate the clock offset failed\n");
             goto _exit;
         }
 
-        send_time(&g_cfg.addr, delay);
+        printf("send the clock offset to server\n");
+        send_time(ctx, &g_cfg.addr, &est);
+    }
+
+    if (g_ctl.ctl && !coordinated && ctl_wait_start() < 0)
+        goto _exit;
 
-        rc = start_server_tracing(&g_cfg.addr);
+    if (PTRACE_WORKING_MODE_CLIENT == g_cfg.work_mode
+        && !g_cfg.sched_ms && !coordinated) {
+        rc = start_server_tracing(ctx, &g_cfg.addr);
         if (rc < 0) {
             fprintf(stderr, "server start tracing failed\n");
+            ctl_started(rc);
             goto _exit;
         }
     }
 
-    rc = start_tracing();
+    if (coordinated)
+        rc = wait_coordinator(ctx, &coord);
+    else if (PTRACE_WORKING_MODE_CLIENT == g_cfg.work_mode && g_cfg.sched_ms)
+        rc = sched_tracing(ctx, &g_cfg.addr, &est, 1);
+    else
+        rc = start_tracing();
+    ctl_started(rc);
     if (rc < 0) {
         fprintf(stderr, "start tracing failed\n");
         goto _exit;
     }
 
+    if (PTRACE_WORKING_MODE_CLIENT == g_cfg.work_mode && g_cfg.stream)
+        fs = stream_file_begin(ctx, &g_cfg.addr, g_cfg.out_file);
+
+    tracing = 1;
     start_time = time(NULL);
+    rotate_init(start_time);
     printf("press CTRL-C to stop tracing\n");
 
+    /* follow the drift of the clocks, the server keeps every sample */
+    if (PTRACE_WORKING_MODE_CLIENT == g_cfg.work_mode)
+        start_resync(&resync, &g_cfg.addr);
+
     while (g_running) {
+        if (resync.running)
+            poll_resync(ctx, &resync, &est);
+
         rc = stat(g_cfg.out_file, &st);
         if (0 == rc) {
             printf("\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b> %.1lfMB, %lds",
@@ -743,22 +4112,63 @@ int ptrace_main(int argc, char *argv[])
             fflush(stdout);
         }
 
-        sleep(1);
+        if (!coordinated) {
+            if (!g_ctl.ctl)
+                sleep(1);
+            else if (0 == ptrace_ctl_run(g_ctl.ctl, 1000) && g_ctl.rotate)
+                ctl_rotate();
+
+            if (PTRACE_WORKING_MODE_ALONE == g_cfg.work_mode && g_running
+                && rotate_due() && rotate_tracing(prev, sizeof(prev)) < 0) {
+                fprintf(stderr, "rotate failed, %s goes on\n",
+                        g_cfg.out_file);
+                g_cfg.rotate_mb = g_cfg.rotate_s = 0;
+            }
+            continue;
+        }
+
+        /* stopped by the coordinator, CTRL-C stops this client alone */
+        if (ptrace_msg_ctx_run(ctx, 1000) < 0
+            || (!g_tracing.session && !coord.sched))
+            break;
     }
 
     printf("\n\n");
 
 _exit:
+    stop_resync(ctx, &resync, &est);
+    if (coord.sched) {
+        pthread_join(coord.sched->act.tid, NULL);
+        server_sched_free(ctx, &coord);
+    }
+    if (PTRACE_WORKING_MODE_CLIENT == g_cfg.work_mode && g_cfg.sched_ms
+        && tracing && !coordinated)
+        sched_tracing(ctx, &g_cfg.addr, &est, 0);
     stop_tracing();
 
     if (PTRACE_WORKING_MODE_CLIENT == g_cfg.work_mode) {
-        stop_server_tracing(&g_cfg.addr);
-        send_file(&g_cfg.addr, g_cfg.out_file);
-        disconnect_server(&g_cfg.addr);
+        /* after a scheduled stop, the skew is reported already */
+        if (!coordinated
+            && 0 == stop_server_tracing(ctx, &g_cfg.addr, &stats)
+            && tracing && !g_cfg.sched_ms)
+            print_start_skew(&est, &stats);
+
+        /* the last sample bounds the drift up to the end of the trace */
+        if (tracing && 0 == estimate_clock(ctx, &g_cfg.addr, &est))
+            send_time(ctx, &g_cfg.addr, &est);
+
+        if (fs)
+            stream_file_end(ctx, &g_cfg.addr, fs);
+        else
+            send_file(ctx, &g_cfg.addr, g_cfg.out_file);
+        disconnect_server(ctx, &g_cfg.addr);
     }
 
-    if (PTRACE_WORKING_MODE_CLIENT == g_cfg.work_mode)
-        ptrace_msg_destroy();
+    ptrace_msg_ctx_destroy(ctx);
+    ctl_exit(g_cfg.out_file);
+
+    if (g_rotation.segment)
+        printf("trace files: %s to %s\n", g_rotation.base_file, g_cfg.out_file);
 
     printf("exit\n");
 
@@ -1,25 +1,78 @@
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <inttypes.h>
 //#include <uuid/uuid.h>
 
 #include <fstream>
+#include <set>
 
 #include "perfetto_trace.pb.h"
+#include "ptrace_combine.h"
+
+/*
+ * Host h (1, 2...) of a combined trace is given ids of its own, h times these
+ * apart from those of file1's host. Pids stay below 2^22, so the pids of
+ * PTRACE_COMBINE_MAX_HOSTS hosts still fit in int32.
+ */
+#define PTRACE_HOST_UID     10000
+#define PTRACE_HOST_SEQ_ID  10000
+#define PTRACE_HOST_PID     10000000
+#define PTRACE_HOST_CPU     200
+#define PTRACE_HOST_UUID    100
 
 struct modify_info {
-    int32_t diff_uid;
-    int32_t diff_seq_id;
-    int32_t diff_pid;
-    int32_t diff_tid;
-    int32_t diff_cpu;
-    int64_t diff_time;
+    int host;
+    int64_t diff_uid;
+    int64_t diff_seq_id;
+    int64_t diff_pid;
+    int64_t diff_tid;
+    int64_t diff_cpu;
+    const struct ptrace_clock_sample *clock;    /* time offset samples */
+    int nclock;
+    std::set<uint32_t> seq_clock;   /* sequences with a default clock id */
 };
 
-static uint64_t new_uuid(uint64_t uuid)
+/*
+ * The builtin clocks of each other host are moved into a clock domain of its
+ * own, host h's clock c becomes the global clock h * 128 + c. The domain is
+ * tied to file1's boot time by the time offset samples, stored as
+ * ClockSnapshot packets. The trace processor converts the timestamps with
+ * them, only the fields without a clock id are rewritten here.
+ */
+#define PTRACE_CLOCK_BASE   128     /* global clock ids start here */
+
+/*
+ * The trace processor takes the offset of the last snapshot before a
+ * timestamp as is, it doesn't interpolate between them. The snapshots are
+ * put this close, so the offset moves in steps below the clock error
+ * (20ns at 20ppm), like the interpolated one of modify_time() does.
+ */
+#define PTRACE_CLOCK_STEP       (1000ULL * 1000 * 1000)
+#define PTRACE_CLOCK_SNAPSHOTS  (1000 * 1000)   /* at most, further apart */
+
+static uint32_t modify_clock_id(const struct modify_info *mod,
+                                uint32_t clock_id)
+{
+    /* the sequence scoped clocks are defined on top of the builtin ones */
+    if (clock_id > 0 && clock_id <= ::perfetto::protos::BUILTIN_CLOCK_MAX_ID)
+        return PTRACE_CLOCK_BASE * mod->host + clock_id;
+
+    return clock_id;
+}
+
+/* a boot timestamp of file2 without a clock id, on the clock of file1 */
+static uint64_t modify_time(const struct modify_info *mod, uint64_t ts)
+{
+    return ts + ptrace_clock_offset(mod->clock, mod->nclock, ts);
+}
+
+static uint64_t new_uuid(const struct modify_info *mod, uint64_t uuid)
 {
 #if 0
     uuid_t ut;
@@ -36,7 +89,7 @@ static uint64_t new_uuid(uint64_t uuid)
 
     return uuid_map[uuid];
 #endif
-    return uuid + 100;
+    return uuid + PTRACE_HOST_UUID * mod->host;
 }
 
 static int modify_process_tree(
@@ -75,7 +128,7 @@ static int modify_process_tree(
 
     if (pt->has_collection_end_timestamp()) {
         pt->set_collection_end_timestamp(
-                pt->collection_end_timestamp() + mod->diff_time);
+                modify_time(mod, pt->collection_end_timestamp()));
     }
 
     return 0;
@@ -99,7 +152,7 @@ static int modify_ftrace_events(
     for (int i = 0; i < fes->event_size(); i++) {
         fe = fes->mutable_event(i);
         if (fe->has_timestamp())
-            fe->set_timestamp(fe->timestamp() + mod->diff_time);
+            fe->set_timestamp(modify_time(mod, fe->timestamp()));
 
         if (fe->has_pid())
             fe->set_pid(fe->pid() + mod->diff_pid);
@@ -134,9 +187,10 @@ static int modify_ftrace_events(
         ::perfetto::protos::FtraceEventBundle_CompactSched *cs;
         cs = fes->mutable_compact_sched();
 
+        /* delta encoded, a bundle is too short to drift within it */
         if (cs->switch_timestamp_size() > 0) {
             cs->set_switch_timestamp(0,
-                    cs->switch_timestamp(0) + mod->diff_time);
+                    modify_time(mod, cs->switch_timestamp(0)));
         }
 
         for (int i = 0; i < cs->switch_next_pid_size(); i++) {
@@ -154,17 +208,15 @@ static int modify_ftrace_stats(
         ::perfetto::protos::TracePacket *pkt,
         const struct modify_info *mod)
 {
-    double diff_time;
     ::perfetto::protos::FtraceStats *fs;
     ::perfetto::protos::FtraceCpuStats *fcs;
 
     if (! pkt->has_ftrace_stats())
         return -1;
 
-    diff_time = (double)(mod->diff_time) / 1000000000.0;
-
     fs = pkt->mutable_ftrace_stats();
 
+    /* in seconds */
     for (int i = 0; i < fs->cpu_stats_size(); i++) {
         fcs = fs->mutable_cpu_stats(i);
 
@@ -172,10 +224,12 @@ static int modify_ftrace_stats(
             fcs->set_cpu(fcs->cpu() + mod->diff_cpu);
 
         if (fcs->has_oldest_event_ts())
-            fcs->set_oldest_event_ts(fcs->oldest_event_ts() + diff_time);
+            fcs->set_oldest_event_ts(modify_time(mod,
+                    fcs->oldest_event_ts() * 1000000000.0) / 1000000000.0);
 
         if (fcs->has_now_ts())
-            fcs->set_now_ts(fcs->now_ts() + diff_time);
+            fcs->set_now_ts(modify_time(mod,
+                    fcs->now_ts() * 1000000000.0) / 1000000000.0);
     }
 
     return 0;
@@ -215,12 +269,16 @@ static int modify_trace_packet_defaults(
 
     tpd = pkt->mutable_trace_packet_defaults();
 
+    if (tpd->has_timestamp_clock_id())
+        tpd->set_timestamp_clock_id(modify_clock_id(mod,
+                                                    tpd->timestamp_clock_id()));
+
     if (tpd->has_track_event_defaults()) {
         ::perfetto::protos::TrackEventDefaults *ted;
         ted = tpd->mutable_track_event_defaults();
 
         if (ted->has_track_uuid())
-            ted->set_track_uuid(new_uuid(ted->track_uuid()));
+            ted->set_track_uuid(new_uuid(mod, ted->track_uuid()));
     }
 
     return 0;
@@ -238,10 +296,10 @@ static int modify_track_descriptor(
     td = pkt->mutable_track_descriptor();
 
     if (td->has_uuid())
-        td->set_uuid(new_uuid(td->uuid()));
+        td->set_uuid(new_uuid(mod, td->uuid()));
 
     if (td->has_parent_uuid())
-        td->set_parent_uuid(new_uuid(td->parent_uuid()));
+        td->set_parent_uuid(new_uuid(mod, td->parent_uuid()));
 
     if (td->has_thread()) {
         ::perfetto::protos::ThreadDescriptor *thread = td->mutable_thread();
@@ -275,8 +333,21 @@ static int modify_clock_snapshot(
         ::perfetto::protos::TracePacket *pkt,
         const struct modify_info *mod)
 {
-    if (pkt->has_clock_snapshot())
-        pkt->clear_clock_snapshot();
+    ::perfetto::protos::ClockSnapshot *cs;
+
+    if (! pkt->has_clock_snapshot())
+        return -1;
+
+    cs = pkt->mutable_clock_snapshot();
+
+    /* file1 has the primary trace clock */
+    cs->clear_primary_trace_clock();
+
+    for (int i = 0; i < cs->clocks_size(); i++) {
+        ::perfetto::protos::ClockSnapshot_Clock *c = cs->mutable_clocks(i);
+
+        c->set_clock_id(modify_clock_id(mod, c->clock_id()));
+    }
 
     return 0;
 }
@@ -311,16 +382,73 @@ static int modify_synchronization_marker(
     return 0;
 }
 
+static void widen_range(uint64_t ts, uint64_t *first, uint64_t *last)
+{
+    if (ts < *first)
+        *first = ts;
+    if (ts > *last)
+        *last = ts;
+}
+
+/*
+ * The boot times the trace of the host spans, those of the packets on the
+ * boot clock and of the ftrace events, before they are modified.
+ */
+static void time_range(const ::perfetto::protos::Trace *trace,
+                       const struct modify_info *mod,
+                       uint64_t *first, uint64_t *last)
+{
+    *first = UINT64_MAX;
+    *last = 0;
+
+    for (int i = 0; i < trace->packet_size(); i++) {
+        const ::perfetto::protos::TracePacket &pkt = trace->packet(i);
+
+        if (pkt.has_timestamp()
+            && (pkt.has_timestamp_clock_id()
+                ? ::perfetto::protos::BUILTIN_CLOCK_BOOTTIME
+                  == pkt.timestamp_clock_id()
+                : !mod->seq_clock.count(pkt.trusted_packet_sequence_id())))
+            widen_range(pkt.timestamp(), first, last);
+
+        if (!pkt.has_ftrace_events())
+            continue;
+
+        for (int j = 0; j < pkt.ftrace_events().event_size(); j++) {
+            if (pkt.ftrace_events().event(j).has_timestamp())
+                widen_range(pkt.ftrace_events().event(j).timestamp(),
+                            first, last);
+        }
+    }
+}
+
+/* first and last: the boot times it spans before */
 static void modify_trace(::perfetto::protos::Trace *trace,
-                  const struct modify_info *mod)
+                  struct modify_info *mod, uint64_t *first, uint64_t *last)
 {
     ::perfetto::protos::TracePacket *pkt;
 
     for (int i = 0; i < trace->packet_size(); i++) {
         pkt = trace->mutable_packet(i);
+        if (pkt->has_trace_packet_defaults()
+            && pkt->trace_packet_defaults().has_timestamp_clock_id())
+            mod->seq_clock.insert(pkt->trusted_packet_sequence_id());
+    }
 
-        if (pkt->has_timestamp())
-            pkt->set_timestamp(pkt->timestamp() + mod->diff_time);
+    time_range(trace, mod, first, last);
+
+    for (int i = 0; i < trace->packet_size(); i++) {
+        pkt = trace->mutable_packet(i);
+
+        /* no clock id means the sequence default, or the boot time */
+        if (pkt->has_timestamp_clock_id()) {
+            pkt->set_timestamp_clock_id(
+                    modify_clock_id(mod, pkt->timestamp_clock_id()));
+        } else if (pkt->has_timestamp()
+                   && !mod->seq_clock.count(pkt->trusted_packet_sequence_id())) {
+            pkt->set_timestamp_clock_id(modify_clock_id(mod,
+                    ::perfetto::protos::BUILTIN_CLOCK_BOOTTIME));
+        }
 
         switch (pkt->data_case()) {
         case ::perfetto::protos::TracePacket::DataCase::kProcessTree:
@@ -375,58 +503,153 @@ static void modify_trace(::perfetto::protos::Trace *trace,
     }
 }
 
-int combine_file(const char *file1, const char *file2,
-                 const char *output, int64_t time_diff_ns)
+/*
+ * Snapshots of both boot clocks every PTRACE_CLOCK_STEP, from first to last
+ * on the host's clock, with the offsets of modify_time(). They are put before
+ * the packets of the host, which the trace processor can't convert without
+ * them.
+ */
+static void clock_snapshots(::perfetto::protos::Trace *trace,
+                            const struct modify_info *mod,
+                            uint64_t first, uint64_t last)
 {
-    int fd, fdo;
+    uint64_t t, step = PTRACE_CLOCK_STEP;
+    ::perfetto::protos::TracePacket *pkt;
+    ::perfetto::protos::ClockSnapshot_Clock *c;
+
+    /* the samples bound the range too, one is a constant offset */
+    if (1 == mod->nclock || mod->clock[0].time < first)
+        first = mod->clock[0].time;
+    if (1 == mod->nclock || mod->clock[mod->nclock - 1].time > last)
+        last = mod->clock[mod->nclock - 1].time;
+
+    if ((last - first) / step > PTRACE_CLOCK_SNAPSHOTS)
+        step = (last - first) / PTRACE_CLOCK_SNAPSHOTS;
+
+    for (t = first; ; t = last - t > step ? t + step : last) {
+        pkt = trace->add_packet();
+        pkt->set_trusted_packet_sequence_id(mod->diff_seq_id);
+
+        c = pkt->mutable_clock_snapshot()->add_clocks();
+        c->set_clock_id(modify_clock_id(mod,
+                ::perfetto::protos::BUILTIN_CLOCK_BOOTTIME));
+        c->set_timestamp(t);
+
+        c = pkt->mutable_clock_snapshot()->add_clocks();
+        c->set_clock_id(::perfetto::protos::BUILTIN_CLOCK_BOOTTIME);
+        c->set_timestamp(modify_time(mod, t));
+
+        if (t == last)
+            break;
+    }
+}
+
+/* modify the trace of another host and write it to fdo */
+static int combine_host(int fdo, const struct ptrace_combine_input *in,
+                        int host)
+{
+    int fd;
+    uint64_t first, last;
     struct modify_info mod;
-    ssize_t n;
-    char buf[1024*1024];
-    ::perfetto::protos::Trace trace;
+    struct ptrace_clock_sample zero;
+    ::perfetto::protos::Trace trace, sync;
 
-    printf("loading %s ...\n", file2);
-    fd = open(file2, O_RDONLY);
+    printf("loading %s ...\n", in->file);
+    fd = open(in->file, O_RDONLY);
     if (fd < 0) {
-        fprintf(stderr, "open %s failed, errno = %d\n", file2, errno);
+        fprintf(stderr, "open %s failed, errno = %d\n", in->file, errno);
         return -1;
     }
     trace.ParseFromFileDescriptor(fd);
     close(fd);
     printf("load completed\n");
 
-    mod.diff_uid    = 10000;
-    mod.diff_seq_id = 10000;
-    mod.diff_pid    = 1000000000;
-    mod.diff_tid    = 1000000000;
-    mod.diff_cpu    = 200;
-    mod.diff_time   = time_diff_ns;
+    mod.host        = host;
+    mod.diff_uid    = (int64_t)PTRACE_HOST_UID * host;
+    mod.diff_seq_id = (int64_t)PTRACE_HOST_SEQ_ID * host;
+    mod.diff_pid    = (int64_t)PTRACE_HOST_PID * host;
+    mod.diff_tid    = (int64_t)PTRACE_HOST_PID * host;
+    mod.diff_cpu    = (int64_t)PTRACE_HOST_CPU * host;
+    mod.clock       = in->clock;
+    mod.nclock      = in->nclock;
+
+    /* without a sample its packets could not be put on any clock of file1 */
+    if (0 == mod.nclock) {
+        fprintf(stderr, "no clock offset of %s, taken as 0\n", in->file);
+        memset(&zero, 0, sizeof(zero));
+        mod.clock = &zero;
+        mod.nclock = 1;
+    }
 
     fprintf(stderr, "modify %s:\n\
   packages      : %d\n\
-  diff uid      : %d\n\
-  diff seq id   : %d\n\
-  diff pid      : %d\n\
-  diff tid      : %d\n\
-  diff cpu id   : %d\n\
-  diff time     : %ld\n",
-        file2, trace.packet_size(),
+  host          : %d\n\
+  diff uid      : %" PRId64 "\n\
+  diff seq id   : %" PRId64 "\n\
+  diff pid      : %" PRId64 "\n\
+  diff tid      : %" PRId64 "\n\
+  diff cpu id   : %" PRId64 "\n\
+  diff time     : %" PRId64 " .. %" PRId64 " (%d samples)\n",
+        in->file, trace.packet_size(), host,
         mod.diff_uid, mod.diff_seq_id,
-        mod.diff_pid, mod.diff_tid,
-        mod.diff_cpu, mod.diff_time);
+        mod.diff_pid, mod.diff_tid, mod.diff_cpu,
+        in->nclock ? in->clock[0].offset : 0,
+        in->nclock ? in->clock[in->nclock - 1].offset : 0,
+        in->nclock);
 
-    modify_trace(&trace, &mod);
+    modify_trace(&trace, &mod, &first, &last);
     printf("modify completed\n");
 
-    fdo = open(output, O_WRONLY | O_CREAT, 0664);
+    /* a trace is a sequence of packets, serialized ones can be appended */
+    printf("combining %s ...\n", in->file);
+    clock_snapshots(&sync, &mod, first, last);
+    if (!sync.SerializeToFileDescriptor(fdo)
+        || !trace.SerializeToFileDescriptor(fdo)) {
+        fprintf(stderr, "write %s failed\n", in->file);
+        return -1;
+    }
+
+#if 0
+    std::ofstream ofs2_txt("file2.txt");
+    ofs2_txt << trace.DebugString();
+    ofs2_txt.close();
+
+    std::ofstream ofs2_bin("file2.ptrace");
+    trace.SerializeToOstream(&ofs2_bin);
+    ofs2_bin.close();
+#endif
+
+    return 0;
+}
+
+int combine_files(const char *file1, const struct ptrace_combine_input *inputs,
+                  int n, const char *output)
+{
+    int i, fd, fdo;
+    ssize_t len;
+    char buf[1024*1024];
+
+    if (n > PTRACE_COMBINE_MAX_HOSTS) {
+        fprintf(stderr, "can not combine %d hosts, at most %d besides %s\n",
+                n, PTRACE_COMBINE_MAX_HOSTS, file1);
+        return -1;
+    }
+
+    fdo = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0664);
     if (fdo < 0) {
         fprintf(stderr, "open %s failed, errno = %d\n", output, errno);
         return -1;
     }
 
-    printf("combining %s into %s ...\n", file2, output);
-    trace.SerializeToFileDescriptor(fdo);
+    printf("combining into %s ...\n", output);
+    for (i = 0; i < n; i++) {
+        if (combine_host(fdo, &inputs[i], i + 1) < 0) {
+            close(fdo);
+            return -1;
+        }
+    }
 
-    printf("combining %s into %s ...\n", file1, output);
+    printf("combining %s ...\n", file1);
     fd = open(file1, O_RDONLY);
     if (fd < 0) {
         fprintf(stderr, "open %s failed, errno = %d\n", file1, errno);
@@ -434,25 +657,27 @@ int combine_file(const char *file1, const char *file2,
         return -1;
     }
 
-    while ((n = read(fd, buf, sizeof(buf))) > 0)
-        write(fdo, buf, n);
+    while ((len = read(fd, buf, sizeof(buf))) > 0)
+        write(fdo, buf, len);
 
     close(fd);
     close(fdo);
 
     printf("combine completed\n");
 
-#if 0
-    std::ofstream ofs2_txt("file2.txt");
-    ofs2_txt << trace.DebugString();
-    ofs2_txt.close();
+    return 0;
+}
 
-    std::ofstream ofs2_bin("file2.ptrace");
-    trace.SerializeToOstream(&ofs2_bin);
-    ofs2_bin.close();
-#endif
+int combine_file(const char *file1, const char *file2, const char *output,
+                 const struct ptrace_clock_sample *clock, int nclock)
+{
+    struct ptrace_combine_input in;
 
-    return 0;
+    in.file = file2;
+    in.clock = clock;
+    in.nclock = nclock;
+
+    return combine_files(file1, &in, 1, output);
 }
 
 
@@ -463,32 +688,76 @@ static void usage(void)
     printf("\
 ptrace-combine %s\n\
 Copyright (c) 2021-2022 Flynn\n\
-Usage: %s <file1> <file2> <output> <time-diff>\n\
+Usage: %s <file1> <file2> <output> <time-diff> [<fileN> <time-diff>]...\n\
   file1             the 1st input file\n\
   file2             the 2nd input file\n\
   output            the combined output file\n\
   time-diff         time-diff = t1 - t2, tN means fileN's timestamp,\n\
-                    in nanoseconds\n",
+                    in nanoseconds, or a clock file saved by the server\n\
+                    (<client file>.clock) whose offsets drift over time\n\
+  fileN             the trace of another host, each with its time-diff\n",
         PTRACE_VERSION, g_program_name);
 }
 
+/* a constant time difference or a clock file, the samples are malloc()ed */
+static int load_time_diff(const char *arg, struct ptrace_combine_input *in)
+{
+    char *end;
+    struct ptrace_clock_sample *clock;
+
+    clock = (struct ptrace_clock_sample *)calloc(1, sizeof(*clock));
+    if (!clock)
+        return -1;
+
+    clock->offset = strtoll(arg, &end, 10);
+    if ('\0' == arg[0] || '\0' != *end) {
+        free(clock);
+        if (ptrace_clock_load(arg, &clock, &in->nclock) < 0)
+            return -1;
+    } else if (!clock->offset) {
+        fprintf(stderr, "invalid time difference: %s\n", arg);
+        free(clock);
+        return -1;
+    } else {
+        in->nclock = 1;
+    }
+
+    in->clock = clock;
+
+    return 0;
+}
+
 int ptrace_combine_main(int argc, char *argv[])
 {
-    int64_t time_diff;
+    int i, n, rc = -1;
+    struct ptrace_combine_input *inputs;
 
     g_program_name = argv[0];
 
-    if (argc < 5) {
+    if (argc < 5 || 0 != (argc - 5) % 2) {
         usage();
         return -1;
     }
 
-    time_diff = atoll(argv[4]);
-    if (!time_diff) {
-        fprintf(stderr, "invalid time difference\n");
-        usage();
+    n = (argc - 3) / 2;
+    inputs = (struct ptrace_combine_input *)calloc(n, sizeof(*inputs));
+    if (!inputs)
         return -1;
+
+    for (i = 0; i < n; i++) {
+        inputs[i].file = i ? argv[2 * i + 3] : argv[2];
+        if (load_time_diff(i ? argv[2 * i + 4] : argv[4], &inputs[i]) < 0) {
+            usage();
+            goto _out;
+        }
     }
 
-    return combine_file(argv[1], argv[2], argv[3], atoll(argv[4]));
+    rc = combine_files(argv[1], inputs, n, argv[3]);
+
+_out:
+    for (i = 0; i < n; i++)
+        free((void *)inputs[i].clock);
+    free(inputs);
+
+    return rc;
 }
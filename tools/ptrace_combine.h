@@ -0,0 +1,30 @@
+#ifndef __PTRACE_COMBINE_H__
+#define __PTRACE_COMBINE_H__
+
+#include "ptrace_clock.h"
+
+/* the other hosts a combined trace can hold, their pids must fit in int32 */
+#define PTRACE_COMBINE_MAX_HOSTS    200
+
+/* the trace of another host, and the offsets of its clock to file1's */
+struct ptrace_combine_input {
+    const char *file;
+    const struct ptrace_clock_sample *clock;
+    int nclock;
+};
+
+/*
+ * Combine the traces of several hosts into output. file1 is copied as is,
+ * the n others are given namespaces of their own: the pids, cpus, track
+ * uuids and clocks of inputs[i] are those of host i + 1.
+ */
+extern int combine_files(const char *file1,
+                         const struct ptrace_combine_input *inputs, int n,
+                         const char *output);
+
+/* the same for a single other host */
+extern int combine_file(const char *file1, const char *file2,
+                        const char *output,
+                        const struct ptrace_clock_sample *clock, int nclock);
+
+#endif /* __PTRACE_COMBINE_H__ */
@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <google/protobuf/io/tokenizer.h>
+#include <google/protobuf/text_format.h>
+
+#include "perfetto_trace.pb.h"
+#include "ptrace_config.h"
+
+/* report the syntax errors with the config file's name */
+class ConfigErrorCollector : public google::protobuf::io::ErrorCollector {
+public:
+    explicit ConfigErrorCollector(const char *path) : path_(path) {}
+
+    void AddError(int line, int column, const std::string &message) override
+    {
+        fprintf(stderr, "%s:%d:%d: %s\n",
+                path_, line + 1, column + 1, message.c_str());
+    }
+
+private:
+    const char *path_;
+};
+
+int ptrace_config_load(const char *path, std::string *cfg)
+{
+    int fd;
+    ssize_t n;
+    char buf[4096];
+    std::string text;
+    perfetto::protos::TraceConfig tc;
+    google::protobuf::TextFormat::Parser parser;
+    ConfigErrorCollector errors(path);
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "open %s failed, errno = %d\n", path, errno);
+        return -1;
+    }
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        text.append(buf, n);
+    close(fd);
+    if (n < 0) {
+        fprintf(stderr, "read %s failed, errno = %d\n", path, errno);
+        return -1;
+    }
+
+    parser.RecordErrorsTo(&errors);
+    if (!parser.ParseFromString(text, &tc)) {
+        fprintf(stderr, "invalid trace config %s\n", path);
+        return -1;
+    }
+
+    if (!tc.SerializeToString(cfg))
+        return -1;
+
+    return 0;
+}
+
+int ptrace_stats_bytes_written(const void *data, size_t len, uint64_t *bytes)
+{
+    int i;
+    perfetto::protos::TraceStats stats;
+
+    if (!stats.ParseFromArray(data, len))
+        return -1;
+
+    *bytes = 0;
+    for (i = 0; i < stats.buffer_stats_size(); i++)
+        *bytes += stats.buffer_stats(i).bytes_written();
+
+    return 0;
+}
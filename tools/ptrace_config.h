@@ -0,0 +1,21 @@
+#ifndef __PTRACE_CONFIG_H__
+#define __PTRACE_CONFIG_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+/*
+ * Load a perfetto trace config in text format, like `perfetto --txt -c`
+ * does, and serialize it: the SDK takes its config as a binary proto.
+ */
+extern int ptrace_config_load(const char *path, std::string *cfg);
+
+/*
+ * The bytes the producers have written into traced's buffers so far, from a
+ * serialized TraceStats as TracingSession::GetTraceStats() returns it.
+ */
+extern int ptrace_stats_bytes_written(const void *data, size_t len,
+                                      uint64_t *bytes);
+
+#endif /* __PTRACE_CONFIG_H__ */
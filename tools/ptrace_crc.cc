@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <errno.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#include "ptrace_crc.h"
+
+#define CRC32C_POLY     0x82f63b78  /* reflected 0x1edc6f41 */
+
+typedef uint32_t (*crc32c_func_t)(uint32_t crc, const uint8_t *p, size_t len);
+
+static uint32_t g_crc32c_table[8][256];
+static crc32c_func_t g_crc32c_func;
+static pthread_once_t g_crc32c_once = PTHREAD_ONCE_INIT;
+
+/* slicing-by-8 */
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    uint32_t lo, hi;
+
+    while (len && ((uintptr_t)p & 7)) {
+        crc = g_crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+
+    while (len >= 8) {
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = g_crc32c_table[7][lo & 0xff] ^
+              g_crc32c_table[6][(lo >> 8) & 0xff] ^
+              g_crc32c_table[5][(lo >> 16) & 0xff] ^
+              g_crc32c_table[4][lo >> 24] ^
+              g_crc32c_table[3][hi & 0xff] ^
+              g_crc32c_table[2][(hi >> 8) & 0xff] ^
+              g_crc32c_table[1][(hi >> 16) & 0xff] ^
+              g_crc32c_table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+
+    while (len--)
+        crc = g_crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    uint64_t v, crc64;
+
+    while (len && ((uintptr_t)p & 7)) {
+        crc = _mm_crc32_u8(crc, *p++);
+        len--;
+    }
+
+    crc64 = crc;
+    while (len >= 8) {
+        memcpy(&v, p, 8);
+        crc64 = _mm_crc32_u64(crc64, v);
+        p += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)crc64;
+
+    while (len--)
+        crc = _mm_crc32_u8(crc, *p++);
+
+    return crc;
+}
+
+static int crc32c_hw_supported(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+}
+#elif defined(__aarch64__)
+__attribute__((target("+crc")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    uint64_t v;
+
+    while (len && ((uintptr_t)p & 7)) {
+        crc = __crc32cb(crc, *p++);
+        len--;
+    }
+
+    while (len >= 8) {
+        memcpy(&v, p, 8);
+        crc = __crc32cd(crc, v);
+        p += 8;
+        len -= 8;
+    }
+
+    while (len--)
+        crc = __crc32cb(crc, *p++);
+
+    return crc;
+}
+
+static int crc32c_hw_supported(void)
+{
+    return !!(getauxval(AT_HWCAP) & HWCAP_CRC32);
+}
+#endif
+
+static void crc32c_init(void)
+{
+    int i, j, k;
+    uint32_t crc;
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (j = 0; j < 8; j++)
+            crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+        g_crc32c_table[0][i] = crc;
+    }
+
+    for (i = 0; i < 256; i++) {
+        crc = g_crc32c_table[0][i];
+        for (k = 1; k < 8; k++) {
+            crc = g_crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+            g_crc32c_table[k][i] = crc;
+        }
+    }
+
+    g_crc32c_func = crc32c_sw;
+#if defined(__x86_64__) || defined(__aarch64__)
+    if (crc32c_hw_supported())
+        g_crc32c_func = crc32c_hw;
+#endif
+}
+
+uint32_t ptrace_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    pthread_once(&g_crc32c_once, crc32c_init);
+
+    return ~g_crc32c_func(~crc, (const uint8_t *)buf, len);
+}
+
+#define CRC_FILE_BUFF_SIZE  (1024 * 1024)
+
+int ptrace_crc32c_file(int fd, uint64_t size, uint32_t *crc)
+{
+    ssize_t n;
+    uint64_t offset = 0;
+    char *buf;
+
+    buf = (char *)malloc(CRC_FILE_BUFF_SIZE);
+    if (!buf) {
+        fprintf(stderr, "alloc crc buffer failed\n");
+        return -1;
+    }
+
+    *crc = 0;
+    while (offset < size) {
+        n = pread(fd, buf, size - offset < CRC_FILE_BUFF_SIZE ?
+                  size - offset : CRC_FILE_BUFF_SIZE, offset);
+        if (n <= 0) {
+            if (n < 0 && EINTR == errno)
+                continue;
+            fprintf(stderr, "read file failed, errno = %d\n", errno);
+            break;
+        }
+
+        *crc = ptrace_crc32c(*crc, buf, n);
+        offset += n;
+    }
+
+    free(buf);
+
+    return offset == size ? 0 : -1;
+}
@@ -0,0 +1,17 @@
+#ifndef __PTRACE_CRC_H__
+#define __PTRACE_CRC_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * CRC32C (Castagnoli), chained like zlib's crc32(): start with 0 and pass the
+ * previous result to continue. SSE4.2/ARMv8 CRC instructions are used when
+ * the CPU has them.
+ */
+extern uint32_t ptrace_crc32c(uint32_t crc, const void *buf, size_t len);
+
+/* CRC32C of the first size bytes of a file */
+extern int ptrace_crc32c_file(int fd, uint64_t size, uint32_t *crc);
+
+#endif /* __PTRACE_CRC_H__ */
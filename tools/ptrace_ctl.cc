@@ -0,0 +1,418 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <errno.h>
+
+#include "ptrace_ctl.h"
+
+#define CTL_EVENTS          16
+
+struct ptrace_ctl_req {
+    struct ptrace_ctl *ctl;
+    struct ptrace_ctl_req *next;
+    int fd;
+    uint32_t len;
+    char line[PTRACE_CTL_LINE_MAX];
+};
+
+struct ptrace_ctl {
+    int epfd;
+    int lfd;
+    struct sockaddr_un addr;
+    ptrace_ctl_handler_t handler;
+    void *priv;
+    struct ptrace_ctl_req *reqs;    /* connected, being read or answered */
+};
+
+static int ctl_addr(struct sockaddr_un *addr, const char *path)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "control socket path too long: %s\n", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+
+    return 0;
+}
+
+/* bind, or take the place of a socket nobody listens on any more */
+static int ctl_bind(int fd, struct sockaddr_un *addr)
+{
+    int cfd, rc;
+
+    if (0 == bind(fd, (struct sockaddr *)addr, sizeof(*addr)))
+        return 0;
+    if (errno != EADDRINUSE)
+        goto _err;
+
+    cfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (cfd < 0)
+        goto _err;
+    rc = connect(cfd, (struct sockaddr *)addr, sizeof(*addr));
+    close(cfd);
+    if (0 == rc) {
+        fprintf(stderr, "control socket %s is in use by another ptrace\n",
+                addr->sun_path);
+        return -1;
+    }
+
+    unlink(addr->sun_path);
+    if (0 == bind(fd, (struct sockaddr *)addr, sizeof(*addr)))
+        return 0;
+
+_err:
+    fprintf(stderr, "bind %s failed, errno = %d\n", addr->sun_path, errno);
+    return -1;
+}
+
+struct ptrace_ctl *ptrace_ctl_create(const char *path,
+        ptrace_ctl_handler_t handler, void *priv)
+{
+    struct epoll_event ev;
+    struct ptrace_ctl *ctl;
+
+    ctl = (struct ptrace_ctl *)calloc(1, sizeof(*ctl));
+    if (!ctl)
+        return NULL;
+    ctl->epfd = -1;
+    ctl->lfd = -1;
+    ctl->handler = handler;
+    ctl->priv = priv;
+
+    if (ctl_addr(&ctl->addr, path) < 0)
+        goto _err;
+
+    ctl->lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (ctl->lfd < 0) {
+        fprintf(stderr, "create control socket failed, errno = %d\n", errno);
+        goto _err;
+    }
+
+    if (ctl_bind(ctl->lfd, &ctl->addr) < 0) {
+        close(ctl->lfd);
+        ctl->lfd = -1;
+        goto _err;
+    }
+
+    /* whoever can connect can stop the tracing */
+    chmod(path, 0600);
+
+    if (listen(ctl->lfd, 8) < 0) {
+        fprintf(stderr, "listen %s failed, errno = %d\n", path, errno);
+        goto _err;
+    }
+
+    ctl->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (ctl->epfd < 0)
+        goto _err;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(ctl->epfd, EPOLL_CTL_ADD, ctl->lfd, &ev) < 0)
+        goto _err;
+
+    return ctl;
+
+_err:
+    if (ctl->epfd >= 0)
+        close(ctl->epfd);
+    if (ctl->lfd >= 0) {
+        close(ctl->lfd);
+        unlink(path);
+    }
+    free(ctl);
+
+    return NULL;
+}
+
+static void ctl_req_free(struct ptrace_ctl_req *req)
+{
+    struct ptrace_ctl_req **pp;
+
+    for (pp = &req->ctl->reqs; *pp != req; pp = &(*pp)->next) {}
+    *pp = req->next;
+
+    close(req->fd);
+    free(req);
+}
+
+void ptrace_ctl_destroy(struct ptrace_ctl *ctl)
+{
+    if (!ctl)
+        return;
+
+    while (ctl->reqs)
+        ptrace_ctl_reply(ctl->reqs, 0, "exiting");
+
+    close(ctl->epfd);
+    close(ctl->lfd);
+    unlink(ctl->addr.sun_path);
+    free(ctl);
+}
+
+int ptrace_ctl_fd(struct ptrace_ctl *ctl)
+{
+    return ctl->epfd;
+}
+
+void ptrace_ctl_reply(struct ptrace_ctl_req *req, int ok, const char *fmt, ...)
+{
+    int n;
+    va_list ap;
+    char line[PTRACE_CTL_LINE_MAX];
+
+    n = snprintf(line, sizeof(line), ok ? "ok" : "error");
+    if (fmt && fmt[0]) {
+        line[n++] = ' ';
+        va_start(ap, fmt);
+        vsnprintf(line + n, sizeof(line) - n - 1, fmt, ap);
+        va_end(ap);
+        n = strlen(line);
+    }
+    line[n++] = '\n';
+
+    /* short enough for the socket buffer, a peer gone is not our problem */
+    send(req->fd, line, n, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+    ctl_req_free(req);
+}
+
+static void ctl_accept(struct ptrace_ctl *ctl)
+{
+    int fd;
+    struct epoll_event ev;
+    struct ptrace_ctl_req *req;
+
+    while ((fd = accept4(ctl->lfd, NULL, NULL,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        req = (struct ptrace_ctl_req *)calloc(1, sizeof(*req));
+        if (!req) {
+            close(fd);
+            continue;
+        }
+        req->ctl = ctl;
+        req->fd = fd;
+        req->next = ctl->reqs;
+        ctl->reqs = req;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = req;
+        if (epoll_ctl(ctl->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+            ctl_req_free(req);
+    }
+}
+
+/* split "<command> [<argument>]" and pass it on */
+static void ctl_dispatch(struct ptrace_ctl_req *req)
+{
+    char *cmd, *arg, *end;
+
+    epoll_ctl(req->ctl->epfd, EPOLL_CTL_DEL, req->fd, NULL);
+
+    req->line[req->len] = '\0';
+    for (cmd = req->line; ' ' == *cmd || '\t' == *cmd; cmd++) {}
+    for (arg = cmd; *arg && ' ' != *arg && '\t' != *arg; arg++) {}
+    if (*arg)
+        *arg++ = '\0';
+    for (; ' ' == *arg || '\t' == *arg; arg++) {}
+    for (end = arg + strlen(arg);
+         end > arg && (' ' == end[-1] || '\t' == end[-1] || '\r' == end[-1]);
+         end--) {}
+    *end = '\0';
+
+    if ('\0' == cmd[0]) {
+        ptrace_ctl_reply(req, 0, "no command");
+        return;
+    }
+
+    req->ctl->handler(req->ctl, req, cmd, arg, req->ctl->priv);
+}
+
+static void ctl_read(struct ptrace_ctl_req *req)
+{
+    ssize_t n;
+    char *nl;
+
+    n = recv(req->fd, req->line + req->len,
+             sizeof(req->line) - 1 - req->len, 0);
+    if (n < 0) {
+        if (EAGAIN != errno && EINTR != errno)
+            ctl_req_free(req);
+        return;
+    }
+
+    req->len += n;
+    nl = (char *)memchr(req->line, '\n', req->len);
+    if (nl) {
+        req->len = nl - req->line;
+    } else if (0 == n) {
+        /* the peer shut its side down without a newline */
+        if (0 == req->len) {
+            ctl_req_free(req);
+            return;
+        }
+    } else if (req->len == sizeof(req->line) - 1) {
+        ptrace_ctl_reply(req, 0, "command too long");
+        return;
+    } else {
+        return;
+    }
+
+    ctl_dispatch(req);
+}
+
+int ptrace_ctl_run(struct ptrace_ctl *ctl, uint32_t timeout_ms)
+{
+    int i, n;
+    struct epoll_event evs[CTL_EVENTS];
+
+    n = epoll_wait(ctl->epfd, evs, CTL_EVENTS, timeout_ms);
+    if (n < 0)
+        return EINTR == errno ? 0 : -1;
+
+    for (i = 0; i < n; i++) {
+        if (!evs[i].data.ptr)
+            ctl_accept(ctl);
+        else
+            ctl_read((struct ptrace_ctl_req *)evs[i].data.ptr);
+    }
+
+    return 0;
+}
+
+
+static const char *g_program_name;
+
+static void usage(void)
+{
+    printf("\
+Usage: %s ctl [-U <socket>] [-t <seconds>] <command> [<argument>]\n\
+  -U <socket>       the control socket of the ptrace to command\n\
+                    (default: " PTRACE_CTL_PATH ")\n\
+  -t <seconds>      give up waiting for the answer after it (default: wait)\n\
+\n\
+Commands:\n\
+  start             start tracing, answered once it has started\n\
+  stop              stop tracing, answered once the trace is complete\n\
+  status            the state, trace file, size and duration\n\
+  mark <name>       put an instant event <name> into the trace\n\
+  rotate            continue the trace in a new file ('alone' mode only)\n",
+        g_program_name);
+}
+
+int ptrace_ctl_main(int argc, char *argv[])
+{
+    int i, opt, fd = -1, rc = -1, timeout_ms = -1;
+    size_t len = 0;
+    ssize_t n;
+    const char *path = PTRACE_CTL_PATH;
+    char line[PTRACE_CTL_LINE_MAX], rsp[PTRACE_CTL_LINE_MAX];
+    struct sockaddr_un addr;
+    struct pollfd pfd;
+
+    g_program_name = "ptrace";
+
+    while ((opt = getopt(argc, argv, "hU:t:")) != -1) {
+        switch (opt) {
+            case 'U':
+                path = optarg;
+                break;
+
+            case 't':
+                timeout_ms = atoi(optarg) * 1000;
+                if (timeout_ms <= 0) {
+                    fprintf(stderr, "invalid timeout: %s\n", optarg);
+                    return -1;
+                }
+                break;
+
+            case 'h':
+            default:
+                usage();
+                return -1;
+        }
+    }
+
+    if (optind >= argc) {
+        usage();
+        return -1;
+    }
+
+    /* the words of the command, joined again */
+    line[0] = '\0';
+    for (i = optind; i < argc; i++) {
+        len += snprintf(line + len, len < sizeof(line) ? sizeof(line) - len : 0,
+                        "%s%s", i > optind ? " " : "", argv[i]);
+    }
+    if (len + 1 >= sizeof(line)) {
+        fprintf(stderr, "command too long\n");
+        return -1;
+    }
+    line[len++] = '\n';
+
+    if (ctl_addr(&addr, path) < 0)
+        return -1;
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "connect %s failed, errno = %d, is ptrace running "
+                "with '-U %s'?\n", path, errno, path);
+        goto _out;
+    }
+
+    if (send(fd, line, len, MSG_NOSIGNAL) != (ssize_t)len) {
+        fprintf(stderr, "send command failed, errno = %d\n", errno);
+        goto _out;
+    }
+
+    len = 0;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (len < sizeof(rsp) - 1) {
+        n = poll(&pfd, 1, timeout_ms);
+        if (n < 0 && EINTR == errno)
+            continue;
+        if (0 == n) {
+            fprintf(stderr, "no answer in %d seconds\n", timeout_ms / 1000);
+            goto _out;
+        }
+
+        n = n > 0 ? recv(fd, rsp + len, sizeof(rsp) - 1 - len, 0) : -1;
+        if (n < 0) {
+            fprintf(stderr, "receive answer failed, errno = %d\n", errno);
+            goto _out;
+        }
+        if (0 == n)
+            break;
+        len += n;
+    }
+    rsp[len] = '\0';
+
+    if (0 == len) {
+        fprintf(stderr, "no answer, ptrace exited?\n");
+        goto _out;
+    }
+
+    printf("%s%s", rsp, '\n' == rsp[len - 1] ? "" : "\n");
+    rc = 0 == strncmp(rsp, "ok", 2) ? 0 : -1;
+
+_out:
+    close(fd);
+
+    return rc;
+}
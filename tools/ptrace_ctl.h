@@ -0,0 +1,50 @@
+#ifndef __PTRACE_CTL_H__
+#define __PTRACE_CTL_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * The control socket of a running ptrace, a Unix stream socket taking one
+ * command per connection: a line "<command> [<argument>]\n", answered by a
+ * line "ok [<text>]\n" or "error <text>\n" before the connection is closed.
+ * A command can be answered later, e.g. once tracing has started.
+ */
+#define PTRACE_CTL_PATH     "/tmp/ptrace.sock"
+#define PTRACE_CTL_LINE_MAX 512
+
+struct ptrace_ctl;
+struct ptrace_ctl_req;      /* a command waiting for its answer */
+
+/* cmd and arg ("" if none) are only valid during the call */
+typedef void (*ptrace_ctl_handler_t)(struct ptrace_ctl *ctl,
+        struct ptrace_ctl_req *req, const char *cmd, const char *arg,
+        void *priv);
+
+/* a stale socket left at path is replaced, a live one is an error */
+extern struct ptrace_ctl *ptrace_ctl_create(const char *path,
+        ptrace_ctl_handler_t handler, void *priv);
+/* the commands not answered yet get "error exiting" */
+extern void ptrace_ctl_destroy(struct ptrace_ctl *ctl);
+
+/*
+ * An epoll fd, readable while ptrace_ctl_run() has something to do, to watch
+ * in another loop (ptrace_msg_ctx_add_fd()).
+ */
+extern int ptrace_ctl_fd(struct ptrace_ctl *ctl);
+
+/*
+ * Wait at most timeout_ms, accept the connections and pass the commands to
+ * the handler, returns -1 on error.
+ */
+extern int ptrace_ctl_run(struct ptrace_ctl *ctl, uint32_t timeout_ms);
+
+/* answer and free req */
+extern void ptrace_ctl_reply(struct ptrace_ctl_req *req, int ok,
+                             const char *fmt, ...)
+        __attribute__((format(printf, 3, 4)));
+
+/* "ptrace ctl ...", sends a command and prints the answer */
+extern int ptrace_ctl_main(int argc, char *argv[]);
+
+#endif /* __PTRACE_CTL_H__ */
@@ -1,18 +1,223 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <errno.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+
+#include <atomic>
+#include <map>
+#include <new>
+#include <vector>
 
 #include "ptrace_msg.h"
 
-static uint32_t g_session_id;
-static int g_sockfd = -1;
-static char g_recv_buff[8192];
+#define PTRACE_MSG_SOCK_BUFF_SIZE   (8 * 1024 * 1024)
+#define PTRACE_MSG_EPOLL_EVENTS     16
+#define PTRACE_MSG_RTO_INIT_MS      200
+#define PTRACE_MSG_RTO_MAX_MS       2000
+#define PTRACE_MSG_RSP_CACHE        64  /* responses kept per peer */
+#define PTRACE_MSG_SID_WINDOW       (1u << 16) /* sids of the same session */
+#define PTRACE_MSG_CTRL_SIZE        128 /* control messages of a datagram */
+
+/*
+ * Messages are allocated from free lists of fixed-size slabs, one for
+ * messages fitting an Ethernet MTU and one for the largest datagram. Bigger
+ * ones come from malloc().
+ */
+#define PTRACE_MSG_SLAB_SMALL       1472
+#define PTRACE_MSG_SLAB_LARGE       PTRACE_MSG_BUFF_SIZE
+#define PTRACE_MSG_SLAB_FREE_MAX    512 /* free slabs kept per size */
+#define PTRACE_MSG_SLAB_NONE        (-1)
+
+struct ptrace_msg_slab {
+    struct ptrace_msg_slab *next;   /* in the free list */
+    int cls;                        /* index in g_msg_pool, or SLAB_NONE */
+    int pad;
+    /* the message follows */
+};
+
+struct ptrace_msg_pool {
+    uint32_t size;                  /* max ptrace_msg_size() */
+    pthread_mutex_t lock;
+    struct ptrace_msg_slab *free_list;
+    uint32_t free_cnt;
+};
+
+static struct ptrace_msg_pool g_msg_pool[] = {
+    { PTRACE_MSG_SLAB_SMALL, PTHREAD_MUTEX_INITIALIZER, NULL, 0 },
+    { PTRACE_MSG_SLAB_LARGE, PTHREAD_MUTEX_INITIALIZER, NULL, 0 },
+};
+
+#define PTRACE_MSG_POOL_CNT (int)(sizeof(g_msg_pool) / sizeof(g_msg_pool[0]))
+
+struct ptrace_msg_fd {
+    int fd;
+    ptrace_msg_fd_cb_t cb;          /* NULL once deleted */
+    void *arg;
+};
+
+/* internal PTRACE_MSG_REQ_XXX, the callback takes the response */
+#define PTRACE_MSG_REQ_OWN_RSP  0x80000000
+/* ask the kernel for the transmit timestamp */
+#define PTRACE_MSG_REQ_TX_TIME  0x40000000
+
+/* a request waiting for its response */
+struct ptrace_msg_pending {
+    struct ptrace_msg *req;
+    uint32_t flags;                 /* PTRACE_MSG_REQ_XXX */
+    uint64_t deadline_ms;
+    uint64_t resend_ms;             /* next retransmission */
+    uint32_t rto_ms;
+    ptrace_msg_rsp_cb_t cb;
+    void *arg;
+};
+
+struct ptrace_msg_peer {
+    struct ptrace_msg_conn conn;
+    /*
+     * The responses sent to the latest requests by sid, NULL while the
+     * request is being handled. The oldest are dropped first, sids of a
+     * session only grow. A context starts at a random sid, a request far
+     * from the cached ones comes from a new session of the same address.
+     */
+    std::map<uint32_t, struct ptrace_msg *> rsps;
+};
+
+struct ptrace_msg_ctx {
+    int sockfd;
+    int epfd;
+    std::atomic<uint32_t> session_id;
+    const struct ptrace_msg_sock_ops *ops;
+    void *ops_priv;
+
+    /*
+     * Datagrams are received in batches by recvmmsg() into pooled messages,
+     * recv_msgs[recv_next, recv_cnt) are the valid ones not handed out yet,
+     * received into recv_buff[recv_slot[]]. A message handed out for good
+     * is replaced by a new one instead of being copied.
+     */
+    struct ptrace_msg *recv_buff[PTRACE_MSG_BATCH];
+    struct sockaddr_in recv_addr[PTRACE_MSG_BATCH];
+    struct iovec recv_iov[PTRACE_MSG_BATCH];
+    struct mmsghdr recv_mmsg[PTRACE_MSG_BATCH];
+    char recv_ctrl[PTRACE_MSG_BATCH][PTRACE_MSG_CTRL_SIZE];
+    struct ptrace_msg *recv_msgs[PTRACE_MSG_BATCH];
+    int recv_slot[PTRACE_MSG_BATCH];
+    int recv_cnt;
+    int recv_next;
+
+    /*
+     * The kernel's transmit timestamp of the latest request sent with
+     * PTRACE_MSG_REQ_TX_TIME, read from the error queue, 0 if none yet.
+     */
+    uint64_t tx_time;
+
+    ptrace_msg_handler_t on_msg;
+    ptrace_msg_conn_free_t on_conn_free;
+    void *arg;
+
+    std::map<int, struct ptrace_msg_fd *> fds;
+    std::vector<struct ptrace_msg_fd *> dead_fds; /* freed after dispatch */
+    std::map<uint64_t, struct ptrace_msg_peer *> conns;
+    std::map<uint32_t, struct ptrace_msg_pending *> pending;   /* by sid */
+};
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* the first sid of a context, random in [0, 2^31) so it never wraps */
+static uint32_t session_seed(void)
+{
+    struct timespec ts;
+    uint64_t x;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    x = ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec) ^ ((uint64_t)getpid() << 32);
+
+    /* splitmix64 finalizer */
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+
+    return (uint32_t)x & 0x7fffffff;
+}
+
+static uint64_t boot_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Socket timestamps are CLOCK_REALTIME, the protocol uses the boot time.
+ * The difference only changes as the real time is adjusted, reading it again
+ * for each batch is precise enough.
+ */
+static int64_t real_to_boot(void)
+{
+    struct timespec real, boot;
+
+    clock_gettime(CLOCK_REALTIME, &real);
+    clock_gettime(CLOCK_BOOTTIME, &boot);
+
+    return ((int64_t)boot.tv_sec - real.tv_sec) * 1000000000
+           + (boot.tv_nsec - real.tv_nsec);
+}
+
+/* the software timestamp among the control messages, 0 if none */
+static uint64_t cmsg_time(struct msghdr *mh)
+{
+    struct cmsghdr *cm;
+    struct scm_timestamping tss;
+
+    for (cm = CMSG_FIRSTHDR(mh); cm; cm = CMSG_NXTHDR(mh, cm)) {
+        if (SOL_SOCKET != cm->cmsg_level || SCM_TIMESTAMPING != cm->cmsg_type
+            || cm->cmsg_len < CMSG_LEN(sizeof(tss)))
+            continue;
+
+        memcpy(&tss, CMSG_DATA(cm), sizeof(tss));
+        if (tss.ts[0].tv_sec || tss.ts[0].tv_nsec)
+            return (uint64_t)tss.ts[0].tv_sec * 1000000000 + tss.ts[0].tv_nsec;
+    }
+
+    return 0;
+}
+
+static int sys_sendmmsg(void *priv, int sockfd, struct mmsghdr *msgs,
+                        unsigned int vlen, int flags)
+{
+    return sendmmsg(sockfd, msgs, vlen, flags);
+}
+
+static int sys_recvmmsg(void *priv, int sockfd, struct mmsghdr *msgs,
+                        unsigned int vlen, int flags)
+{
+    return recvmmsg(sockfd, msgs, vlen, flags, NULL);
+}
+
+static const struct ptrace_msg_sock_ops g_sys_sock_ops = {
+    sys_sendmmsg,
+    sys_recvmmsg,
+};
 
 uint32_t ptrace_msg_size(const struct ptrace_msg *msg)
 {
@@ -21,14 +226,42 @@ uint32_t ptrace_msg_size(const struct ptrace_msg *msg)
 
 struct ptrace_msg *ptrace_msg_alloc(uint32_t data_len)
 {
+    int cls;
+    uint32_t size = sizeof(struct ptrace_msg) + data_len;
+    struct ptrace_msg_pool *pool = NULL;
+    struct ptrace_msg_slab *slab = NULL;
     struct ptrace_msg *msg;
 
-    msg = (struct ptrace_msg *)malloc(sizeof(struct ptrace_msg) + data_len);
-    if (!msg) {
+    for (cls = 0; cls < PTRACE_MSG_POOL_CNT; cls++) {
+        if (size <= g_msg_pool[cls].size) {
+            pool = &g_msg_pool[cls];
+            break;
+        }
+    }
+
+    if (pool) {
+        pthread_mutex_lock(&pool->lock);
+        slab = pool->free_list;
+        if (slab) {
+            pool->free_list = slab->next;
+            pool->free_cnt--;
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        if (!slab)
+            slab = (struct ptrace_msg_slab *)malloc(sizeof(*slab) + pool->size);
+    } else {
+        cls = PTRACE_MSG_SLAB_NONE;
+        slab = (struct ptrace_msg_slab *)malloc(sizeof(*slab) + size);
+    }
+
+    if (!slab) {
         fprintf(stderr, "alloc msg failed, data_len = %d\n", data_len);
         return NULL;
     }
 
+    slab->cls = cls;
+    msg = (struct ptrace_msg *)(slab + 1);
     msg->data_len = data_len;
 
     return msg;
@@ -46,23 +279,90 @@ struct ptrace_msg *ptrace_msg_dup(const struct ptrace_msg *msg)
 
 void ptrace_msg_free(struct ptrace_msg *msg)
 {
-    if (msg) {
-        free(msg);
+    struct ptrace_msg_pool *pool;
+    struct ptrace_msg_slab *slab;
+
+    if (!msg)
+        return;
+
+    slab = (struct ptrace_msg_slab *)msg - 1;
+    if (PTRACE_MSG_SLAB_NONE == slab->cls) {
+        free(slab);
+        return;
     }
+
+    pool = &g_msg_pool[slab->cls];
+    pthread_mutex_lock(&pool->lock);
+    if (pool->free_cnt < PTRACE_MSG_SLAB_FREE_MAX) {
+        slab->next = pool->free_list;
+        pool->free_list = slab;
+        pool->free_cnt++;
+        slab = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    free(slab);
 }
 
-int ptrace_msg_send(struct ptrace_msg *msg)
+/* hand out the message received into a slot for good, it is not copied */
+static struct ptrace_msg *recv_take(struct ptrace_msg_ctx *ctx, int slot)
 {
-    ssize_t sz;
+    struct ptrace_msg *msg = ctx->recv_buff[slot], *buf;
+
+    buf = ptrace_msg_alloc(PTRACE_MSG_BUFF_SIZE - sizeof(struct ptrace_msg));
+    if (!buf)
+        return ptrace_msg_dup(msg);
+
+    ctx->recv_buff[slot] = buf;
+    ctx->recv_iov[slot].iov_base = buf;
+
+    return msg;
+}
+
+/* with tx_time, the kernel queues the transmit timestamp on the error queue */
+static int msg_send(struct ptrace_msg_ctx *ctx, struct ptrace_msg *msg,
+                    int tx_time)
+{
+    int n;
+    uint32_t tsflags = SOF_TIMESTAMPING_TX_SOFTWARE;
+    char ctrl[CMSG_SPACE(sizeof(tsflags))];
+    struct cmsghdr *cm;
+    struct iovec iov;
+    struct mmsghdr mmsg;
 
 #if 0
     fprintf(stderr, "Msg[%d] > %s:%d\n", msg->id,
             inet_ntoa(msg->dest.sin_addr), ntohs(msg->dest.sin_port));
 #endif
 
-    sz = sendto(g_sockfd, msg, ptrace_msg_size(msg), 0,
-               (struct sockaddr *)&msg->dest, sizeof(msg->dest));
-    if (sz != ptrace_msg_size(msg)) {
+    iov.iov_base = msg;
+    iov.iov_len = ptrace_msg_size(msg);
+    memset(&mmsg, 0, sizeof(mmsg));
+    mmsg.msg_hdr.msg_name = &msg->dest;
+    mmsg.msg_hdr.msg_namelen = sizeof(msg->dest);
+    mmsg.msg_hdr.msg_iov = &iov;
+    mmsg.msg_hdr.msg_iovlen = 1;
+
+    if (tx_time) {
+        memset(ctrl, 0, sizeof(ctrl));
+        mmsg.msg_hdr.msg_control = ctrl;
+        mmsg.msg_hdr.msg_controllen = sizeof(ctrl);
+        cm = CMSG_FIRSTHDR(&mmsg.msg_hdr);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SO_TIMESTAMPING;
+        cm->cmsg_len = CMSG_LEN(sizeof(tsflags));
+        memcpy(CMSG_DATA(cm), &tsflags, sizeof(tsflags));
+    }
+
+    n = ctx->ops->sendmmsg(ctx->ops_priv, ctx->sockfd, &mmsg, 1, 0);
+    if (n < 0 && tx_time && EINVAL == errno) {
+        /* a kernel without per-datagram timestamping */
+        mmsg.msg_hdr.msg_control = NULL;
+        mmsg.msg_hdr.msg_controllen = 0;
+        n = ctx->ops->sendmmsg(ctx->ops_priv, ctx->sockfd, &mmsg, 1, 0);
+    }
+
+    if (n != 1 || mmsg.msg_len != iov.iov_len) {
         fprintf(stderr, "send msg failed, errno = %d\n", errno);
         return -1;
     }
@@ -70,43 +370,209 @@ int ptrace_msg_send(struct ptrace_msg *msg)
     return 0;
 }
 
-struct ptrace_msg *ptrace_msg_recv(uint32_t timeout_ms)
+int ptrace_msg_send(struct ptrace_msg_ctx *ctx, struct ptrace_msg *msg)
+{
+    return msg_send(ctx, msg, 0);
+}
+
+/* read the transmit timestamps queued on the socket, keep the latest */
+static void errq_drain(struct ptrace_msg_ctx *ctx)
 {
-    int rc;
-    socklen_t addrlen;
-    fd_set rfds;
-    struct timeval tv;
-    struct ptrace_msg *msg = (struct ptrace_msg *)g_recv_buff;
+    uint64_t t;
+    char ctrl[PTRACE_MSG_CTRL_SIZE];
+    struct msghdr mh;
 
-    FD_ZERO(&rfds);
-    FD_SET(g_sockfd, &rfds);
+    for (;;) {
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_control = ctrl;
+        mh.msg_controllen = sizeof(ctrl);
+        if (recvmsg(ctx->sockfd, &mh, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            break;
 
-    tv.tv_sec = timeout_ms / 1000;
-    tv.tv_usec = (timeout_ms % 1000) * 1000;
-    rc = select(g_sockfd + 1, &rfds, NULL, NULL, &tv);
-    if (rc <= 0) {
-        if (rc < 0)
-            fprintf(stderr, "select faield, rc = %d, errno = %d\n", rc, errno);
-        return NULL;
+        t = cmsg_time(&mh);
+        if (t)
+            ctx->tx_time = t + real_to_boot();
     }
+}
 
-    addrlen = sizeof(msg->src);
-    rc = recvfrom(g_sockfd, g_recv_buff, sizeof(g_recv_buff), 0,
-                 (struct sockaddr *)&msg->src, &addrlen);
-    if (rc <= 0 || (uint32_t)rc < ptrace_msg_size(msg)) {
-        fprintf(stderr, "recv msg faield, rc = %d, errno = %d\n", rc, errno);
-        return NULL;
+int ptrace_msg_send_batch(struct ptrace_msg_ctx *ctx,
+        struct ptrace_msg **msgs, int cnt)
+{
+    int i, n, sent = 0;
+    struct iovec iov[PTRACE_MSG_BATCH];
+    struct mmsghdr mmsg[PTRACE_MSG_BATCH];
+
+    while (sent < cnt) {
+        n = cnt - sent < PTRACE_MSG_BATCH ? cnt - sent : PTRACE_MSG_BATCH;
+
+        memset(mmsg, 0, sizeof(mmsg[0]) * n);
+        for (i = 0; i < n; i++) {
+            iov[i].iov_base = msgs[sent + i];
+            iov[i].iov_len = ptrace_msg_size(msgs[sent + i]);
+            mmsg[i].msg_hdr.msg_name = &msgs[sent + i]->dest;
+            mmsg[i].msg_hdr.msg_namelen = sizeof(msgs[sent + i]->dest);
+            mmsg[i].msg_hdr.msg_iov = &iov[i];
+            mmsg[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        n = ctx->ops->sendmmsg(ctx->ops_priv, ctx->sockfd, mmsg, n, 0);
+        if (n <= 0) {
+            if (n < 0 && EINTR == errno)
+                continue;
+            fprintf(stderr, "send msgs failed, errno = %d\n", errno);
+            return -1;
+        }
+
+        sent += n;
     }
 
+    return 0;
+}
+
+/* pass a response to the request waiting for it, a late duplicate is dropped */
+static void pending_done(struct ptrace_msg_ctx *ctx, int slot)
+{
+    struct ptrace_msg *rsp = ctx->recv_buff[slot];
+    struct ptrace_msg_pending *p;
+    std::map<uint32_t, struct ptrace_msg_pending *>::iterator it;
+
+    it = ctx->pending.find(rsp->sid);
+    if (it == ctx->pending.end())
+        return;
+
+    p = it->second;
+    if (p->req->id != rsp->id
+        || p->req->dest.sin_addr.s_addr != rsp->src.sin_addr.s_addr
+        || p->req->dest.sin_port != rsp->src.sin_port)
+        return;
+
+    ctx->pending.erase(it);
+    if (p->flags & PTRACE_MSG_REQ_OWN_RSP)
+        rsp = recv_take(ctx, slot);
+    p->cb(ctx, p->req, rsp, p->arg);
+    ptrace_msg_free(p->req);
+    free(p);
+}
+
+/*
+ * Refill the receive buffers, wait at most timeout_ms if nothing is queued.
+ * Returns the number of messages received, 0 on timeout.
+ */
+static int recv_fill(struct ptrace_msg_ctx *ctx, uint32_t timeout_ms)
+{
+    int i, n, cnt;
+    int wait_ms = timeout_ms;
+    uint64_t deadline = now_ms() + timeout_ms;
+    uint64_t now, t;
+    int64_t real2boot;
+    struct pollfd pfd;
+    struct ptrace_msg *msg;
+
+    ctx->recv_cnt = ctx->recv_next = 0;
+
+    do {
+        for (i = 0; i < PTRACE_MSG_BATCH; i++) {
+            ctx->recv_mmsg[i].msg_hdr.msg_namelen = sizeof(ctx->recv_addr[i]);
+            ctx->recv_mmsg[i].msg_hdr.msg_controllen = PTRACE_MSG_CTRL_SIZE;
+        }
+
+        n = ctx->ops->recvmmsg(ctx->ops_priv, ctx->sockfd, ctx->recv_mmsg,
+                               PTRACE_MSG_BATCH, MSG_DONTWAIT);
+        if (n < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+            if (wait_ms <= 0)
+                return 0;
+
+            pfd.fd = ctx->sockfd;
+            pfd.events = POLLIN;
+            n = poll(&pfd, 1, wait_ms);
+            if (n <= 0) {
+                if (n < 0)
+                    fprintf(stderr, "poll faield, rc = %d, errno = %d\n",
+                            n, errno);
+                return n;
+            }
+
+            n = ctx->ops->recvmmsg(ctx->ops_priv, ctx->sockfd,
+                                   ctx->recv_mmsg, PTRACE_MSG_BATCH,
+                                   MSG_DONTWAIT);
+        }
+
+        if (n <= 0) {
+            fprintf(stderr, "recv msg faield, rc = %d, errno = %d\n",
+                    n, errno);
+            return -1;
+        }
+
+        /* the datagrams the kernel did not stamp were received by now */
+        now = boot_ns();
+        real2boot = real_to_boot();
+
+        /* drop the malformed datagrams, hand the responses to the requests */
+        for (i = 0, cnt = 0; i < n; i++) {
+            msg = ctx->recv_buff[i];
+            if (ctx->recv_mmsg[i].msg_len < sizeof(*msg)
+                || ctx->recv_mmsg[i].msg_len < ptrace_msg_size(msg)) {
+                fprintf(stderr, "recv msg faield, len = %u\n",
+                        ctx->recv_mmsg[i].msg_len);
+                continue;
+            }
+
+            memcpy(&msg->src, &ctx->recv_addr[i], sizeof(msg->src));
+            t = cmsg_time(&ctx->recv_mmsg[i].msg_hdr);
+            msg->rx_time = t ? t + real2boot : now;
+
 #if 0
-    fprintf(stderr, "Msg[%d] < %s:%d\n", msg->id,
-            inet_ntoa(msg->dest.sin_addr), ntohs(msg->dest.sin_port));
+            fprintf(stderr, "Msg[%d] < %s:%d\n", msg->id,
+                    inet_ntoa(msg->dest.sin_addr), ntohs(msg->dest.sin_port));
 #endif
 
-    return ptrace_msg_dup(msg);
+            if (PTRACE_MSG_TYPE_RSP == msg->type) {
+                pending_done(ctx, i);
+                continue;
+            }
+
+            ctx->recv_slot[cnt] = i;
+            ctx->recv_msgs[cnt++] = msg;
+        }
+
+        wait_ms = (int64_t)(deadline - now_ms()) > 0 ? deadline - now_ms() : 0;
+    } while (0 == cnt && timeout_ms > 0 && wait_ms > 0);
+
+    ctx->recv_cnt = cnt;
+
+    return cnt;
+}
+
+static void pending_timer(struct ptrace_msg_ctx *ctx);
+
+struct ptrace_msg *ptrace_msg_recv(struct ptrace_msg_ctx *ctx,
+        uint32_t timeout_ms)
+{
+    pending_timer(ctx);
+
+    if (ctx->recv_next >= ctx->recv_cnt && recv_fill(ctx, timeout_ms) <= 0)
+        return NULL;
+
+    return recv_take(ctx, ctx->recv_slot[ctx->recv_next++]);
 }
 
-int ptrace_msg_notify(struct sockaddr_in *dest,
+int ptrace_msg_recv_batch(struct ptrace_msg_ctx *ctx,
+        struct ptrace_msg **msgs, int max, uint32_t timeout_ms)
+{
+    int n = 0;
+
+    pending_timer(ctx);
+
+    if (ctx->recv_next >= ctx->recv_cnt && recv_fill(ctx, timeout_ms) <= 0)
+        return 0;
+
+    while (n < max && ctx->recv_next < ctx->recv_cnt)
+        msgs[n++] = ctx->recv_msgs[ctx->recv_next++];
+
+    return n;
+}
+
+int ptrace_msg_notify(struct ptrace_msg_ctx *ctx, struct sockaddr_in *dest,
         uint8_t msg_id, void *data, int data_len)
 {
     int rc = -1;
@@ -120,7 +586,7 @@ int ptrace_msg_notify(struct sockaddr_in *dest,
         if (data)
             memcpy(msg->data, data, data_len);
 
-        rc = ptrace_msg_send(msg);
+        rc = ptrace_msg_send(ctx, msg);
 
         ptrace_msg_free(msg);
     }
@@ -128,71 +594,238 @@ int ptrace_msg_notify(struct sockaddr_in *dest,
     return rc;
 }
 
-int ptrace_msg_request(struct sockaddr_in *dest,
-        int msg_id, void *data, int data_len,
-        struct ptrace_msg **rsp_msg, uint32_t timeout_ms)
+/* take the ownership of req and send it */
+static struct ptrace_msg_pending *pending_add(struct ptrace_msg_ctx *ctx,
+        struct ptrace_msg *req, uint32_t flags, uint32_t timeout_ms,
+        ptrace_msg_rsp_cb_t cb, void *arg)
 {
-    int rc = -1;
-    struct ptrace_msg *req, *rsp;
+    uint64_t now = now_ms();
+    struct ptrace_msg_pending *p;
+
+    p = (struct ptrace_msg_pending *)malloc(sizeof(*p));
+    if (!p) {
+        fprintf(stderr, "alloc pending request failed\n");
+        ptrace_msg_free(req);
+        return NULL;
+    }
+
+    req->type = PTRACE_MSG_TYPE_REQ;
+    req->sid = ctx->session_id++;
+
+    p->req = req;
+    p->flags = flags;
+    p->rto_ms = PTRACE_MSG_RTO_INIT_MS;
+    p->deadline_ms = now + timeout_ms;
+    p->resend_ms = (flags & PTRACE_MSG_REQ_ONCE) ?
+                   p->deadline_ms : now + p->rto_ms;
+    p->cb = cb;
+    p->arg = arg;
+    ctx->pending[req->sid] = p;
+
+    /* a lost request is retransmitted like a lost datagram */
+    if (flags & PTRACE_MSG_REQ_TX_TIME) {
+        ctx->tx_time = 0;
+        msg_send(ctx, req, 1);
+    } else {
+        ptrace_msg_send(ctx, req);
+    }
+
+    return p;
+}
+
+static void pending_del(struct ptrace_msg_ctx *ctx,
+                        struct ptrace_msg_pending *p)
+{
+    ctx->pending.erase(p->req->sid);
+    ptrace_msg_free(p->req);
+    free(p);
+}
+
+/* retransmit the requests due, fail the ones timed out */
+static void pending_timer(struct ptrace_msg_ctx *ctx)
+{
+    size_t i;
+    uint64_t now = now_ms();
+    struct ptrace_msg_pending *p;
+    std::vector<struct ptrace_msg_pending *> expired;
+    std::map<uint32_t, struct ptrace_msg_pending *>::iterator it;
+
+    for (it = ctx->pending.begin(); it != ctx->pending.end(); ++it) {
+        p = it->second;
+        if (now >= p->deadline_ms) {
+            expired.push_back(p);
+        } else if (now >= p->resend_ms) {
+            ptrace_msg_send(ctx, p->req);
+            p->rto_ms = p->rto_ms * 2 < PTRACE_MSG_RTO_MAX_MS ?
+                        p->rto_ms * 2 : PTRACE_MSG_RTO_MAX_MS;
+            p->resend_ms = now + p->rto_ms;
+        }
+    }
+
+    /* the callbacks may make new requests */
+    for (i = 0; i < expired.size(); i++) {
+        p = expired[i];
+        ctx->pending.erase(p->req->sid);
+        p->cb(ctx, p->req, NULL, p->arg);
+        ptrace_msg_free(p->req);
+        free(p);
+    }
+}
+
+/* how long to wait for the next request timer, at most timeout_ms */
+static uint32_t pending_wait(struct ptrace_msg_ctx *ctx, uint32_t timeout_ms)
+{
+    uint64_t now = now_ms(), due;
+    std::map<uint32_t, struct ptrace_msg_pending *>::iterator it;
+
+    for (it = ctx->pending.begin(); it != ctx->pending.end(); ++it) {
+        due = it->second->resend_ms < it->second->deadline_ms ?
+              it->second->resend_ms : it->second->deadline_ms;
+        if (due <= now)
+            return 0;
+        if (due - now < timeout_ms)
+            timeout_ms = due - now;
+    }
+
+    return timeout_ms;
+}
+
+int ptrace_msg_request_async(struct ptrace_msg_ctx *ctx,
+        struct sockaddr_in *dest, int msg_id, void *data, int data_len,
+        uint32_t flags, uint32_t timeout_ms, ptrace_msg_rsp_cb_t cb,
+        void *arg)
+{
+    struct ptrace_msg *req;
 
     req = ptrace_msg_alloc(data_len);
     if (!req)
         return -1;
 
     req->id = msg_id;
-    req->type = PTRACE_MSG_TYPE_REQ;
-    req->sid = g_session_id++;
     memcpy(&req->dest, dest, sizeof(req->dest));
     if (data)
         memcpy(req->data, data, data_len);
 
-    ptrace_msg_send(req);
+    return pending_add(ctx, req, flags, timeout_ms, cb, arg) ? 0 : -1;
+}
+
+struct request_sync {
+    int done;
+    struct ptrace_msg *rsp;
+};
+
+static void request_sync_cb(struct ptrace_msg_ctx *ctx,
+        struct ptrace_msg *req, struct ptrace_msg *rsp, void *arg)
+{
+    struct request_sync *rs = (struct request_sync *)arg;
+
+    rs->done = 1;
+    rs->rsp = rsp;  /* taken from the receive buffers */
+}
+
+/*
+ * Run the loop until req is answered or timed out. With tx_time, the kernel's
+ * transmit timestamp is taken if it is sane, or the time before sending.
+ */
+static int request_sync(struct ptrace_msg_ctx *ctx, struct ptrace_msg *req,
+        uint32_t flags, struct ptrace_msg **rsp_msg, uint32_t timeout_ms,
+        uint64_t *tx_time)
+{
+    uint64_t sent;
+    struct request_sync rs;
+    struct ptrace_msg_pending *p;
+
+    rs.done = 0;
+    rs.rsp = NULL;
 
-    rsp = ptrace_msg_recv(timeout_ms);
-    if (rsp && PTRACE_MSG_TYPE_RSP == rsp->type && req->sid == rsp->sid) {
-        rc = 0;
-        if (rsp_msg) {
-            *rsp_msg = rsp;
-            rsp = NULL;
+    if (tx_time)
+        flags |= PTRACE_MSG_REQ_TX_TIME;
+    sent = boot_ns();
+
+    p = pending_add(ctx, req, flags | PTRACE_MSG_REQ_OWN_RSP, timeout_ms,
+                    request_sync_cb, &rs);
+    if (!p)
+        return -1;
+
+    while (!rs.done) {
+        if (ptrace_msg_ctx_run(ctx, timeout_ms) < 0) {
+            pending_del(ctx, p);
+            return -1;
         }
     }
 
-    ptrace_msg_free(req);
-    if (rsp)
-        ptrace_msg_free(rsp);
+    if (!rs.rsp)
+        return -1;
 
-    return rc;
+    if (tx_time) {
+        errq_drain(ctx);
+        *tx_time = ctx->tx_time >= sent && ctx->tx_time <= rs.rsp->rx_time ?
+                   ctx->tx_time : sent;
+    }
+
+    if (rsp_msg)
+        *rsp_msg = rs.rsp;
+    else
+        ptrace_msg_free(rs.rsp);
+
+    return 0;
+}
+
+static int request_new(struct ptrace_msg_ctx *ctx, struct sockaddr_in *dest,
+        int msg_id, void *data, int data_len, uint32_t flags,
+        struct ptrace_msg **rsp_msg, uint32_t timeout_ms, uint64_t *tx_time)
+{
+    struct ptrace_msg *req;
+
+    req = ptrace_msg_alloc(data_len);
+    if (!req)
+        return -1;
+
+    req->id = msg_id;
+    memcpy(&req->dest, dest, sizeof(req->dest));
+    if (data)
+        memcpy(req->data, data, data_len);
+
+    return request_sync(ctx, req, flags, rsp_msg, timeout_ms, tx_time);
 }
 
-int ptrace_msg_reqeust2(struct ptrace_msg *req,
+int ptrace_msg_request(struct ptrace_msg_ctx *ctx, struct sockaddr_in *dest,
+        int msg_id, void *data, int data_len,
+        struct ptrace_msg **rsp_msg, uint32_t timeout_ms)
+{
+    return request_new(ctx, dest, msg_id, data, data_len, 0,
+                       rsp_msg, timeout_ms, NULL);
+}
+
+int ptrace_msg_request_once(struct ptrace_msg_ctx *ctx,
+        struct sockaddr_in *dest, int msg_id, void *data, int data_len,
+        struct ptrace_msg **rsp_msg, uint32_t timeout_ms, uint64_t *tx_time)
+{
+    return request_new(ctx, dest, msg_id, data, data_len, PTRACE_MSG_REQ_ONCE,
+                       rsp_msg, timeout_ms, tx_time);
+}
+
+int ptrace_msg_reqeust2(struct ptrace_msg_ctx *ctx, struct ptrace_msg *req,
                         struct ptrace_msg **rsp_msg, uint32_t timeout_ms)
 {
-    int rc = -1;
-    struct ptrace_msg *rsp;
-    
-    req->type = PTRACE_MSG_TYPE_REQ;
-    req->sid = g_session_id++;
-    ptrace_msg_send(req);
-
-    rsp = ptrace_msg_recv(timeout_ms);
-    if (rsp && PTRACE_MSG_TYPE_RSP == rsp->type && req->sid == rsp->sid) {
-        rc = 0;
-        if (rsp_msg) {
-            *rsp_msg = rsp;
-            rsp = NULL;
-        }
-    }
+    struct ptrace_msg *dup = ptrace_msg_dup(req);
 
-    if (rsp)
-        ptrace_msg_free(rsp);
+    if (!dup)
+        return -1;
 
-    return rc;
+    return request_sync(ctx, dup, 0, rsp_msg, timeout_ms, NULL);
 }
 
-int ptrace_msg_response(struct ptrace_msg *req, void *data, int data_len)
+static struct ptrace_msg_peer *peer_find(struct ptrace_msg_ctx *ctx,
+                                         const struct sockaddr_in *addr);
+
+int ptrace_msg_response(struct ptrace_msg_ctx *ctx, struct ptrace_msg *req,
+        void *data, int data_len)
 {
     int rc = -1;
     struct ptrace_msg *msg;
+    struct ptrace_msg_peer *peer;
+    std::map<uint32_t, struct ptrace_msg *>::iterator it;
 
     msg = ptrace_msg_alloc(data_len);
     if (msg) {
@@ -203,7 +836,17 @@ int ptrace_msg_response(struct ptrace_msg *req, void *data, int data_len)
         if (data)
             memcpy(msg->data, data, data_len);
 
-        rc = ptrace_msg_send(msg);
+        rc = ptrace_msg_send(ctx, msg);
+
+        /* kept to answer the retransmissions of req */
+        peer = peer_find(ctx, &req->src);
+        if (peer) {
+            it = peer->rsps.find(req->sid);
+            if (it != peer->rsps.end() && !it->second) {
+                it->second = msg;
+                msg = NULL;
+            }
+        }
 
         ptrace_msg_free(msg);
     }
@@ -211,35 +854,412 @@ int ptrace_msg_response(struct ptrace_msg *req, void *data, int data_len)
     return rc;
 }
 
-int ptrace_msg_init(struct sockaddr_in *local_addr)
+/*
+ * Listen on addr, port 0 means an ephemeral port. The port actually used is
+ * written back to addr.
+ */
+int ptrace_msg_tcp_listen(struct sockaddr_in *addr)
 {
-    int rc;
-    int sockfd;
+    int fd;
+    int opt = 1;
+    socklen_t addrlen = sizeof(*addr);
 
-    sockfd = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sockfd < 0) {
-        fprintf(stderr, "create socket failed, errno = %d\n", errno);
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        fprintf(stderr, "create tcp socket failed, errno = %d\n", errno);
+        return -1;
+    }
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+    addr->sin_family = AF_INET;
+    if (bind(fd, (struct sockaddr *)addr, sizeof(*addr)) < 0
+        || listen(fd, 1) < 0
+        || getsockname(fd, (struct sockaddr *)addr, &addrlen) < 0) {
+        fprintf(stderr, "listen tcp socket failed, errno = %d\n", errno);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int ptrace_msg_tcp_connect(struct sockaddr_in *dest)
+{
+    int fd;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        fprintf(stderr, "create tcp socket failed, errno = %d\n", errno);
+        return -1;
+    }
+
+    dest->sin_family = AF_INET; /* connect() with AF_UNSPEC disconnects */
+    if (connect(fd, (struct sockaddr *)dest, sizeof(*dest)) < 0) {
+        fprintf(stderr, "connect %s:%d failed, errno = %d\n",
+                inet_ntoa(dest->sin_addr), ntohs(dest->sin_port), errno);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static uint64_t conn_key(const struct sockaddr_in *addr)
+{
+    return ((uint64_t)addr->sin_addr.s_addr << 16) | addr->sin_port;
+}
+
+static struct ptrace_msg_peer *peer_find(struct ptrace_msg_ctx *ctx,
+                                         const struct sockaddr_in *addr)
+{
+    std::map<uint64_t, struct ptrace_msg_peer *>::iterator it;
+
+    it = ctx->conns.find(conn_key(addr));
+
+    return it != ctx->conns.end() ? it->second : NULL;
+}
+
+static struct ptrace_msg_peer *peer_get(struct ptrace_msg_ctx *ctx,
+                                        const struct sockaddr_in *addr)
+{
+    struct ptrace_msg_peer *peer;
+
+    peer = peer_find(ctx, addr);
+    if (peer)
+        return peer;
+
+    peer = new (std::nothrow) struct ptrace_msg_peer;
+    if (!peer) {
+        fprintf(stderr, "alloc conn failed\n");
+        return NULL;
+    }
+
+    memcpy(&peer->conn.addr, addr, sizeof(peer->conn.addr));
+    peer->conn.data = NULL;
+    ctx->conns[conn_key(addr)] = peer;
+
+    return peer;
+}
+
+void ptrace_msg_conn_del(struct ptrace_msg_ctx *ctx,
+        struct ptrace_msg_conn *conn)
+{
+    struct ptrace_msg_peer *peer;
+    std::map<uint32_t, struct ptrace_msg *>::iterator it;
+
+    peer = peer_find(ctx, &conn->addr);
+    if (!peer)
+        return;
+
+    ctx->conns.erase(conn_key(&conn->addr));
+
+    if (ctx->on_conn_free)
+        ctx->on_conn_free(ctx, &peer->conn, ctx->arg);
+
+    for (it = peer->rsps.begin(); it != peer->rsps.end(); ++it)
+        ptrace_msg_free(it->second);
+    delete peer;
+}
+
+void ptrace_msg_ctx_set_handler(struct ptrace_msg_ctx *ctx,
+        ptrace_msg_handler_t on_msg, ptrace_msg_conn_free_t on_conn_free,
+        void *arg)
+{
+    ctx->on_msg = on_msg;
+    ctx->on_conn_free = on_conn_free;
+    ctx->arg = arg;
+}
+
+int ptrace_msg_ctx_add_fd(struct ptrace_msg_ctx *ctx, int fd,
+        uint32_t events, ptrace_msg_fd_cb_t cb, void *arg)
+{
+    struct epoll_event ev;
+    struct ptrace_msg_fd *mfd;
+
+    mfd = (struct ptrace_msg_fd *)malloc(sizeof(*mfd));
+    if (!mfd)
+        return -1;
+
+    mfd->fd = fd;
+    mfd->cb = cb;
+    mfd->arg = arg;
+
+    ev.events = events;
+    ev.data.ptr = mfd;
+    if (epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        fprintf(stderr, "add fd %d to epoll failed, errno = %d\n", fd, errno);
+        free(mfd);
+        return -1;
+    }
+
+    ctx->fds[fd] = mfd;
+
+    return 0;
+}
+
+int ptrace_msg_ctx_del_fd(struct ptrace_msg_ctx *ctx, int fd)
+{
+    struct ptrace_msg_fd *mfd;
+    std::map<int, struct ptrace_msg_fd *>::iterator it;
+
+    it = ctx->fds.find(fd);
+    if (it == ctx->fds.end())
+        return -1;
+
+    mfd = it->second;
+    ctx->fds.erase(it);
+    epoll_ctl(ctx->epfd, EPOLL_CTL_DEL, fd, NULL);
+
+    /* events of this fd may still be pending in the current dispatch */
+    mfd->cb = NULL;
+    ctx->dead_fds.push_back(mfd);
+
+    return 0;
+}
+
+/*
+ * Returns 1 if req is a retransmission, its response (if any) is sent again.
+ * Otherwise a slot is reserved for the response.
+ */
+static int peer_dup_req(struct ptrace_msg_ctx *ctx,
+                        struct ptrace_msg_peer *peer, struct ptrace_msg *req)
+{
+    std::map<uint32_t, struct ptrace_msg *>::iterator it;
+
+    /* the peer restarted on the same address, its old responses are stale */
+    if (!peer->rsps.empty()
+        && (req->sid + PTRACE_MSG_SID_WINDOW < peer->rsps.begin()->first
+            || req->sid > peer->rsps.rbegin()->first + PTRACE_MSG_SID_WINDOW)) {
+        for (it = peer->rsps.begin(); it != peer->rsps.end(); ++it)
+            ptrace_msg_free(it->second);
+        peer->rsps.clear();
+    }
+
+    it = peer->rsps.find(req->sid);
+    if (it != peer->rsps.end()) {
+        if (it->second)
+            ptrace_msg_send(ctx, it->second);
+        return 1;
+    }
+
+    /* older than any response kept, must have been answered already */
+    if (peer->rsps.size() >= PTRACE_MSG_RSP_CACHE) {
+        it = peer->rsps.begin();
+        if (req->sid < it->first)
+            return 1;
+        ptrace_msg_free(it->second);
+        peer->rsps.erase(it);
+    }
+
+    peer->rsps[req->sid] = NULL;
+
+    return 0;
+}
+
+/* hand the received messages to the handler, one batch per wakeup */
+static void ctx_dispatch(struct ptrace_msg_ctx *ctx)
+{
+    struct ptrace_msg *msg;
+    struct ptrace_msg_peer *peer;
+
+    if (ctx->recv_next >= ctx->recv_cnt && recv_fill(ctx, 0) <= 0)
+        return;
+
+    while (ctx->recv_next < ctx->recv_cnt) {
+        msg = ctx->recv_msgs[ctx->recv_next++];
+        if (!ctx->on_msg)
+            continue;
+
+        peer = peer_get(ctx, &msg->src);
+        if (!peer)
+            continue;
+
+        if (PTRACE_MSG_TYPE_REQ == msg->type && peer_dup_req(ctx, peer, msg))
+            continue;
+
+        ctx->on_msg(ctx, &peer->conn, msg, ctx->arg);
+    }
+}
+
+int ptrace_msg_ctx_run(struct ptrace_msg_ctx *ctx, uint32_t timeout_ms)
+{
+    int i, n;
+    size_t j;
+    struct ptrace_msg_fd *mfd;
+    struct epoll_event events[PTRACE_MSG_EPOLL_EVENTS];
+
+    n = epoll_wait(ctx->epfd, events, PTRACE_MSG_EPOLL_EVENTS,
+                   pending_wait(ctx, timeout_ms));
+    if (n < 0) {
+        if (EINTR == errno)
+            return 0;
+        fprintf(stderr, "epoll wait failed, errno = %d\n", errno);
         return -1;
     }
 
+    for (i = 0; i < n; i++) {
+        mfd = (struct ptrace_msg_fd *)events[i].data.ptr;
+        if (!mfd) {
+            /* transmit timestamps wake the loop up until they are read */
+            if (events[i].events & EPOLLERR)
+                errq_drain(ctx);
+            ctx_dispatch(ctx);
+        }
+        else if (mfd->cb)
+            mfd->cb(ctx, mfd->fd, events[i].events, mfd->arg);
+    }
+
+    for (j = 0; j < ctx->dead_fds.size(); j++)
+        free(ctx->dead_fds[j]);
+    ctx->dead_fds.clear();
+
+    pending_timer(ctx);
+
+    return n;
+}
+
+struct ptrace_msg_ctx *ptrace_msg_ctx_create(struct sockaddr_in *local_addr)
+{
+    int i, rc;
+    int bufsize;
+    uint32_t tsflags;
+    struct epoll_event ev;
+    struct ptrace_msg_ctx *ctx;
+
+    ctx = new (std::nothrow) struct ptrace_msg_ctx;
+    if (!ctx) {
+        fprintf(stderr, "alloc msg context failed\n");
+        return NULL;
+    }
+
+    ctx->session_id = session_seed();
+    ctx->ops = &g_sys_sock_ops;
+    ctx->ops_priv = NULL;
+    ctx->on_msg = NULL;
+    ctx->on_conn_free = NULL;
+    ctx->arg = NULL;
+    ctx->epfd = -1;
+    ctx->tx_time = 0;
+    memset(ctx->recv_buff, 0, sizeof(ctx->recv_buff));
+
+    ctx->sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (ctx->sockfd < 0) {
+        fprintf(stderr, "create socket failed, errno = %d\n", errno);
+        delete ctx;
+        return NULL;
+    }
+
+    /* room for a whole file transfer window */
+    bufsize = PTRACE_MSG_SOCK_BUFF_SIZE;
+    setsockopt(ctx->sockfd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+    setsockopt(ctx->sockfd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+
+    /*
+     * Kernel receive timestamps, free of the wakeup latency of the receiver.
+     * Transmit ones are asked for by each probe, only the timestamp is
+     * looped back. Without them the time of the system call is used.
+     */
+    tsflags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE
+              | SOF_TIMESTAMPING_OPT_TSONLY;
+    setsockopt(ctx->sockfd, SOL_SOCKET, SO_TIMESTAMPING,
+               &tsflags, sizeof(tsflags));
+
     if (local_addr) {
-        rc = bind(sockfd, (struct sockaddr *)local_addr, sizeof(*local_addr));
+        rc = bind(ctx->sockfd, (struct sockaddr *)local_addr,
+                  sizeof(*local_addr));
         if (rc < 0) {
             fprintf(stderr, "bind socket failed, errno = %d\n", errno);
-            close(sockfd);
-            return -1;
+            goto _err;
         }
     }
 
-    g_sockfd = sockfd;
+    ctx->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (ctx->epfd < 0) {
+        fprintf(stderr, "create epoll failed, errno = %d\n", errno);
+        goto _err;
+    }
 
-    return 0;
+    /* the message socket is the only one with a NULL data.ptr */
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, ctx->sockfd, &ev) < 0) {
+        fprintf(stderr, "add socket to epoll failed, errno = %d\n", errno);
+        goto _err;
+    }
+
+    memset(ctx->recv_mmsg, 0, sizeof(ctx->recv_mmsg));
+    for (i = 0; i < PTRACE_MSG_BATCH; i++) {
+        ctx->recv_buff[i] = ptrace_msg_alloc(PTRACE_MSG_BUFF_SIZE
+                                             - sizeof(struct ptrace_msg));
+        if (!ctx->recv_buff[i])
+            goto _err;
+        ctx->recv_iov[i].iov_base = ctx->recv_buff[i];
+        ctx->recv_iov[i].iov_len = PTRACE_MSG_BUFF_SIZE;
+        ctx->recv_mmsg[i].msg_hdr.msg_name = &ctx->recv_addr[i];
+        ctx->recv_mmsg[i].msg_hdr.msg_iov = &ctx->recv_iov[i];
+        ctx->recv_mmsg[i].msg_hdr.msg_iovlen = 1;
+        ctx->recv_mmsg[i].msg_hdr.msg_control = ctx->recv_ctrl[i];
+    }
+    ctx->recv_cnt = ctx->recv_next = 0;
+
+    return ctx;
+
+_err:
+    for (i = 0; i < PTRACE_MSG_BATCH; i++)
+        ptrace_msg_free(ctx->recv_buff[i]);
+    if (ctx->epfd >= 0)
+        close(ctx->epfd);
+    close(ctx->sockfd);
+    delete ctx;
+
+    return NULL;
 }
 
-void ptrace_msg_destroy(void)
+int ptrace_msg_ctx_local_addr(struct ptrace_msg_ctx *ctx,
+        struct sockaddr_in *addr)
 {
-    if (g_sockfd > 0) {
-        close(g_sockfd);
-        g_sockfd = -1;
+    socklen_t addrlen = sizeof(*addr);
+
+    if (getsockname(ctx->sockfd, (struct sockaddr *)addr, &addrlen) < 0) {
+        fprintf(stderr, "get socket name failed, errno = %d\n", errno);
+        return -1;
     }
+
+    return 0;
+}
+
+void ptrace_msg_ctx_set_sock_ops(struct ptrace_msg_ctx *ctx,
+        const struct ptrace_msg_sock_ops *ops, void *priv)
+{
+    ctx->ops = ops ? ops : &g_sys_sock_ops;
+    ctx->ops_priv = ops ? priv : NULL;
+}
+
+void ptrace_msg_ctx_destroy(struct ptrace_msg_ctx *ctx)
+{
+    size_t i;
+    std::map<int, struct ptrace_msg_fd *>::iterator it;
+
+    if (!ctx)
+        return;
+
+    while (!ctx->conns.empty())
+        ptrace_msg_conn_del(ctx, &ctx->conns.begin()->second->conn);
+
+    /* nobody waits for these any more */
+    while (!ctx->pending.empty())
+        pending_del(ctx, ctx->pending.begin()->second);
+
+    for (it = ctx->fds.begin(); it != ctx->fds.end(); ++it)
+        free(it->second);
+    for (i = 0; i < ctx->dead_fds.size(); i++)
+        free(ctx->dead_fds[i]);
+    for (i = 0; i < PTRACE_MSG_BATCH; i++)
+        ptrace_msg_free(ctx->recv_buff[i]);
+
+    close(ctx->epfd);
+    close(ctx->sockfd);
+
+    delete ctx;
 }
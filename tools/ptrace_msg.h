@@ -2,6 +2,7 @@
 #define __PTRACE_MSG_H__
 
 #include <stdint.h>
+#include <sys/socket.h>
 #include <netinet/in.h>
 
 enum ptrace_msg_type_e {
@@ -13,38 +14,149 @@ enum ptrace_msg_type_e {
 struct ptrace_msg {
     struct sockaddr_in dest;
     struct sockaddr_in src;
+    uint64_t rx_time;       /* boot time it was received, set on receive */
     uint8_t type;           /* type */
-    uint8_t sid;            /* session id */
     uint8_t id;             /* message id */
+    uint32_t sid;           /* session id */
     uint32_t data_len;
     char data[0];
 };
 
+#define PTRACE_MSG_BUFF_SIZE    8192    /* max datagram size */
+#define PTRACE_MSG_BATCH        64      /* max messages per batch syscall */
+
 #define PTRACE_MSG_DATA_PTR(msg, type)  ((type *)(msg->data))
 #define PTRACE_MSG_DATA(msg, type)      (*PTRACE_MSG_DATA_PTR(msg, type))
 
+/*
+ * A context owns a UDP socket, its receive buffers and an epoll loop. It is
+ * driven by one thread, which also makes the requests and responses. Sending
+ * other messages is thread-safe and so is using different contexts from
+ * different threads.
+ */
+struct ptrace_msg_ctx;
+
+/* per peer state, created when the first message arrives from a peer */
+struct ptrace_msg_conn {
+    struct sockaddr_in addr;
+    void *data;             /* owned by the message handler */
+};
+
+/*
+ * msg points into the receive buffers and is only valid during the call,
+ * the handler must not receive from the same context nor wait for a response.
+ * A request retransmitted by the peer is not passed again, the response
+ * already sent is repeated instead.
+ */
+typedef void (*ptrace_msg_handler_t)(struct ptrace_msg_ctx *ctx,
+        struct ptrace_msg_conn *conn, struct ptrace_msg *msg, void *arg);
+typedef void (*ptrace_msg_conn_free_t)(struct ptrace_msg_ctx *ctx,
+        struct ptrace_msg_conn *conn, void *arg);
+typedef void (*ptrace_msg_fd_cb_t)(struct ptrace_msg_ctx *ctx,
+        int fd, uint32_t events, void *arg);
+/* rsp is NULL on timeout, like msg above it is only valid during the call */
+typedef void (*ptrace_msg_rsp_cb_t)(struct ptrace_msg_ctx *ctx,
+        struct ptrace_msg *req, struct ptrace_msg *rsp, void *arg);
+
 extern struct ptrace_msg *ptrace_msg_alloc(uint32_t data_len);
 extern struct ptrace_msg *ptrace_msg_dup(const struct ptrace_msg *msg);
 extern void ptrace_msg_free(struct ptrace_msg *msg);
 extern uint32_t ptrace_msg_size(const struct ptrace_msg *msg);
 
-extern int ptrace_msg_send(struct ptrace_msg *msg);
-extern struct ptrace_msg *ptrace_msg_recv(uint32_t timeout_ms);
+extern int ptrace_msg_send(struct ptrace_msg_ctx *ctx, struct ptrace_msg *msg);
+extern struct ptrace_msg *ptrace_msg_recv(struct ptrace_msg_ctx *ctx,
+        uint32_t timeout_ms);
 
-extern int ptrace_msg_notify(struct sockaddr_in *dest,
-        uint8_t msg_id, void *data, int data_len);
+/*
+ * Send up to cnt messages by sendmmsg(). The received messages point into
+ * the receive buffers, they must not be freed and are only valid until the
+ * next receive. Responses are never returned by the receive functions, they
+ * are passed to the request they answer.
+ */
+extern int ptrace_msg_send_batch(struct ptrace_msg_ctx *ctx,
+        struct ptrace_msg **msgs, int cnt);
+extern int ptrace_msg_recv_batch(struct ptrace_msg_ctx *ctx,
+        struct ptrace_msg **msgs, int max, uint32_t timeout_ms);
 
-extern int ptrace_msg_request(struct sockaddr_in *dest,
-        int msg_id, void *data, int data_len,
-        struct ptrace_msg **rsp_msg, uint32_t timeout_ms);
-extern int ptrace_msg_reqeust2(struct ptrace_msg *req,
+extern int ptrace_msg_notify(struct ptrace_msg_ctx *ctx,
+        struct sockaddr_in *dest, uint8_t msg_id, void *data, int data_len);
+
+#define PTRACE_MSG_REQ_ONCE     0x1     /* do not retransmit */
+
+/*
+ * Send a request and call cb with its response or on timeout. The request
+ * is retransmitted with exponential backoff until then, any number of them
+ * can be in flight.
+ */
+extern int ptrace_msg_request_async(struct ptrace_msg_ctx *ctx,
+        struct sockaddr_in *dest, int msg_id, void *data, int data_len,
+        uint32_t flags, uint32_t timeout_ms, ptrace_msg_rsp_cb_t cb,
+        void *arg);
+
+/* the same, but wait for the response, which is freed by the caller */
+extern int ptrace_msg_request(struct ptrace_msg_ctx *ctx,
+        struct sockaddr_in *dest, int msg_id, void *data, int data_len,
         struct ptrace_msg **rsp_msg, uint32_t timeout_ms);
+extern int ptrace_msg_reqeust2(struct ptrace_msg_ctx *ctx,
+        struct ptrace_msg *req, struct ptrace_msg **rsp_msg,
+        uint32_t timeout_ms);
+
+/*
+ * Sent only once, for probes whose round trip time is measured. *tx_time is
+ * the boot time the request was sent and (*rsp_msg)->rx_time the one its
+ * response was received. Both are the kernel's timestamps if it gives them,
+ * otherwise taken in user space around the system calls.
+ */
+extern int ptrace_msg_request_once(struct ptrace_msg_ctx *ctx,
+        struct sockaddr_in *dest, int msg_id, void *data, int data_len,
+        struct ptrace_msg **rsp_msg, uint32_t timeout_ms, uint64_t *tx_time);
+
+extern int ptrace_msg_response(struct ptrace_msg_ctx *ctx,
+        struct ptrace_msg *req, void *data, int data_len);
+
+extern int ptrace_msg_tcp_listen(struct sockaddr_in *addr);
+extern int ptrace_msg_tcp_connect(struct sockaddr_in *dest);
+
+extern struct ptrace_msg_ctx *ptrace_msg_ctx_create(
+        struct sockaddr_in *local_addr);
+extern void ptrace_msg_ctx_destroy(struct ptrace_msg_ctx *ctx);
+extern int ptrace_msg_ctx_local_addr(struct ptrace_msg_ctx *ctx,
+        struct sockaddr_in *addr);
+
+/*
+ * The datagram calls of a context, they return like sendmmsg()/recvmmsg()
+ * and can be replaced to run the protocol over an emulated network. The
+ * socket stays in the context's epoll loop, so a replacement must still
+ * deliver through it.
+ */
+struct ptrace_msg_sock_ops {
+    int (*sendmmsg)(void *priv, int sockfd, struct mmsghdr *msgs,
+                    unsigned int vlen, int flags);
+    int (*recvmmsg)(void *priv, int sockfd, struct mmsghdr *msgs,
+                    unsigned int vlen, int flags);
+};
+
+/* NULL ops restores the system calls */
+extern void ptrace_msg_ctx_set_sock_ops(struct ptrace_msg_ctx *ctx,
+        const struct ptrace_msg_sock_ops *ops, void *priv);
+
+/* messages received by ptrace_msg_ctx_run() are passed to on_msg */
+extern void ptrace_msg_ctx_set_handler(struct ptrace_msg_ctx *ctx,
+        ptrace_msg_handler_t on_msg, ptrace_msg_conn_free_t on_conn_free,
+        void *arg);
+extern void ptrace_msg_conn_del(struct ptrace_msg_ctx *ctx,
+        struct ptrace_msg_conn *conn);
 
-extern int ptrace_msg_response(struct ptrace_msg *req,
-        void *data, int data_len);
+/* watch other fds (EPOLLIN/EPOLLOUT...) in the same loop */
+extern int ptrace_msg_ctx_add_fd(struct ptrace_msg_ctx *ctx, int fd,
+        uint32_t events, ptrace_msg_fd_cb_t cb, void *arg);
+extern int ptrace_msg_ctx_del_fd(struct ptrace_msg_ctx *ctx, int fd);
 
-extern int ptrace_msg_init(struct sockaddr_in *local_addr);
-extern void ptrace_msg_destroy(void);
+/*
+ * Wait at most timeout_ms and dispatch the events and request timers,
+ * returns -1 on error.
+ */
+extern int ptrace_msg_ctx_run(struct ptrace_msg_ctx *ctx, uint32_t timeout_ms);
 
 #endif /* __PTRACE_MSG_H__ */
 
@@ -0,0 +1,287 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <errno.h>
+
+#include <map>
+#include <new>
+
+#include "ptrace_netem.h"
+
+#define NETEM_LIMIT_DEFAULT 1000
+
+struct netem_pkt {
+    int sockfd;
+    struct sockaddr_in dest;
+    uint32_t len;
+    char data[0];
+};
+
+struct ptrace_netem {
+    struct ptrace_netem_cfg cfg;
+    struct ptrace_msg_ctx *ctx;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int stop;
+    unsigned int seed;
+    uint64_t link_free_ns;          /* the link is busy until then */
+    std::multimap<uint64_t, struct netem_pkt *> queue;  /* by delivery time */
+};
+
+static uint64_t netem_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* [0, 1) */
+static double netem_rand(struct ptrace_netem *ne)
+{
+    return (double)rand_r(&ne->seed) / ((double)RAND_MAX + 1.0);
+}
+
+/* called with the lock held */
+static void netem_enqueue(struct ptrace_netem *ne, struct netem_pkt *pkt)
+{
+    int64_t delay;
+    uint64_t now = netem_now_ns(), due;
+
+    if (netem_rand(ne) < ne->cfg.loss || ne->queue.size() >= ne->cfg.limit) {
+        free(pkt);
+        return;
+    }
+
+    /* serialized on the link first, then in flight */
+    if (ne->link_free_ns < now)
+        ne->link_free_ns = now;
+    if (ne->cfg.rate_bps)
+        ne->link_free_ns += (uint64_t)pkt->len * 8 * 1000000000
+                            / ne->cfg.rate_bps;
+    due = ne->link_free_ns;
+
+    if (!(netem_rand(ne) < ne->cfg.reorder)) {
+        delay = (int64_t)ne->cfg.delay_us * 1000;
+        if (ne->cfg.jitter_us)
+            delay += (int64_t)((2.0 * netem_rand(ne) - 1.0)
+                               * ne->cfg.jitter_us * 1000);
+        if (delay > 0)
+            due += delay;
+    }
+
+    ne->queue.insert(std::make_pair(due, pkt));
+    pthread_cond_signal(&ne->cond);
+}
+
+static int netem_sendmmsg(void *priv, int sockfd, struct mmsghdr *msgs,
+                          unsigned int vlen, int flags)
+{
+    unsigned int i;
+    size_t j, len;
+    struct msghdr *hdr;
+    struct netem_pkt *pkt;
+    struct ptrace_netem *ne = (struct ptrace_netem *)priv;
+
+    for (i = 0; i < vlen; i++) {
+        hdr = &msgs[i].msg_hdr;
+        for (j = 0, len = 0; j < hdr->msg_iovlen; j++)
+            len += hdr->msg_iov[j].iov_len;
+
+        pkt = (struct netem_pkt *)malloc(sizeof(*pkt) + len);
+        if (!pkt) {
+            errno = ENOBUFS;
+            return i ? (int)i : -1;
+        }
+
+        pkt->sockfd = sockfd;
+        memcpy(&pkt->dest, hdr->msg_name, sizeof(pkt->dest));
+        pkt->len = len;
+        for (j = 0, len = 0; j < hdr->msg_iovlen; j++) {
+            memcpy(pkt->data + len, hdr->msg_iov[j].iov_base,
+                   hdr->msg_iov[j].iov_len);
+            len += hdr->msg_iov[j].iov_len;
+        }
+        msgs[i].msg_len = len;
+
+        pthread_mutex_lock(&ne->lock);
+        netem_enqueue(ne, pkt);
+        pthread_mutex_unlock(&ne->lock);
+    }
+
+    return vlen;
+}
+
+static int netem_recvmmsg(void *priv, int sockfd, struct mmsghdr *msgs,
+                          unsigned int vlen, int flags)
+{
+    return recvmmsg(sockfd, msgs, vlen, flags, NULL);
+}
+
+static const struct ptrace_msg_sock_ops g_netem_ops = {
+    netem_sendmmsg,
+    netem_recvmmsg,
+};
+
+/* deliver the queued datagrams when they are due */
+static void *netem_thread(void *arg)
+{
+    uint64_t now, due;
+    struct timespec ts;
+    struct netem_pkt *pkt;
+    struct ptrace_netem *ne = (struct ptrace_netem *)arg;
+
+    pthread_mutex_lock(&ne->lock);
+    while (!ne->stop) {
+        if (ne->queue.empty()) {
+            pthread_cond_wait(&ne->cond, &ne->lock);
+            continue;
+        }
+
+        due = ne->queue.begin()->first;
+        now = netem_now_ns();
+        if (due > now) {
+            ts.tv_sec = due / 1000000000;
+            ts.tv_nsec = due % 1000000000;
+            pthread_cond_timedwait(&ne->cond, &ne->lock, &ts);
+            continue;
+        }
+
+        pkt = ne->queue.begin()->second;
+        ne->queue.erase(ne->queue.begin());
+        pthread_mutex_unlock(&ne->lock);
+
+        sendto(pkt->sockfd, pkt->data, pkt->len, 0,
+               (struct sockaddr *)&pkt->dest, sizeof(pkt->dest));
+        free(pkt);
+
+        pthread_mutex_lock(&ne->lock);
+    }
+    pthread_mutex_unlock(&ne->lock);
+
+    return NULL;
+}
+
+int ptrace_netem_parse(const char *spec, struct ptrace_netem_cfg *cfg)
+{
+    char buf[256];
+    char *key, *val, *save = NULL;
+    double v;
+
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->limit = NETEM_LIMIT_DEFAULT;
+
+    snprintf(buf, sizeof(buf), "%s", spec);
+    for (key = strtok_r(buf, ",", &save); key;
+         key = strtok_r(NULL, ",", &save)) {
+        val = strchr(key, '=');
+        if (!val) {
+            fprintf(stderr, "invalid netem option: %s\n", key);
+            return -1;
+        }
+        *val++ = '\0';
+
+        v = strtod(val, &val);
+        if ('\0' != *val || v < 0) {
+            fprintf(stderr, "invalid netem value: %s\n", key);
+            return -1;
+        }
+
+        if (0 == strcmp(key, "delay")) {
+            cfg->delay_us = v * 1000;
+        } else if (0 == strcmp(key, "jitter")) {
+            cfg->jitter_us = v * 1000;
+        } else if (0 == strcmp(key, "loss")) {
+            cfg->loss = v / 100;
+        } else if (0 == strcmp(key, "reorder")) {
+            cfg->reorder = v / 100;
+        } else if (0 == strcmp(key, "rate")) {
+            cfg->rate_bps = v * 1000000;
+        } else if (0 == strcmp(key, "limit")) {
+            cfg->limit = v;
+        } else {
+            fprintf(stderr, "invalid netem option: %s\n", key);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void ptrace_netem_print(const struct ptrace_netem_cfg *cfg,
+                        char *buf, size_t size)
+{
+    snprintf(buf, size, "delay %.1fms, jitter %.1fms, loss %.1f%%, "
+             "reorder %.1f%%, rate %.0fMbit/s, limit %u",
+             cfg->delay_us / 1000.0, cfg->jitter_us / 1000.0,
+             cfg->loss * 100, cfg->reorder * 100,
+             cfg->rate_bps / 1000000.0, cfg->limit);
+}
+
+struct ptrace_netem *ptrace_netem_create(const struct ptrace_netem_cfg *cfg,
+                                         struct ptrace_msg_ctx *ctx)
+{
+    pthread_condattr_t attr;
+    struct ptrace_netem *ne;
+
+    ne = new (std::nothrow) struct ptrace_netem;
+    if (!ne) {
+        fprintf(stderr, "alloc netem failed\n");
+        return NULL;
+    }
+
+    memcpy(&ne->cfg, cfg, sizeof(ne->cfg));
+    ne->ctx = ctx;
+    ne->stop = 0;
+    ne->seed = (unsigned int)netem_now_ns();
+    ne->link_free_ns = 0;
+
+    pthread_mutex_init(&ne->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ne->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&ne->thread, NULL, netem_thread, ne)) {
+        fprintf(stderr, "create netem thread failed\n");
+        pthread_cond_destroy(&ne->cond);
+        pthread_mutex_destroy(&ne->lock);
+        delete ne;
+        return NULL;
+    }
+
+    ptrace_msg_ctx_set_sock_ops(ctx, &g_netem_ops, ne);
+
+    return ne;
+}
+
+void ptrace_netem_destroy(struct ptrace_netem *ne)
+{
+    std::multimap<uint64_t, struct netem_pkt *>::iterator it;
+
+    if (!ne)
+        return;
+
+    ptrace_msg_ctx_set_sock_ops(ne->ctx, NULL, NULL);
+
+    pthread_mutex_lock(&ne->lock);
+    ne->stop = 1;
+    pthread_cond_signal(&ne->cond);
+    pthread_mutex_unlock(&ne->lock);
+    pthread_join(ne->thread, NULL);
+
+    /* what is still in flight is lost */
+    for (it = ne->queue.begin(); it != ne->queue.end(); ++it)
+        free(it->second);
+
+    pthread_cond_destroy(&ne->cond);
+    pthread_mutex_destroy(&ne->lock);
+    delete ne;
+}
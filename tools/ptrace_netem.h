@@ -0,0 +1,41 @@
+#ifndef __PTRACE_NETEM_H__
+#define __PTRACE_NETEM_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "ptrace_msg.h"
+
+/*
+ * A network emulator for the datagrams of a message context, like a tiny
+ * netem(8): sent datagrams are queued and delivered later by a thread, so
+ * two contexts on loopback see a slow, lossy link between them.
+ */
+struct ptrace_netem_cfg {
+    uint32_t delay_us;      /* one-way delay */
+    uint32_t jitter_us;     /* the delay varies by up to +/- jitter */
+    double loss;            /* probability a datagram is dropped */
+    double reorder;         /* probability a datagram skips the delay */
+    uint64_t rate_bps;      /* link bandwidth in bits/s, 0: unlimited */
+    uint32_t limit;         /* max datagrams queued, more are dropped */
+};
+
+struct ptrace_netem;
+
+/*
+ * spec: "delay=<ms>,jitter=<ms>,loss=<%>,reorder=<%>,rate=<Mbit/s>,
+ * limit=<datagrams>", every key is optional.
+ */
+extern int ptrace_netem_parse(const char *spec, struct ptrace_netem_cfg *cfg);
+extern void ptrace_netem_print(const struct ptrace_netem_cfg *cfg,
+                               char *buf, size_t size);
+
+/*
+ * Emulate the sending direction of ctx. Destroy it before ctx, while ctx
+ * is not sending.
+ */
+extern struct ptrace_netem *ptrace_netem_create(
+        const struct ptrace_netem_cfg *cfg, struct ptrace_msg_ctx *ctx);
+extern void ptrace_netem_destroy(struct ptrace_netem *ne);
+
+#endif /* __PTRACE_NETEM_H__ */